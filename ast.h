@@ -7,186 +7,307 @@
 #ifndef AST_H
 #define AST_H
 
+#include "token.h"
 #include<string>
 #include<vector>
 #include<iostream>
 #include<cstring>
+#include<memory>
+#include<mutex>
+#include<new>
+#include<utility>
+#include<type_traits>
+#include<cstdint>
+
+// 节点的种类，编译器按它 switch 分派，不用逐个 dynamic_cast
+enum ExprKind {
+    EXPR_LITERAL,
+    EXPR_VARIABLE,
+    EXPR_STRING,
+    EXPR_BINARY,
+    EXPR_CALL,
+    EXPR_UNARY,
+    EXPR_ASSIGN,
+    EXPR_ARRAY,
+    EXPR_INDEX,
+    EXPR_INDEX_ASSIGN,
+};
+
+enum StmtKind {
+    STMT_IF,
+    STMT_FOR,
+    STMT_WHILE,
+    STMT_LET,
+    STMT_FUNC,
+    STMT_RETURN,
+    STMT_EXPR,
+    STMT_BREAK,
+    STMT_CONTINUE,
+};
 
+// 所有节点都由 AstArena 分配，子节点跟着整个 arena 一起释放，所以节点不会 delete 它的子节点
+// 分派只看 kind，节点也就不需要虚函数表
 class Expr {
 public:
-    virtual ~Expr() {}
+    const ExprKind kind;
+
+    explicit Expr(ExprKind k) : kind(k) {}
 };
 
 class Stmt {
 public:
-    virtual ~Stmt() {}
+    const StmtKind kind;
+
+    explicit Stmt(StmtKind k) : kind(k) {}
 };
 
-class Block{
+// 按 kind 向下转换，代替 dynamic_cast：node 为 NULL 或者种类不对时返回 NULL
+template<class T, class Node>
+T *ast_cast(Node *node) {
+    return node != NULL && node->kind == T::KIND ? static_cast<T *>(node) : NULL;
+}
+
+// AST 节点的分配器：节点从 64KB 的大块内存中按顺序切出来，同一棵树的节点在内存中是连续的，
+// 解析时不再有大量零散的小块 new，释放时也不用递归地 delete，整棵树随 AstArena 一起释放
+// 只有带 std::string / std::vector 成员的节点需要调用析构函数，记在 __cleanups__ 中
+class AstArena {
+    struct Cleanup {
+        void (*destroy)(void *);
+        void *node;
+    };
+
+    static const size_t BLOCK_SIZE = 64 * 1024;
+
+    std::vector<char *> __blocks__;
+    std::vector<Cleanup> __cleanups__;
+    char *__ptr__, *__end__;
+
+    template<class T>
+    static void destroy(void *node) { static_cast<T *>(node)->~T(); }
+
+    void *allocate(size_t size, size_t align) {
+        size_t pad = (align - reinterpret_cast<uintptr_t>(__ptr__) % align) % align;
+        if (__ptr__ == NULL || pad + size > static_cast<size_t>(__end__ - __ptr__)) {
+            size_t n = size + align > BLOCK_SIZE ? size + align : BLOCK_SIZE;
+            __blocks__.push_back(static_cast<char *>(::operator new(n)));
+            __ptr__ = __blocks__.back();
+            __end__ = __ptr__ + n;
+            pad = (align - reinterpret_cast<uintptr_t>(__ptr__) % align) % align;
+        }
+        void *p = __ptr__ + pad;
+        __ptr__ += pad + size;
+        return p;
+    }
+
 public:
-    std::vector<Stmt*> statements;
-    ~Block() {
-        for(size_t i = 0; i < statements.size(); i++) {
-            delete statements[i];
+    AstArena() : __ptr__(NULL), __end__(NULL) {}
+    AstArena(const AstArena &) = delete;
+    AstArena &operator=(const AstArena &) = delete;
+
+    ~AstArena() {
+        for (size_t i = __cleanups__.size(); i-- > 0; ) __cleanups__[i].destroy(__cleanups__[i].node);
+        for (size_t i = 0; i < __blocks__.size(); i++) ::operator delete(__blocks__[i]);
+    }
+
+    template<class T, class... Args>
+    T *make(Args&&... args) {
+        T *node = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        if (!std::is_trivially_destructible<T>::value) {
+            Cleanup c = { &AstArena::destroy<T>, node };
+            __cleanups__.push_back(c);
         }
+        return node;
     }
 };
 
+class Block{
+public:
+    std::vector<Stmt*> statements;
+};
+
 class LiteralExpr : public Expr {
 public:
+    static const ExprKind KIND = EXPR_LITERAL;
+
     double value;
+    bool is_int;       // 不带小数点的数字字面量是 64 位整数
+    long long ivalue;
 
-    LiteralExpr(double v) : value(v) {}
+    LiteralExpr(double v) : Expr(KIND), value(v), is_int(false), ivalue(0) {}
+    LiteralExpr(long long i) : Expr(KIND), value(static_cast<double>(i)), is_int(true), ivalue(i) {}
 };
 
 class VariableExpr : public Expr {
 public:
+    static const ExprKind KIND = EXPR_VARIABLE;
+
     std::string name;
 
-    VariableExpr(const std::string &n) : name(n) {}
+    VariableExpr(const std::string &n) : Expr(KIND), name(n) {}
 };
 
 class StringExpr : public Expr{
 public:
+    static const ExprKind KIND = EXPR_STRING;
+
     std::string str;
     
-    StringExpr(const std::string &s) : str(s) {}
+    StringExpr(const std::string &s) : Expr(KIND), str(s) {}
 };
 
 class BinaryExpr : public Expr {
 public:
+    static const ExprKind KIND = EXPR_BINARY;
+
     Expr *left, *right;
     std::string op;
-    BinaryExpr(Expr *l, std::string o, Expr *r) : left(l), op(o), right(r) {};
-    ~BinaryExpr() {
-        delete left;
-        delete right;
-    }
+    BinaryExpr(Expr *l, std::string o, Expr *r) : Expr(KIND), left(l), right(r), op(std::move(o)) {};
 };
 
 class CallExpr : public Expr {
 public:
+    static const ExprKind KIND = EXPR_CALL;
+
     Expr *callee;
     std::vector<Expr *> arguments;
-    CallExpr(Expr* call, std::vector<Expr *> args) : callee(call), arguments(args) {}
-    ~CallExpr() {
-        delete callee;
-        for(size_t i = 0; i < arguments.size(); i++) delete arguments[i];
-    }
+    CallExpr(Expr* call, std::vector<Expr *> args) : Expr(KIND), callee(call), arguments(std::move(args)) {}
 };
 
 class UnaryExpr : public Expr {
 public:
+    static const ExprKind KIND = EXPR_UNARY;
+
     Expr *right;
     std::string op;
 
-    UnaryExpr(std::string o, Expr *r) : op(o), right(r) {};
-    ~UnaryExpr() {
-        delete right;
-    }
+    UnaryExpr(std::string o, Expr *r) : Expr(KIND), right(r), op(std::move(o)) {};
 };
 
 class AssignExpr : public Expr {
 public:
+    static const ExprKind KIND = EXPR_ASSIGN;
+
     std::string var_name;
     Expr *value;
-    AssignExpr(std::string n, Expr *v) : var_name(n), value(v) {};
-    ~AssignExpr() { delete value; }
+    AssignExpr(std::string n, Expr *v) : Expr(KIND), var_name(std::move(n)), value(v) {};
+};
+
+class ArrayExpr : public Expr {
+public:
+    static const ExprKind KIND = EXPR_ARRAY;
+
+    std::vector<Expr *> elements;
+
+    ArrayExpr(std::vector<Expr *> elems) : Expr(KIND), elements(std::move(elems)) {}
+};
+
+class IndexExpr : public Expr {
+public:
+    static const ExprKind KIND = EXPR_INDEX;
+
+    Expr *object, *index;
+
+    IndexExpr(Expr *obj, Expr *idx) : Expr(KIND), object(obj), index(idx) {}
+};
+
+class IndexAssignExpr : public Expr {
+public:
+    static const ExprKind KIND = EXPR_INDEX_ASSIGN;
+
+    Expr *object, *index, *value;
+
+    IndexAssignExpr(Expr *obj, Expr *idx, Expr *v) : Expr(KIND), object(obj), index(idx), value(v) {}
 };
 
 class IfStmt : public Stmt {
 public:
+    static const StmtKind KIND = STMT_IF;
+
     Expr *condition;
     Block *thenBranch, *elseBranch;
 
-    IfStmt(Expr *cond, Block *t, Block *e) : condition(cond), thenBranch(t), elseBranch(e) {}
-    ~IfStmt() {
-        delete condition;
-        delete thenBranch;
-        delete elseBranch;
-    }
+    IfStmt(Expr *cond, Block *t, Block *e) : Stmt(KIND), condition(cond), thenBranch(t), elseBranch(e) {}
 };
 
 class ForStmt : public Stmt {
 public:
+    static const StmtKind KIND = STMT_FOR;
+
     Stmt *initializer;
     Expr *condition, *increment;
     Block *body;
 
-    ForStmt(Stmt *init, Expr *cond, Expr *incr, Block *body) : initializer(init), condition(cond), increment(incr), body(body) {};
-    ~ForStmt() {
-        delete initializer;
-        delete condition;
-        delete increment;
-        delete body;
-    }
+    ForStmt(Stmt *init, Expr *cond, Expr *incr, Block *body) : Stmt(KIND), initializer(init), condition(cond), increment(incr), body(body) {};
 };
 
 class WhileStmt : public Stmt {
 public:
+    static const StmtKind KIND = STMT_WHILE;
+
     Expr *condition;
     Block *body;
 
-    WhileStmt(Expr *cond, Block *body) : condition(cond), body(body) {};
-    ~WhileStmt() {
-        delete condition;
-        delete body;
-    }
+    WhileStmt(Expr *cond, Block *body) : Stmt(KIND), condition(cond), body(body) {};
 };
 
 class LetStmt : public Stmt {
 public:
+    static const StmtKind KIND = STMT_LET;
+
     std::string name;
     Expr *initializer;
 
-    LetStmt(std::string n, Expr *init) : name(n), initializer(init) {};
-    ~LetStmt() {
-        delete initializer;
-    }
+    LetStmt(std::string n, Expr *init) : Stmt(KIND), name(std::move(n)), initializer(init) {};
 };
 
 class FuncStmt : public Stmt{
 public:
+    static const StmtKind KIND = STMT_FUNC;
+
     std::string name;
     std::vector<std::string> params;
     Block *body;
 
-    FuncStmt(std::string n, std::vector<std::string> p, Block *body) : name(n), params(p), body(body) {}
-    ~FuncStmt() {
-        delete body;
-    }
+    // 预解析时函数体还没有解析，body 为 NULL：tokens 是整个程序的 token 序列，body_begin 是函数体 { 的下标
+    // 第一次编译这个函数时由 Parser::parse_body 解析，函数体的节点放在单独的 body_arena 中
+    std::shared_ptr<const std::vector<Token>> tokens;
+    size_t body_begin;
+    std::once_flag body_parsed;
+    std::shared_ptr<AstArena> body_arena;
+
+    FuncStmt(std::string n, std::vector<std::string> p, Block *body) : Stmt(KIND), name(std::move(n)), params(std::move(p)), body(body), body_begin(0) {}
 };
 
 class ReturnStmt : public Stmt {
 public:
+    static const StmtKind KIND = STMT_RETURN;
+
     Expr *expr;
 
-    ReturnStmt(Expr *e) : expr(e) {}
-    ~ReturnStmt() {
-        delete expr;
-    }
+    ReturnStmt(Expr *e) : Stmt(KIND), expr(e) {}
 };
 
 class ExprStmt : public Stmt {
 public:
+    static const StmtKind KIND = STMT_EXPR;
+
     Expr *expr;
 
-    ExprStmt(Expr *e) : expr(e) {};
-    ~ExprStmt() {
-        delete expr;
-    }
+    ExprStmt(Expr *e) : Stmt(KIND), expr(e) {};
 };
 
 class BreakStmt : public Stmt {
 public:
-    BreakStmt() {}
-    ~BreakStmt() {}
+    static const StmtKind KIND = STMT_BREAK;
+
+    BreakStmt() : Stmt(KIND) {}
 };
 
 class ContinueStmt : public Stmt {
 public:
-    ContinueStmt() {}
-    ~ContinueStmt() {}
+    static const StmtKind KIND = STMT_CONTINUE;
+
+    ContinueStmt() : Stmt(KIND) {}
 };
 
 #endif
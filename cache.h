@@ -0,0 +1,156 @@
+/*************************************************************************
+	> File Name: cache.h
+	> Author: Bryan Si (SeongLam)
+	> Created Time: Mon Oct 19 20:17:36 2026
+ ************************************************************************/
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "compiler.h"
+#include "image.h"
+#include<string>
+#include<vector>
+#include<fstream>
+#include<cstdio>
+#include<cstring>
+
+// 编译结果的磁盘缓存（.mlc 文件）
+// 缓存的 key 是源码内容、编译器版本和影响代码生成的编译选项一起算出的 FNV-1a 哈希，
+// 只要有一项变了 key 就不同，旧的缓存文件自然失效
+//
+// 文件就是 image.h 中的字节码镜像，加载时直接 mmap，VM 在映射的内存上执行
+
+class BytecodeCache {
+
+    // 在内存中拼出整个镜像，偏移都相对于 __buf__ 的开头
+    class ImageWriter {
+        std::string __buf__;
+
+    public:
+        ImageWriter() : __buf__(sizeof(ImageHeader), '\0') {}
+
+        unsigned long long put(const void *data, size_t n, size_t align) {
+            while (__buf__.size() % align != 0) __buf__.push_back('\0');
+            unsigned long long offset = __buf__.size();
+            __buf__.append(static_cast<const char *>(data), n);
+            return offset;
+        }
+
+        StrRef put_str(const std::string &s) {
+            StrRef ref;
+            ref.offset = put(s.data(), s.size(), 1);
+            ref.length = s.size();
+            return ref;
+        }
+
+        unsigned long long put_chunk(const Chunk &chunk, int param_count) {
+            std::vector<StrRef> refs;
+            for (size_t i = 0; i < chunk.__const_str__.size(); i++) refs.push_back(put_str(chunk.__const_str__[i]));
+
+            ImageChunk c;
+            c.reg_count = image_registers(chunk.__bytecode__.data(), chunk.__bytecode__.size(), param_count);
+            c.code_count = static_cast<unsigned int>(chunk.__bytecode__.size());
+            c.num_count = static_cast<unsigned int>(chunk.__const_num__.size());
+            c.str_count = static_cast<unsigned int>(refs.size());
+            c.code = put(chunk.__bytecode__.data(), chunk.__bytecode__.size() * sizeof(CompactInst), 8);
+            c.nums = put(chunk.__const_num__.data(), chunk.__const_num__.size() * sizeof(double), 8);
+            c.strs = put(refs.data(), refs.size() * sizeof(StrRef), 8);
+            return put(&c, sizeof(c), 8);
+        }
+
+        void set_header(const ImageHeader &h) {
+            std::memcpy(&__buf__[0], &h, sizeof(h));
+        }
+
+        const std::string &data() const {
+            return __buf__;
+        }
+    };
+
+public:
+
+    // 编译器版本，编译器的输出发生变化时需要修改；再加上构建时间，重新编译解释器之后旧的缓存都会失效
+    static const char *version() {
+        return "minilang-bytecode-4 " __DATE__ " " __TIME__;
+    }
+
+    static unsigned long long fnv1a(const std::string &data, unsigned long long hash = 14695981039346656037ULL) {
+        for (size_t i = 0; i < data.size(); i++) {
+            hash ^= static_cast<unsigned char>(data[i]);
+            hash *= 1099511628211ULL;
+        }
+        return hash;
+    }
+
+    // options_desc 描述影响代码生成的编译选项
+    static unsigned long long make_key(const std::string &source, const std::string &options_desc) {
+        unsigned long long hash = fnv1a(source);
+        hash = fnv1a(std::string("\0", 1) + version(), hash);
+        return fnv1a(std::string("\0", 1) + options_desc, hash);
+    }
+
+    // 指定了缓存目录时文件名就是 key，否则放在源文件旁边：foo.ml -> foo.mlc
+    static std::string cache_path(const std::string &source_path, const std::string &dir, unsigned long long key) {
+        if (!dir.empty()) {
+            char name[32];
+            std::snprintf(name, sizeof(name), "%016llx.mlc", key);
+            return dir + "/" + name;
+        }
+        std::string base = source_path;
+        size_t slash = base.find_last_of('/');
+        size_t dot = base.find_last_of('.');
+        if (dot != std::string::npos && (slash == std::string::npos || dot > slash)) base.erase(dot);
+        return base + ".mlc";
+    }
+
+    // 先写到临时文件再改名，同时运行的另一个进程不会读到写了一半的文件，已经映射了旧文件的进程也不受影响
+    static bool save(const std::string &path, unsigned long long key, const Chunk &main_chunk, const std::vector<const Func *> &funcs) {
+        ImageWriter w;
+        ImageHeader h;
+        std::memset(&h, 0, sizeof(h));
+        std::memcpy(h.magic, "MLC2", 4);
+        h.version = IMAGE_VERSION;
+        h.key = key;
+        h.main_chunk = w.put_chunk(main_chunk, 0);
+
+        // 桶的个数取不小于 2 倍函数个数的 2 的幂，链表都很短
+        std::vector<ImageFunc> table(funcs.size());
+        unsigned int bucket_count = funcs.empty() ? 0 : 1;
+        while (bucket_count < 2 * funcs.size()) bucket_count *= 2;
+        std::vector<unsigned int> buckets(bucket_count, 0);
+        for (size_t i = 0; i < funcs.size(); i++) {
+            const std::string &name = funcs[i]->name;
+            table[i].name = w.put_str(name);
+            table[i].chunk = w.put_chunk(funcs[i]->__chunk__, static_cast<int>(funcs[i]->params.size()));
+            table[i].param_count = static_cast<unsigned int>(funcs[i]->params.size());
+            unsigned int &head = buckets[image_hash(name.data(), name.size()) % bucket_count];
+            table[i].next = head;
+            head = static_cast<unsigned int>(i + 1);
+        }
+        h.funcs = w.put(table.data(), table.size() * sizeof(ImageFunc), 8);
+        h.buckets = w.put(buckets.data(), buckets.size() * sizeof(unsigned int), 8);
+        h.func_count = static_cast<unsigned int>(funcs.size());
+        h.bucket_count = bucket_count;
+        h.size = w.data().size();
+        w.set_header(h);
+
+        std::string tmp = path + ".tmp";
+        {
+            std::ofstream out(tmp.c_str(), std::ios::binary);
+            if (!out) return false;
+            out.write(w.data().data(), w.data().size());
+            if (!out) {
+                std::remove(tmp.c_str());
+                return false;
+            }
+        }
+        if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+            std::remove(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+};
+
+#endif
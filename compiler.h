@@ -10,10 +10,20 @@
 #include<vector>
 #include<stack>
 #include<unordered_map>
+#include<unordered_set>
 #include<string>
 #include<iostream>
+#include<sstream>
+#include<stdexcept>
+#include<algorithm>
+#include<mutex>
 #include "ast.h"
+#include "parser.h"
 #include "instruction.h"
+#include "optimizer.h"
+#include "number.h"
+#include "profile.h"
+#include "thread_pool.h"
 
 class Func {
 public:
@@ -21,14 +31,13 @@ public:
     std::vector<std::string> params;
     Chunk __chunk__;
 
-    Func(const std::string &n, std::vector<std::string> p) : name(n), params(p) {}
-    Func& operator=(const Func &right) {
-        if (&right == this) return *this;
-        name = right.name;
-        params = right.params;
-        __chunk__ = right.__chunk__;
-        return *this;
-    }
+    Func(const std::string &n, std::vector<std::string> p) : name(n), params(std::move(p)) {}
+};
+
+// 编译错误。函数体可能在线程池中编译，所以出错时不能直接 exit，而是带回主程序按源码顺序报告
+class CompileError : public std::runtime_error {
+public:
+    explicit CompileError(const std::string &message) : std::runtime_error(message) {}
 };
 
 struct Loop {
@@ -38,6 +47,46 @@ struct Loop {
     Loop(int s) : start(s) {}
 };
 
+// 编译期已知的数字常量，规则和 VM 中的 Value 一致：整数运算溢出时退回 double
+struct ConstValue {
+    bool is_int;
+    long long ivalue;
+    double value;
+
+    ConstValue() : is_int(true), ivalue(0), value(0) {}
+    ConstValue(long long i) : is_int(true), ivalue(i), value(static_cast<double>(i)) {}
+    ConstValue(double v) : is_int(false), ivalue(0), value(v) {}
+};
+
+// 编译选项，由 main.cpp 根据命令行参数设置
+struct CompileOptions {
+    std::unordered_set<std::string> builtins; // VM 的内置函数名，调用时内置函数优先，所以不允许声明同名的用户函数
+    bool report;   // 打印每个函数的优化统计
+    int opt_level; // -O0 不做任何优化，-O1 常量折叠 + 内联 + 寄存器分配 + 窥孔优化，-O2 再加上基本块内的 CSE / 复写传播 / 死代码删除
+    const Profile *profile; // --profile-use 读入的 profile，没有的时候为 NULL
+    bool instrument;        // --profile-gen：不做内联，保证 profile 中每个函数的调用次数都是完整的
+    int jobs;               // -j：并行编译函数体的线程数，1 表示串行
+    bool lazy;              // --lazy：函数只登记，第一次调用时才由 VM 通过 compile_lazy 编译
+
+    CompileOptions() : report(false), opt_level(1), profile(NULL), instrument(false), jobs(1), lazy(false) {}
+};
+
+// 一个函数单独编译的结果，并行编译时先保存下来，等主程序编译到对应的 FuncStmt 时再合并
+struct CompiledFunc {
+    Func fn;
+    bool ok;
+    std::string error;  // 编译错误信息
+    std::string log;    // --report 的输出
+
+    CompiledFunc(const std::string &name, const std::vector<std::string> &params) : fn(name, params), ok(false) {}
+};
+
+// --lazy 时登记的函数：保存 AST 和分支编号用的函数序号，函数体在第一次调用时才编译
+struct LazyFunc {
+    FuncStmt *stmt;
+    int func_index;
+};
+
 enum CompilerType {
     FunctionCompiler,
     MainCompiler,
@@ -52,8 +101,28 @@ class Compiler {
     std::stack<std::unordered_map<std::string, int>> __scope__;
     std::stack<Loop *> __loop__;
     std::unordered_map<std::string, Func> __user_def_func__;
+    std::vector<std::string> __func_order__; // 函数的声明顺序，保证内联等处理的结果是确定的
+    std::unordered_set<std::string> __func_names__; // 程序中声明的所有函数名，函数名可以作为值传给 pmap 等内置函数
+    const Compiler *__parent__; // 函数编译器指向主程序的编译器，函数名表从这里读取，不用每个函数拷贝一份
+
+    std::unordered_map<FuncStmt *, int> __func_ids__; // 顶层函数的序号（分支编号的高 16 位），按声明顺序从 1 开始
+    int __next_func_index__;                          // 嵌套在主程序语句块中的函数，编译到的时候再分配序号
+    std::unordered_map<FuncStmt *, CompiledFunc> __precompiled__; // -j 时提前并行编译好的顶层函数
+    std::unordered_map<std::string, LazyFunc> __lazy_funcs__;     // --lazy 时还没有编译的函数，AST 要一直保留到程序结束
+
+    std::ostringstream __log__; // --report 的输出先写到这里，保证并行编译时输出的顺序和串行一致
 
     CompilerType __type__;
+    CompileOptions __options__;
+    std::string __name__;  // 正在编译的函数名，主程序为 <main>
+    int __param_count__;
+
+    std::unordered_set<std::string> __assigned_names__; // 当前函数中被赋值过的变量名，没有出现在这里的 let 变量就是常量
+    std::unordered_map<int, ConstValue> __const_regs__; // 保存常量的变量寄存器 -> 常量值
+
+    int __func_index__;    // 分支编号的高 16 位，主程序为 0，函数按声明顺序从 1 开始
+    int __branch_count__;  // 已经分配的分支编号个数
+    int __pgo_inverted__, __pgo_rotated__; // 根据 profile 翻转的 if 和轮转的循环个数
 
     // Expression Compile
     int compile_expr(Expr *expr);
@@ -61,12 +130,23 @@ class Compiler {
     int compile_unary_expr(UnaryExpr *expr);
     int compile_call_expr(CallExpr *expr);
     int compile_assign_expr(AssignExpr *expr);
+    int compile_array_expr(ArrayExpr *expr);
+    int compile_index_expr(IndexExpr *expr);
+    int compile_index_assign_expr(IndexAssignExpr *expr);
+    int compile_operand(Expr *expr, const std::vector<Expr *> &later);
+    void compile_into(Expr *expr, int dst);
+    static bool assigns_var(Expr *expr, const std::string &name);
+    bool fold_constant(Expr *expr, ConstValue &out);
+    int emit_constant(const ConstValue &value, int dst);
+    static void collect_assigned(Expr *expr, std::unordered_set<std::string> &names);
+    static void collect_assigned(Stmt *stmt, std::unordered_set<std::string> &names);
     
     // Statement Compile
     void compile_stmt(Stmt *stmt);
     void compile_if_stmt(IfStmt *stmt);
     void compile_while_stmt(WhileStmt *stmt);
     void compile_for_stmt(ForStmt *stmt);
+    bool compile_counted_for(ForStmt *stmt);
     void compile_let_stmt(LetStmt *stmt);
     void compile_return_stmt(ReturnStmt *stmt);
     void compile_break_stmt(BreakStmt *stmt);
@@ -75,21 +155,52 @@ class Compiler {
     void compile_expr_stmt(ExprStmt *stmt);
     void compile_block(Block* block);
 
+    void compile_body(Block *block);
+    void compile_function(FuncStmt *stmt, int func_index, CompiledFunc &out) const;
+    void precompile_functions(const std::vector<FuncStmt *> &funcs);
+
+    const std::unordered_set<std::string> &program_funcs() const {
+        return __parent__ ? __parent__->__func_names__ : __func_names__;
+    }
+
+    // 给条件分支分配编号，格式见 profile.h
+    int next_branch_id() {
+        if (__branch_count__ >= 0xffff) return 0;
+        return (__func_index__ << 16) | ++__branch_count__;
+    }
+
+    // 使用 profile 时，这个条件是否多半成立
+    bool branch_mostly_true(int id) const {
+        return id != 0 && __options__.opt_level >= 1 && __options__.profile && __options__.profile->mostly_true(id);
+    }
+
+    int emit_int(long long value, int dst) {
+        unsigned long long bits = static_cast<unsigned long long>(value);
+        __chunk__.write(OP_LOAD_INT, static_cast<int>(bits & 0xffffffffULL), static_cast<int>(bits >> 32), dst);
+        return dst;
+    }
+
 public:
 
-    Compiler() : __tmp_counter__(0), __max_reg_count__(0), __type__(MainCompiler) {
+    Compiler() : __tmp_counter__(0), __max_reg_count__(0), __parent__(NULL), __next_func_index__(1),
+        __type__(MainCompiler), __name__("<main>"), __param_count__(0),
+        __func_index__(0), __branch_count__(0), __pgo_inverted__(0), __pgo_rotated__(0) {
         // std::cout << "Created Main Compiler (Default)" << std::endl;
         std::unordered_map<std::string, int> base_scope;
         __scope__.push(base_scope);
     }
 
-    Compiler(CompilerType type) : __tmp_counter__(0), __max_reg_count__(0), __type__(type) {
+    Compiler(CompilerType type) : __tmp_counter__(0), __max_reg_count__(0), __parent__(NULL), __next_func_index__(1),
+        __type__(type), __name__("<main>"), __param_count__(0),
+        __func_index__(0), __branch_count__(0), __pgo_inverted__(0), __pgo_rotated__(0) {
         // std::cout << "Created Specific Type Compiler" << std::endl;
         std::unordered_map<std::string, int> base_scope;
         __scope__.push(base_scope);
     }
 
-    Compiler(CompilerType type, std::vector<std::string> params) : __type__(type) {
+    Compiler(CompilerType type, std::vector<std::string> params) : __parent__(NULL), __next_func_index__(1),
+        __type__(type), __name__("<main>"), __param_count__(static_cast<int>(params.size())),
+        __func_index__(0), __branch_count__(0), __pgo_inverted__(0), __pgo_rotated__(0) {
         std::unordered_map<std::string, int> base_scope;
         __scope__.push(base_scope);
         for (size_t i = 0; i < params.size(); i++) {
@@ -100,68 +211,410 @@ public:
         // std::cout<<"Compiling Function with params size " << __max_reg_count__ << std::endl;
     }
 
+    // 函数编译器把 CompileError 抛给调用方，主程序在这里统一报告
     void compile(Block *block) {
-        for(size_t i = 0; i < block->statements.size(); i++) {
-            compile_stmt(block->statements[i]);
+        if (__type__ == FunctionCompiler) {
+            compile_body(block);
+            return;
+        }
+
+        try {
+            compile_body(block);
+        } catch (const CompileError &e) {
+            std::cout << __log__.str();
+            std::cerr << e.what() << std::endl;
+            exit(1);
         }
+        std::cout << __log__.str();
+    }
+
+    // Chunk 生成完之后：内联、优化、寄存器分配、类型推导，最后编码成紧凑字节码
+    void finish_compile() {
         __chunk__.__reg_count__ = std::max(__tmp_counter__, __max_reg_count__);
         if (__type__ == MainCompiler) __chunk__.write(OP_HALT, 0, 0, 0);
+
+        if (__options__.report && __options__.profile && __options__.opt_level >= 1) {
+            __log__ << "[pgo] " << __name__ << ": " << __pgo_inverted__ << " branches inverted, " << __pgo_rotated__ << " loops rotated" << std::endl;
+        }
+
+        if (__type__ == MainCompiler && __options__.opt_level >= 1 && !__options__.instrument) inline_functions();
+        finish_chunk(__chunk__, __param_count__, __name__);
+        if (__type__ == MainCompiler && __options__.opt_level >= 1) infer_types();
+        if (__type__ == MainCompiler) encode_chunks();
+    }
+
+    // 一个 Chunk 生成完之后的优化流程
+    void finish_chunk(Chunk &chunk, int param_count, const std::string &name) {
+        // profile 中的热函数在 -O1 下也按 -O2 优化
+        int level = __options__.opt_level;
+        if (level == 1 && name != "<main>" && __options__.profile && __options__.profile->hot(name)) {
+            level = 2;
+            if (__options__.report) __log__ << "[pgo] " << name << ": hot, optimized at -O2" << std::endl;
+        }
+
+        if (level >= 2) {
+            size_t before = chunk.__code__.size();
+            Optimizer::OptimizeStats stats = Optimizer::optimize(chunk, param_count);
+            if (__options__.report) {
+                __log__ << "[O2] " << name << ": " << before << " -> " << chunk.__code__.size() << " instructions, "
+                          << stats.hoisted << " hoisted out of loops" << std::endl;
+            }
+        }
+
+        // 编译时每个临时值都占一个新的寄存器，这里按活跃区间重新分配，缩小每一帧的寄存器数量
+        if (__options__.opt_level >= 1) {
+            int before = chunk.__reg_count__;
+            bool allocated = Optimizer::allocate_registers(chunk, param_count);
+            if (__options__.report) {
+                __log__ << "[regalloc] " << name << ": " << before << " -> " << chunk.__reg_count__ << " registers";
+                if (!allocated) __log__ << " (skipped)";
+                __log__ << std::endl;
+            }
+
+            size_t removed = Optimizer::peephole(chunk, param_count);
+            if (__options__.report) {
+                __log__ << "[peephole] " << name << ": " << removed << " instructions removed" << std::endl;
+            }
+        }
     }
 
-    Chunk get_chunk() {
+    void inline_functions();
+    void infer_types();
+    void encode_chunks();
+    bool compile_lazy(const std::string &name, Func &out) const;
+
+    void set_options(const CompileOptions &options) {
+        __options__ = options;
+    }
+
+    const CompileOptions &get_options() const {
+        return __options__;
+    }
+
+    const Chunk &get_chunk() const {
         // std::cout << "Returning Chunk with reg count: "<<__chunk__.get_reg_count() << std::endl;
         return __chunk__;
     }
 
-    std::unordered_map<std::string, Func> get_user_func() {
+    const std::unordered_map<std::string, Func> &get_user_func() const {
         return __user_def_func__;
     }
+
+    // 把编译结果移交给调用方，之后编译器中不再保存它们；--lazy 编译函数时不需要这两项
+    // 移交出去的 Chunk 已经编译完了，只保留 VM 需要的部分
+    Chunk take_chunk() {
+        __chunk__.drop_compile_data();
+        return std::move(__chunk__);
+    }
+
+    std::unordered_map<std::string, Func> take_user_func() {
+        for (std::unordered_map<std::string, Func>::iterator it = __user_def_func__.begin(); it != __user_def_func__.end(); ++it) {
+            it->second.__chunk__.drop_compile_data();
+        }
+        return std::move(__user_def_func__);
+    }
+
+    // 函数的声明顺序
+    const std::vector<std::string> &get_func_order() const {
+        return __func_order__;
+    }
 };
 
 int Compiler::compile_expr(Expr *expr) {
-    if (BinaryExpr *e = dynamic_cast<BinaryExpr *>(expr)) {
-        return compile_binary_expr(e);
-    } 
-    if (UnaryExpr *e = dynamic_cast<UnaryExpr *>(expr)) {
-        return compile_unary_expr(e);
+    switch (expr->kind) {
+        case EXPR_BINARY:
+            return compile_binary_expr(static_cast<BinaryExpr *>(expr));
+        case EXPR_UNARY:
+            return compile_unary_expr(static_cast<UnaryExpr *>(expr));
+        case EXPR_CALL:
+            return compile_call_expr(static_cast<CallExpr *>(expr));
+        case EXPR_ASSIGN:
+            return compile_assign_expr(static_cast<AssignExpr *>(expr));
+        case EXPR_ARRAY:
+            return compile_array_expr(static_cast<ArrayExpr *>(expr));
+        case EXPR_INDEX:
+            return compile_index_expr(static_cast<IndexExpr *>(expr));
+        case EXPR_INDEX_ASSIGN:
+            return compile_index_assign_expr(static_cast<IndexAssignExpr *>(expr));
+
+        case EXPR_LITERAL: {
+            LiteralExpr *e = static_cast<LiteralExpr *>(expr);
+            if (e->is_int) return emit_int(e->ivalue, __tmp_counter__++);
+            size_t idx = __chunk__.add_const_number(e->value);
+            __chunk__.write(OP_CONSTANT, idx, 0, __tmp_counter__++);
+            return __tmp_counter__ - 1;
+        }
+
+        case EXPR_STRING: {
+            int idx = __chunk__.add_const_str(static_cast<StringExpr *>(expr)->str);
+            __chunk__.write(OP_CONSTANT, ~idx, 0, __tmp_counter__++);
+            return __tmp_counter__ - 1;
+        }
+
+        case EXPR_VARIABLE: {
+            VariableExpr *e = static_cast<VariableExpr *>(expr);
+            std::unordered_map<std::string, int>::iterator it = __scope__.top().find(e->name);
+            if(it != __scope__.top().end()) {
+                // 直接把变量所在的寄存器当作操作数，不再拷贝到临时寄存器
+                return it->second;
+            } else if (program_funcs().count(e->name)) {
+                // 函数名作为值使用时就是它的名字，OP_CALL 也是通过名字找到函数的
+                int idx = __chunk__.add_const_str(e->name);
+                __chunk__.write(OP_CONSTANT, ~idx, 0, __tmp_counter__++);
+                return __tmp_counter__ - 1;
+            } else {
+                throw CompileError("Undefined variable " + e->name);
+            }
+        }
     }
-    if (CallExpr *e = dynamic_cast<CallExpr *>(expr)) {
-        return compile_call_expr(e);
+
+    throw CompileError("Unknown expression ");
+}
+
+// 判断表达式在求值过程中是否会给变量 name 赋值
+bool Compiler::assigns_var(Expr *expr, const std::string &name) {
+    if (!expr) return false;
+    switch (expr->kind) {
+        case EXPR_ASSIGN: {
+            AssignExpr *e = static_cast<AssignExpr *>(expr);
+            return e->var_name == name || assigns_var(e->value, name);
+        }
+        case EXPR_BINARY: {
+            BinaryExpr *e = static_cast<BinaryExpr *>(expr);
+            return assigns_var(e->left, name) || assigns_var(e->right, name);
+        }
+        case EXPR_UNARY:
+            return assigns_var(static_cast<UnaryExpr *>(expr)->right, name);
+        case EXPR_CALL: {
+            CallExpr *e = static_cast<CallExpr *>(expr);
+            for (size_t i = 0; i < e->arguments.size(); i++) {
+                if (assigns_var(e->arguments[i], name)) return true;
+            }
+            return false;
+        }
+        case EXPR_ARRAY: {
+            ArrayExpr *e = static_cast<ArrayExpr *>(expr);
+            for (size_t i = 0; i < e->elements.size(); i++) {
+                if (assigns_var(e->elements[i], name)) return true;
+            }
+            return false;
+        }
+        case EXPR_INDEX: {
+            IndexExpr *e = static_cast<IndexExpr *>(expr);
+            return assigns_var(e->object, name) || assigns_var(e->index, name);
+        }
+        case EXPR_INDEX_ASSIGN: {
+            IndexAssignExpr *e = static_cast<IndexAssignExpr *>(expr);
+            return assigns_var(e->object, name) || assigns_var(e->index, name) || assigns_var(e->value, name);
+        }
+        default:
+            return false;
     }
+}
 
-    if (AssignExpr *e = dynamic_cast<AssignExpr *>(expr)) {
-        return compile_assign_expr(e);
+// 收集语句中所有被赋值的变量名，函数体有自己的作用域，不需要进入
+void Compiler::collect_assigned(Expr *expr, std::unordered_set<std::string> &names) {
+    if (!expr) return;
+    switch (expr->kind) {
+        case EXPR_ASSIGN: {
+            AssignExpr *e = static_cast<AssignExpr *>(expr);
+            names.insert(e->var_name);
+            collect_assigned(e->value, names);
+            break;
+        }
+        case EXPR_BINARY: {
+            BinaryExpr *e = static_cast<BinaryExpr *>(expr);
+            collect_assigned(e->left, names);
+            collect_assigned(e->right, names);
+            break;
+        }
+        case EXPR_UNARY:
+            collect_assigned(static_cast<UnaryExpr *>(expr)->right, names);
+            break;
+        case EXPR_CALL: {
+            CallExpr *e = static_cast<CallExpr *>(expr);
+            for (size_t i = 0; i < e->arguments.size(); i++) collect_assigned(e->arguments[i], names);
+            break;
+        }
+        case EXPR_ARRAY: {
+            ArrayExpr *e = static_cast<ArrayExpr *>(expr);
+            for (size_t i = 0; i < e->elements.size(); i++) collect_assigned(e->elements[i], names);
+            break;
+        }
+        case EXPR_INDEX: {
+            IndexExpr *e = static_cast<IndexExpr *>(expr);
+            collect_assigned(e->object, names);
+            collect_assigned(e->index, names);
+            break;
+        }
+        case EXPR_INDEX_ASSIGN: {
+            IndexAssignExpr *e = static_cast<IndexAssignExpr *>(expr);
+            collect_assigned(e->object, names);
+            collect_assigned(e->index, names);
+            collect_assigned(e->value, names);
+            break;
+        }
+        default:
+            break;
     }
+}
 
-    if (LiteralExpr *e = dynamic_cast<LiteralExpr *>(expr)) {
-        size_t idx = __chunk__.add_const_number(e->value);
-        __chunk__.write(OP_CONSTANT, idx, 0, __tmp_counter__++);
-        return __tmp_counter__ - 1;
+void Compiler::collect_assigned(Stmt *stmt, std::unordered_set<std::string> &names) {
+    if (!stmt) return;
+    switch (stmt->kind) {
+        case STMT_IF: {
+            IfStmt *s = static_cast<IfStmt *>(stmt);
+            collect_assigned(s->condition, names);
+            for (size_t i = 0; i < s->thenBranch->statements.size(); i++) collect_assigned(s->thenBranch->statements[i], names);
+            if (s->elseBranch) {
+                for (size_t i = 0; i < s->elseBranch->statements.size(); i++) collect_assigned(s->elseBranch->statements[i], names);
+            }
+            break;
+        }
+        case STMT_WHILE: {
+            WhileStmt *s = static_cast<WhileStmt *>(stmt);
+            collect_assigned(s->condition, names);
+            for (size_t i = 0; i < s->body->statements.size(); i++) collect_assigned(s->body->statements[i], names);
+            break;
+        }
+        case STMT_FOR: {
+            ForStmt *s = static_cast<ForStmt *>(stmt);
+            collect_assigned(s->initializer, names);
+            collect_assigned(s->condition, names);
+            collect_assigned(s->increment, names);
+            for (size_t i = 0; i < s->body->statements.size(); i++) collect_assigned(s->body->statements[i], names);
+            break;
+        }
+        case STMT_LET:
+            collect_assigned(static_cast<LetStmt *>(stmt)->initializer, names);
+            break;
+        case STMT_RETURN:
+            collect_assigned(static_cast<ReturnStmt *>(stmt)->expr, names);
+            break;
+        case STMT_EXPR:
+            collect_assigned(static_cast<ExprStmt *>(stmt)->expr, names);
+            break;
+        default:
+            break;
     }
+}
 
-    if (StringExpr *e = dynamic_cast<StringExpr *>(expr)) {
-        int idx = __chunk__.add_const_str(e->str);
-        __chunk__.write(OP_CONSTANT, ~idx, 0, __tmp_counter__++);
-        return __tmp_counter__ - 1;
+// 尝试在编译期算出表达式的值
+// 只处理数字，除数为 0 的除法留到运行时报错
+bool Compiler::fold_constant(Expr *expr, ConstValue &out) {
+    if (LiteralExpr *e = ast_cast<LiteralExpr>(expr)) {
+        out = e->is_int ? ConstValue(e->ivalue) : ConstValue(e->value);
+        return true;
     }
 
-    if (VariableExpr *e = dynamic_cast<VariableExpr *>(expr)) {
+    if (VariableExpr *e = ast_cast<VariableExpr>(expr)) {
         std::unordered_map<std::string, int>::iterator it = __scope__.top().find(e->name);
-        if(it != __scope__.top().end()) {
-            __chunk__.write(OP_GET_LOCAL, it->second, 0, __tmp_counter__++);
-            return __tmp_counter__ - 1;
+        if (it == __scope__.top().end()) return false;
+        std::unordered_map<int, ConstValue>::iterator c = __const_regs__.find(it->second);
+        if (c == __const_regs__.end()) return false;
+        out = c->second;
+        return true;
+    }
+
+    if (UnaryExpr *e = ast_cast<UnaryExpr>(expr)) {
+        ConstValue v;
+        if (!fold_constant(e->right, v)) return false;
+        if (e->op == "!") {
+            out = ConstValue((v.is_int ? v.ivalue == 0 : v.value == 0.0) ? 1LL : 0LL);
+            return true;
+        }
+        if (e->op == "-") {
+            // 和运行时一样按 0 - x 计算
+            long long iv;
+            if (v.is_int && !int_sub_overflow(0, v.ivalue, &iv)) out = ConstValue(iv);
+            else out = ConstValue(0.0 - v.value);
+            return true;
+        }
+        return false;
+    }
+
+    if (BinaryExpr *e = ast_cast<BinaryExpr>(expr)) {
+        ConstValue l, r;
+        if (!fold_constant(e->left, l) || !fold_constant(e->right, r)) return false;
+
+        bool both_int = l.is_int && r.is_int;
+        long long iv;
+        const std::string &op = e->op;
+        if (op == "+") {
+            if (both_int && !int_add_overflow(l.ivalue, r.ivalue, &iv)) out = ConstValue(iv);
+            else out = ConstValue(l.value + r.value);
+        } else if (op == "-") {
+            if (both_int && !int_sub_overflow(l.ivalue, r.ivalue, &iv)) out = ConstValue(iv);
+            else out = ConstValue(l.value - r.value);
+        } else if (op == "*") {
+            if (both_int && !int_mul_overflow(l.ivalue, r.ivalue, &iv)) out = ConstValue(iv);
+            else out = ConstValue(l.value * r.value);
+        } else if (op == "/") {
+            if (r.value == 0) return false;
+            out = ConstValue(l.value / r.value);
         } else {
-            std::cerr << "Undefined variable "<<e->name<<std::endl;
-            exit(1);
+            bool b;
+            if (op == "<") b = both_int ? l.ivalue < r.ivalue : l.value < r.value;
+            else if (op == ">") b = both_int ? l.ivalue > r.ivalue : l.value > r.value;
+            else if (op == "<=") b = both_int ? l.ivalue <= r.ivalue : l.value <= r.value;
+            else if (op == ">=") b = both_int ? l.ivalue >= r.ivalue : l.value >= r.value;
+            else if (op == "==") b = both_int ? l.ivalue == r.ivalue : l.value == r.value;
+            else if (op == "!=") b = both_int ? l.ivalue != r.ivalue : l.value != r.value;
+            else return false;
+            out = ConstValue(b ? 1LL : 0LL);
+        }
+        return true;
+    }
+
+    return false;
+}
+
+int Compiler::emit_constant(const ConstValue &value, int dst) {
+    if (value.is_int) return emit_int(value.ivalue, dst);
+    size_t idx = __chunk__.add_const_number(value.value);
+    __chunk__.write(OP_CONSTANT, idx, 0, dst);
+    return dst;
+}
+
+// 编译一个操作数，变量（以及赋值表达式）的结果就是变量自己的寄存器
+// 如果之后求值的兄弟表达式 later 会修改这个变量，就必须先拷贝一份，保证从左到右的求值语义
+int Compiler::compile_operand(Expr *expr, const std::vector<Expr *> &later) {
+    int reg = compile_expr(expr);
+
+    std::string name;
+    if (VariableExpr *e = ast_cast<VariableExpr>(expr)) name = e->name;
+    else if (AssignExpr *e = ast_cast<AssignExpr>(expr)) name = e->var_name;
+    else return reg;
+
+    for (size_t i = 0; i < later.size(); i++) {
+        if (assigns_var(later[i], name)) {
+            __chunk__.write(OP_GET_LOCAL, reg, 0, __tmp_counter__++);
+            return __tmp_counter__ - 1;
         }
     }
+    return reg;
+}
 
-    std::cerr << "Unknown expression "<<std::endl;
-    exit(1);
+// 把表达式的值写入 dst
+// 如果值是刚刚由最后一条指令算进新临时寄存器的，直接让那条指令写 dst，省掉一次拷贝
+void Compiler::compile_into(Expr *expr, int dst) {
+    int mark = __tmp_counter__;
+    int src = compile_expr(expr);
+    if (src >= mark && !__chunk__.__code__.empty()) {
+        Instruction &last = __chunk__.__code__.back();
+        if (last.result == src && last.op != OP_CALL && last.op != OP_FORLOOP && Optimizer::inst_def(last) == src) {
+            last.result = dst;
+            return;
+        }
+    }
+    __chunk__.write(OP_SET_LOCAL, src, 0, dst);
 }
 
 int Compiler::compile_binary_expr(BinaryExpr *expr) {
-    int left_reg = compile_expr(expr->left);
+    ConstValue folded;
+    if (__options__.opt_level >= 1 && fold_constant(expr, folded)) return emit_constant(folded, __tmp_counter__++);
+
+    int left_reg = compile_operand(expr->left, std::vector<Expr *>(1, expr->right));
     int right_reg = compile_expr(expr->right);
     int result_reg = __tmp_counter__++;
 
@@ -184,39 +637,38 @@ int Compiler::compile_binary_expr(BinaryExpr *expr) {
     } else if (expr->op == "<=") {
         __chunk__.write(OP_LESS_EQUAL, left_reg, right_reg, result_reg);
     } else if (expr->op == "!=") {
-        __chunk__.write(OP_EQUAL, left_reg, right_reg, result_reg);
-        __chunk__.write(OP_NOT, result_reg, 0, __tmp_counter__++);
-        result_reg = __tmp_counter__;
+        int equal_reg = result_reg;
+        result_reg = __tmp_counter__++;
+        __chunk__.write(OP_EQUAL, left_reg, right_reg, equal_reg);
+        __chunk__.write(OP_NOT, equal_reg, 0, result_reg);
     } else {
-        std::cerr << "Unsupported binary operator "<<expr->op<<std::endl;
-        exit(1);
+        throw CompileError("Unsupported binary operator " + expr->op);
     }
 
     return result_reg;
 }
 
 int Compiler::compile_unary_expr(UnaryExpr *expr) {
+    ConstValue folded;
+    if (__options__.opt_level >= 1 && fold_constant(expr, folded)) return emit_constant(folded, __tmp_counter__++);
+
     int src = compile_expr(expr->right);
     int dst = __tmp_counter__++;
     if (expr->op == "!") {
         __chunk__.write(OP_NOT, src, 0, dst);
     } else if(expr->op == "-") {
-        int zero_idx = __chunk__.add_const_number(0.0);
-        int zero_reg = __tmp_counter__++;
-        __chunk__.write(OP_CONSTANT, zero_idx, 0, zero_reg);
+        int zero_reg = emit_int(0, __tmp_counter__++);
         __chunk__.write(OP_SUB, zero_reg, src, dst);
     } else {
-        std::cerr<<"Unsupported unary operator "<<expr->op<<std::endl;
-        exit(1);
+        throw CompileError("Unsupported unary operator " + expr->op);
     }
     return dst;
 }
 
 int Compiler::compile_call_expr(CallExpr *expr) {
-    VariableExpr *callee = dynamic_cast<VariableExpr *>(expr->callee);
+    VariableExpr *callee = ast_cast<VariableExpr>(expr->callee);
     if (!callee) {
-        std::cerr << "Function name must be VariableExpr" << std::endl;
-        exit(1);
+        throw CompileError("Function name must be VariableExpr");
     }
     int fn_idx = __chunk__.add_const_str(callee->name);
     int fn_reg = __tmp_counter__++;
@@ -224,7 +676,8 @@ int Compiler::compile_call_expr(CallExpr *expr) {
 
     std::vector<int> arg_regs;
     for (size_t i = 0; i < expr->arguments.size(); i++) {
-        arg_regs.push_back(compile_expr(expr->arguments[i]));
+        std::vector<Expr *> later(expr->arguments.begin() + i + 1, expr->arguments.end());
+        arg_regs.push_back(compile_operand(expr->arguments[i], later));
     }
 
     // 这里一般的做法是需要通过扫描那些寄存器是真的存放着重要的数据
@@ -244,26 +697,62 @@ int Compiler::compile_call_expr(CallExpr *expr) {
 int Compiler::compile_assign_expr(AssignExpr *expr) {
     std::unordered_map<std::string, int>::iterator it = __scope__.top().find(expr->var_name);
     if (it != __scope__.top().end()) {
-        int src = compile_expr(expr->value);
-        __chunk__.write(OP_SET_LOCAL, src, 0, it->second);
+        compile_into(expr->value, it->second);
     } else {
-        std::cerr << "Undefined variable "<<expr->var_name<<std::endl;
-        exit(1);
+        throw CompileError("Undefined variable " + expr->var_name);
     }
     return it->second;
 }
 
+int Compiler::compile_array_expr(ArrayExpr *expr) {
+    std::vector<int> elem_regs;
+    for (size_t i = 0; i < expr->elements.size(); i++) {
+        std::vector<Expr *> later(expr->elements.begin() + i + 1, expr->elements.end());
+        elem_regs.push_back(compile_operand(expr->elements[i], later));
+    }
+
+    // 和函数调用一样，元素需要放在一段连续的寄存器中，VM 才能一次性打包
+    int base = __tmp_counter__;
+    for (size_t i = 0; i < elem_regs.size(); i++) {
+        __chunk__.write(OP_SET_LOCAL, elem_regs[i], 0, __tmp_counter__++);
+    }
+
+    int result_reg = __tmp_counter__++;
+    __chunk__.write(OP_NEW_ARRAY, base, static_cast<int>(elem_regs.size()), result_reg);
+    return result_reg;
+}
+
+int Compiler::compile_index_expr(IndexExpr *expr) {
+    int obj_reg = compile_operand(expr->object, std::vector<Expr *>(1, expr->index));
+    int idx_reg = compile_expr(expr->index);
+    int result_reg = __tmp_counter__++;
+    __chunk__.write(OP_GET_INDEX, obj_reg, idx_reg, result_reg);
+    return result_reg;
+}
+
+int Compiler::compile_index_assign_expr(IndexAssignExpr *expr) {
+    std::vector<Expr *> later;
+    later.push_back(expr->index);
+    later.push_back(expr->value);
+    int obj_reg = compile_operand(expr->object, later);
+    int idx_reg = compile_operand(expr->index, std::vector<Expr *>(1, expr->value));
+    int val_reg = compile_expr(expr->value);
+    __chunk__.write(OP_SET_INDEX, obj_reg, idx_reg, val_reg);
+    return val_reg;
+}
+
 void Compiler::compile_stmt(Stmt* stmt) {
-    if (IfStmt *s = dynamic_cast<IfStmt *>(stmt))           compile_if_stmt(s);
-    if (WhileStmt *s = dynamic_cast<WhileStmt *>(stmt))     compile_while_stmt(s);
-    if (ForStmt *s = dynamic_cast<ForStmt *>(stmt))         compile_for_stmt(s);
-    if (LetStmt *s = dynamic_cast<LetStmt *>(stmt))         compile_let_stmt(s);
-    if (ExprStmt *s = dynamic_cast<ExprStmt *>(stmt))       compile_expr_stmt(s);
-    if (BreakStmt *s = dynamic_cast<BreakStmt *>(stmt))     compile_break_stmt(s);
-    if (ContinueStmt *s = dynamic_cast<ContinueStmt *>(stmt)) compile_continue_stmt(s);
-    if (FuncStmt *s = dynamic_cast<FuncStmt *>(stmt))       compile_func_stmt(s);
-    if (ReturnStmt *s = dynamic_cast<ReturnStmt *>(stmt))   compile_return_stmt(s);
-    if (Block *s = dynamic_cast<Block *>(stmt))             compile_block(s);
+    switch (stmt->kind) {
+        case STMT_IF:       compile_if_stmt(static_cast<IfStmt *>(stmt)); break;
+        case STMT_WHILE:    compile_while_stmt(static_cast<WhileStmt *>(stmt)); break;
+        case STMT_FOR:      compile_for_stmt(static_cast<ForStmt *>(stmt)); break;
+        case STMT_LET:      compile_let_stmt(static_cast<LetStmt *>(stmt)); break;
+        case STMT_EXPR:     compile_expr_stmt(static_cast<ExprStmt *>(stmt)); break;
+        case STMT_BREAK:    compile_break_stmt(static_cast<BreakStmt *>(stmt)); break;
+        case STMT_CONTINUE: compile_continue_stmt(static_cast<ContinueStmt *>(stmt)); break;
+        case STMT_FUNC:     compile_func_stmt(static_cast<FuncStmt *>(stmt)); break;
+        case STMT_RETURN:   compile_return_stmt(static_cast<ReturnStmt *>(stmt)); break;
+    }
 }
 
 void Compiler::compile_block(Block *block) {
@@ -281,8 +770,26 @@ void Compiler::compile_block(Block *block) {
 
 void Compiler::compile_if_stmt(IfStmt *stmt) {
     int cond_reg = compile_expr(stmt->condition);
+    int branch_id = next_branch_id();
+
+    // profile 显示条件多半成立：把 then 分支放到后面，热路径上就少执行一条跳过 else 的 OP_JUMP
+    if (stmt->elseBranch && branch_mostly_true(branch_id)) {
+        int then_jump = static_cast<int>(__chunk__.__code__.size());
+        __chunk__.write(OP_JUMP_IF_TRUE, cond_reg, branch_id, 0);
+
+        compile_block(stmt->elseBranch);
+        int end_line = static_cast<int> (__chunk__.__code__.size());
+        __chunk__.write(OP_JUMP, 0, 0, 0);
+
+        __chunk__.__code__[then_jump].result = static_cast<int>(__chunk__.__code__.size());
+        compile_block(stmt->thenBranch);
+        __chunk__.__code__[end_line].arg1 = static_cast<int> (__chunk__.__code__.size());
+        __pgo_inverted__++;
+        return;
+    }
+
     int then_line = static_cast<int>(__chunk__.__code__.size());
-    __chunk__.write(OP_JUMP_IF_FALSE, cond_reg, 0, 0); // result 在后面会修改
+    __chunk__.write(OP_JUMP_IF_FALSE, cond_reg, branch_id, 0); // result 在后面会修改
 
     compile_block(stmt->thenBranch);
 
@@ -304,18 +811,116 @@ void Compiler::compile_while_stmt(WhileStmt *stmt) {
     int loop_start = static_cast<int> (__chunk__.__code__.size());
 
     int cond_reg = compile_expr(stmt->condition);
+    int branch_id = next_branch_id();
     int exit_line = static_cast<int> (__chunk__.__code__.size());
-    __chunk__.write(OP_JUMP_IF_FALSE, cond_reg, 0, 0);
+    __chunk__.write(OP_JUMP_IF_FALSE, cond_reg, branch_id, 0);
 
-    __loop__.push(new Loop(loop_start));
+    // profile 显示循环平均不止执行一次：把条件复制一份放到循环体后面，每次迭代只执行一条条件跳转
+    bool rotate = branch_mostly_true(branch_id);
+    int body_start = static_cast<int> (__chunk__.__code__.size());
+
+    __loop__.push(new Loop(rotate ? -1 : loop_start));
     int _origin_next_reg_ = __tmp_counter__;
     compile_block(stmt->body);
     __max_reg_count__ = std::max(__tmp_counter__, __max_reg_count__);
     __tmp_counter__ = _origin_next_reg_;
     Loop *l = __loop__.top(); __loop__.pop();
 
-    __chunk__.write(OP_JUMP, loop_start, 0, 0);
+    if (rotate) {
+        int check = static_cast<int> (__chunk__.__code__.size());
+        for (int pc : l->_continue_jump_) {
+            __chunk__.__code__[pc].arg1 = check;
+        }
+        int again_reg = compile_expr(stmt->condition);
+        __chunk__.write(OP_JUMP_IF_TRUE, again_reg, branch_id, body_start);
+        __pgo_rotated__++;
+    } else {
+        __chunk__.write(OP_JUMP, loop_start, 0, 0);
+    }
+
+    int after_loop = static_cast<int> (__chunk__.__code__.size());
+    for (int pc : l->_break_jump_) {
+        __chunk__.__code__[pc].arg1 = after_loop;
+    }
+    __chunk__.__code__[exit_line].result = after_loop;
+
+    delete l;
+}
+
+// 识别 for (let i = a; i < b; i = i + c) 这样的计数循环，用一条 OP_FORLOOP 完成 "自增 + 比较 + 跳回循环体"
+// 要求循环体中不修改 i，c 是常量，b 是常量或者循环体中不会被修改的变量，比较可以是 < <= > >=
+// 不满足条件的时候返回 false，并且不生成任何指令
+bool Compiler::compile_counted_for(ForStmt *stmt) {
+    LetStmt *init = ast_cast<LetStmt>(stmt->initializer);
+    BinaryExpr *cond = ast_cast<BinaryExpr>(stmt->condition);
+    AssignExpr *incr = ast_cast<AssignExpr>(stmt->increment);
+    if (!init || !cond || !incr) return false;
+    const std::string &name = init->name;
+
+    Opcode kind;
+    if (cond->op == "<") kind = OP_LESS;
+    else if (cond->op == "<=") kind = OP_LESS_EQUAL;
+    else if (cond->op == ">") kind = OP_GREATER;
+    else if (cond->op == ">=") kind = OP_GREATER_EQUAL;
+    else return false;
+
+    VariableExpr *cond_var = ast_cast<VariableExpr>(cond->left);
+    if (!cond_var || cond_var->name != name) return false;
+
+    // 步长：i = i + c 或者 i = i - c
+    BinaryExpr *step_expr = ast_cast<BinaryExpr>(incr->value);
+    if (incr->var_name != name || !step_expr || (step_expr->op != "+" && step_expr->op != "-")) return false;
+    VariableExpr *step_var = ast_cast<VariableExpr>(step_expr->left);
+    ConstValue step;
+    if (!step_var || step_var->name != name || !fold_constant(step_expr->right, step)) return false;
+    if (step_expr->op == "-") {
+        if (step.is_int && step.ivalue == LLONG_MIN) return false;
+        step = step.is_int ? ConstValue(-step.ivalue) : ConstValue(-step.value);
+    }
+
+    // 上限
+    ConstValue limit;
+    bool limit_is_const = fold_constant(cond->right, limit);
+    VariableExpr *limit_var = ast_cast<VariableExpr>(cond->right);
+    if (!limit_is_const && !(limit_var && limit_var->name != name && __scope__.top().count(limit_var->name))) return false;
+
+    std::unordered_set<std::string> assigned;
+    for (size_t i = 0; i < stmt->body->statements.size(); i++) collect_assigned(stmt->body->statements[i], assigned);
+    if (assigned.count(name)) return false;
+    if (!limit_is_const && assigned.count(limit_var->name)) return false;
+
+    // 计数器、上限、步长放在连续的三个寄存器中，计数器就是循环变量自己的寄存器
+    int base = __tmp_counter__;
+    __tmp_counter__ += 3;
+    if (init->initializer) compile_into(init->initializer, base);
+    else emit_int(0, base);
+    __const_regs__.erase(base);
+    __scope__.top()[name] = base;
+
+    if (limit_is_const) emit_constant(limit, base + 1);
+    else __chunk__.write(OP_SET_LOCAL, __scope__.top()[limit_var->name], 0, base + 1);
+    emit_constant(step, base + 2);
+
+    // 第一次进入循环之前的检查；和普通的 for 一样占用一个分支编号，后面的分支在各个优化级别下编号才一致
+    int cond_reg = __tmp_counter__++;
+    __chunk__.write(kind, base, base + 1, cond_reg);
+    int exit_line = static_cast<int> (__chunk__.__code__.size());
+    __chunk__.write(OP_JUMP_IF_FALSE, cond_reg, next_branch_id(), 0);
+
+    int body_start = static_cast<int> (__chunk__.__code__.size());
+    __loop__.push(new Loop(-1));
+    int _origin_next_reg_ = __tmp_counter__;
+    compile_block(stmt->body);
+    __max_reg_count__ = std::max(__tmp_counter__, __max_reg_count__);
+    __tmp_counter__ = _origin_next_reg_;
 
+    int loop_line = static_cast<int> (__chunk__.__code__.size());
+    __chunk__.write(OP_FORLOOP, base, kind, body_start);
+
+    Loop *l = __loop__.top(); __loop__.pop();
+    for (int pc : l->_continue_jump_) {
+        __chunk__.__code__[pc].arg1 = loop_line;
+    }
     int after_loop = static_cast<int> (__chunk__.__code__.size());
     for (int pc : l->_break_jump_) {
         __chunk__.__code__[pc].arg1 = after_loop;
@@ -323,9 +928,11 @@ void Compiler::compile_while_stmt(WhileStmt *stmt) {
     __chunk__.__code__[exit_line].result = after_loop;
 
     delete l;
+    return true;
 }
 
 void Compiler::compile_for_stmt(ForStmt *stmt) {
+    if (__options__.opt_level >= 1 && compile_counted_for(stmt)) return;
     
     if (stmt->initializer) {
         compile_stmt(stmt->initializer);
@@ -341,11 +948,14 @@ void Compiler::compile_for_stmt(ForStmt *stmt) {
     }
     // std::cout << "Compile cond expr."<<std::endl;
 
-    int exit_line = -1;
+    int exit_line = -1, branch_id = 0;
     if (stmt->condition) {
+        branch_id = next_branch_id();
         exit_line = static_cast<int> (__chunk__.__code__.size());
-        __chunk__.write(OP_JUMP_IF_FALSE, cond_reg, 0, 0);
+        __chunk__.write(OP_JUMP_IF_FALSE, cond_reg, branch_id, 0);
     }
+    bool rotate = branch_mostly_true(branch_id); // 和 while 一样
+    int body_start = static_cast<int> (__chunk__.__code__.size());
 
     __loop__.push(new Loop(-1));
     int _origin_next_reg_ = __tmp_counter__;
@@ -362,7 +972,13 @@ void Compiler::compile_for_stmt(ForStmt *stmt) {
         compile_expr(stmt->increment);
     }
 
-    __chunk__.write(OP_JUMP, loop_start, 0, 0);
+    if (rotate) {
+        int again_reg = compile_expr(stmt->condition);
+        __chunk__.write(OP_JUMP_IF_TRUE, again_reg, branch_id, body_start);
+        __pgo_rotated__++;
+    } else {
+        __chunk__.write(OP_JUMP, loop_start, 0, 0);
+    }
 
     Loop *l = __loop__.top(); __loop__.pop();
     // std::cout<<"Popped out loop context "<<l<<std::endl;
@@ -385,8 +1001,7 @@ void Compiler::compile_for_stmt(ForStmt *stmt) {
 
 void Compiler::compile_continue_stmt(ContinueStmt *stmt) {
     if (__loop__.empty()) {
-        std::cerr << "Continue outside loop."<<std::endl;
-        exit(1);
+        throw CompileError("Continue outside loop.");
     }
 
     Loop *l = __loop__.top();
@@ -401,8 +1016,7 @@ void Compiler::compile_continue_stmt(ContinueStmt *stmt) {
 void Compiler::compile_break_stmt(BreakStmt *stmt) {
     // std::cout<<"Compiling break statement..."<<std::endl;
     if (__loop__.empty()) {
-        std::cerr << "Break outside loop" <<std::endl;
-        exit(1);
+        throw CompileError("Break outside loop");
     }
 
     Loop *l = __loop__.top();
@@ -413,15 +1027,28 @@ void Compiler::compile_break_stmt(BreakStmt *stmt) {
 
 void Compiler::compile_let_stmt(LetStmt *stmt) {
     int reg = -1;
+    int mark = __tmp_counter__;
     if (stmt->initializer) {
         reg = compile_expr(stmt->initializer);
     } else {
-        int zero_idx = __chunk__.add_const_number(0.0);
-        reg = __tmp_counter__++;
-        __chunk__.write(OP_CONSTANT, zero_idx, 0, reg);
+        reg = emit_int(0, __tmp_counter__++);
+    }
+
+    // 初始值本来就在一个新的临时寄存器中，直接把它当作变量的寄存器
+    // 如果初始值是别的变量的寄存器（let y = x;），还是要拷贝一份
+    if (reg < mark) {
+        __chunk__.write(OP_REGISTER_LOCAL, reg, 0, __tmp_counter__++);
+        reg = __tmp_counter__ - 1;
     }
-    __chunk__.write(OP_REGISTER_LOCAL, reg, 0, __tmp_counter__++);
-    __scope__.top()[stmt->name] = __tmp_counter__ - 1;
+
+    // 从来没有被赋值过的变量，如果初始值是常量，之后用到它的表达式都可以在编译期算出来
+    ConstValue value;
+    if (!__assigned_names__.count(stmt->name) && (!stmt->initializer || fold_constant(stmt->initializer, value))) {
+        __const_regs__[reg] = value;
+    } else {
+        __const_regs__.erase(reg);
+    }
+    __scope__.top()[stmt->name] = reg;
 }
 
 void Compiler::compile_expr_stmt(ExprStmt *stmt) {
@@ -430,24 +1057,247 @@ void Compiler::compile_expr_stmt(ExprStmt *stmt) {
 
 void Compiler::compile_func_stmt(FuncStmt *stmt) {
     // std::cout<<"Compiling function " << stmt->name <<std::endl;
-    if (__user_def_func__.find(stmt->name) != __user_def_func__.end()) {
-        std::cerr << "Redeclare of function " << stmt->name << std::endl;
-        exit(1);
+    if (__user_def_func__.find(stmt->name) != __user_def_func__.end() || __lazy_funcs__.count(stmt->name)) {
+        throw CompileError("Redeclare of function " + stmt->name);
+    }
+
+    // 调用时内置函数优先，和内置函数同名的用户函数永远不会被调用，所以直接报错
+    if (__options__.builtins.count(stmt->name)) {
+        throw CompileError("Function " + stmt->name + " has the same name as a builtin function");
     }
 
     if (__type__ == FunctionCompiler) {
-        std::cerr << "You cannot declare a function within a function" << std::endl;
+        throw CompileError("You cannot declare a function within a function");
+    }
+
+    std::unordered_map<FuncStmt *, int>::iterator id = __func_ids__.find(stmt);
+    if (__options__.lazy) {
+        LazyFunc lazy;
+        lazy.stmt = stmt;
+        lazy.func_index = id != __func_ids__.end() ? id->second : __next_func_index__++;
+        __lazy_funcs__[stmt->name] = lazy;
+        return;
+    }
+
+    // 并行编译过的函数直接取结果，错误也在这里才报告，所以报告的总是源码中的第一个错误
+    CompiledFunc local(stmt->name, stmt->params);
+    CompiledFunc *compiled = &local;
+    std::unordered_map<FuncStmt *, CompiledFunc>::iterator it = __precompiled__.find(stmt);
+    if (it != __precompiled__.end()) {
+        compiled = &it->second;
+    } else {
+        compile_function(stmt, id != __func_ids__.end() ? id->second : __next_func_index__++, local);
+    }
+
+    __log__ << compiled->log;
+    if (!compiled->ok) throw CompileError(compiled->error);
+
+    __user_def_func__.emplace(stmt->name, std::move(compiled->fn));
+    __func_order__.push_back(stmt->name);
+    if (it != __precompiled__.end()) __precompiled__.erase(it);
+}
+
+// 用一个新的函数编译器编译函数体。函数体不能引用外面的变量，只读取主程序的函数名表和编译选项，所以可以并行执行
+void Compiler::compile_function(FuncStmt *stmt, int func_index, CompiledFunc &out) const {
+    Compiler fn_compiler(FunctionCompiler, stmt->params);
+    fn_compiler.__parent__ = this;
+    fn_compiler.__options__ = __options__;
+    fn_compiler.__name__ = stmt->name;
+    fn_compiler.__func_index__ = func_index;
+
+    try {
+        fn_compiler.compile(Parser::parse_body(stmt));
+        // 函数的 Chunk 之后还要内联和编码，不能用 take_chunk
+        out.fn.__chunk__ = std::move(fn_compiler.__chunk__);
+        out.ok = true;
+    } catch (const CompileError &e) {
+        out.error = e.what();
+    }
+    out.log = fn_compiler.__log__.str();
+}
+
+// --lazy：VM 第一次调用 name 时编译它，name 不是登记过的函数时返回 false
+// 函数体的编译流程和提前编译一样，只是调用方已经编译完了，不会再内联它。可能在 pmap 的工作线程中调用，所以只读取编译器的状态
+// 编译错误在这时才报告，没有调用过的函数中的错误不会被发现
+bool Compiler::compile_lazy(const std::string &name, Func &out) const {
+    std::unordered_map<std::string, LazyFunc>::const_iterator it = __lazy_funcs__.find(name);
+    if (it == __lazy_funcs__.end()) return false;
+
+    CompiledFunc compiled(name, it->second.stmt->params);
+    compile_function(it->second.stmt, it->second.func_index, compiled);
+    // 多个工作线程可能同时编译不同的函数，日志先写到自己的缓冲区，最后加锁一次输出，不同函数的日志不会交错
+    static std::mutex log_mutex;
+    if (!compiled.ok) {
+        std::lock_guard<std::mutex> lock(log_mutex);
+        std::cout << compiled.log << std::flush;
+        std::cerr << compiled.error << std::endl;
         exit(1);
     }
 
-    Func fn(stmt->name, stmt->params);
-    Compiler* fn_compiler = new Compiler(FunctionCompiler, stmt->params);
-    
-    fn_compiler->compile(stmt->body);
+    std::ostringstream log;
+    log << compiled.log;
+    Chunk &chunk = compiled.fn.__chunk__;
+    if (__options__.opt_level >= 1) {
+        Optimizer::TypeStats stats = Optimizer::specialize_types(chunk, static_cast<int>(compiled.fn.params.size()));
+        if (__options__.report) {
+            log << "[types] " << name << ": " << stats.proven << "/" << stats.sites << " arithmetic sites proven numeric" << std::endl;
+        }
+    }
+    Optimizer::encode(chunk, __options__.instrument);
+    {
+        std::lock_guard<std::mutex> lock(log_mutex);
+        std::cout << log.str();
+    }
+    chunk.drop_compile_data();
+    out = std::move(compiled.fn);
+    return true;
+}
 
-    fn.__chunk__ = fn_compiler->get_chunk();
-    __user_def_func__.insert({stmt->name, fn});
+// -j：把顶层函数分给线程池编译，结果在 compile_func_stmt 中按源码顺序合并
+void Compiler::precompile_functions(const std::vector<FuncStmt *> &funcs) {
+    std::vector<CompiledFunc> results;
+    results.reserve(funcs.size());
+    for (size_t i = 0; i < funcs.size(); i++) results.push_back(CompiledFunc(funcs[i]->name, funcs[i]->params));
+
+    // 每个任务编译连续的一段函数，任务数是线程数的几倍，函数大小不均匀时也能分得比较平均
+    size_t threads = std::min(static_cast<size_t>(__options__.jobs), funcs.size());
+    size_t groups = std::min(funcs.size(), threads * 8);
+    std::vector<std::function<void()>> tasks;
+    for (size_t g = 0; g < groups; g++) {
+        size_t first = funcs.size() * g / groups, last = funcs.size() * (g + 1) / groups;
+        tasks.push_back([this, &funcs, &results, first, last]() {
+            for (size_t i = first; i < last; i++) compile_function(funcs[i], __func_ids__.find(funcs[i])->second, results[i]);
+        });
+    }
+    ThreadPool pool(threads);
+    pool.run_batch(tasks);
 
+    for (size_t i = 0; i < funcs.size(); i++) __precompiled__.insert(std::make_pair(funcs[i], std::move(results[i])));
+}
+
+void Compiler::compile_body(Block *block) {
+    if (__type__ == MainCompiler) {
+        std::vector<FuncStmt *> funcs;
+        for (size_t i = 0; i < block->statements.size(); i++) {
+            if (FuncStmt *s = ast_cast<FuncStmt>(block->statements[i])) {
+                __func_names__.insert(s->name);
+                __func_ids__[s] = static_cast<int>(funcs.size()) + 1;
+                funcs.push_back(s);
+            }
+        }
+        __next_func_index__ = static_cast<int>(funcs.size()) + 1;
+        if (__options__.jobs > 1 && funcs.size() > 1 && !__options__.lazy) precompile_functions(funcs);
+    }
+    for (size_t i = 0; i < block->statements.size(); i++) {
+        collect_assigned(block->statements[i], __assigned_names__);
+    }
+
+    for(size_t i = 0; i < block->statements.size(); i++) {
+        compile_stmt(block->statements[i]);
+    }
+    finish_compile();
+}
+
+// 把小的、非递归的用户函数内联到调用它的地方
+// 先处理函数（按照声明顺序），再处理主程序
+void Compiler::inline_functions() {
+    static const size_t INLINE_MAX_SIZE = 32;     // 被内联的函数最多有多少条指令
+    static const size_t INLINE_GROWTH = 2048;     // 每个调用方最多因为内联增加多少条指令
+    static const size_t INLINE_HOT_MAX_SIZE = 96; // profile 中的热函数放宽大小限制
+    const Profile *profile = __options__.profile;
+
+    // 调用图
+    std::unordered_map<std::string, std::vector<std::string>> calls;
+    for (size_t i = 0; i < __func_order__.size(); i++) {
+        std::vector<std::string> targets = Optimizer::call_targets(__user_def_func__.find(__func_order__[i])->second.__chunk__);
+        std::vector<std::string> &out = calls[__func_order__[i]];
+        for (size_t j = 0; j < targets.size(); j++) {
+            if (!targets[j].empty() && __user_def_func__.count(targets[j])) out.push_back(targets[j]);
+        }
+    }
+
+    std::unordered_map<std::string, Optimizer::InlineCandidate> candidates;
+    for (size_t i = 0; i < __func_order__.size(); i++) {
+        const std::string &name = __func_order__[i];
+        const Func &fn = __user_def_func__.find(name)->second;
+        if (__options__.builtins.count(name)) continue;
+        // 有 profile 的时候，没有被调用过的函数不值得内联
+        if (profile && profile->call_count(name) == 0) continue;
+        size_t max_size = profile && profile->hot(name) ? INLINE_HOT_MAX_SIZE : INLINE_MAX_SIZE;
+        if (fn.__chunk__.__code__.size() > max_size) continue;
+        if (!Optimizer::inlinable(fn.__chunk__, static_cast<int>(fn.params.size()))) continue;
+
+        // 能沿着调用图回到自己的函数是递归的，不内联
+        std::vector<std::string> stack(calls[name]);
+        std::unordered_set<std::string> visited;
+        bool recursive = false;
+        while (!stack.empty() && !recursive) {
+            std::string f = stack.back(); stack.pop_back();
+            if (f == name) recursive = true;
+            if (!visited.insert(f).second) continue;
+            stack.insert(stack.end(), calls[f].begin(), calls[f].end());
+        }
+        if (recursive) continue;
+
+        Optimizer::InlineCandidate c;
+        c.chunk = &fn.__chunk__;
+        c.param_count = static_cast<int>(fn.params.size());
+        c.max_size = max_size;
+        candidates[name] = c;
+    }
+    if (candidates.empty()) return;
+
+    for (size_t i = 0; i < __func_order__.size(); i++) {
+        Func &fn = __user_def_func__.find(__func_order__[i])->second;
+        size_t count = Optimizer::inline_calls(fn.__chunk__, candidates, INLINE_GROWTH);
+        if (count == 0) continue;
+        if (__options__.report) __log__ << "[inline] " << fn.name << ": " << count << " call sites inlined" << std::endl;
+        finish_chunk(fn.__chunk__, static_cast<int>(fn.params.size()), fn.name);
+    }
+
+    size_t count = Optimizer::inline_calls(__chunk__, candidates, INLINE_GROWTH);
+    if (count > 0 && __options__.report) __log__ << "[inline] " << __name__ << ": " << count << " call sites inlined" << std::endl;
+}
+
+// 所有优化都做完之后，对每个函数和主程序做类型推导，换上不检查类型的数值指令
+void Compiler::infer_types() {
+    size_t sites = 0, proven = 0;
+    for (size_t i = 0; i <= __func_order__.size(); i++) {
+        Chunk *chunk = &__chunk__;
+        int param_count = __param_count__;
+        const std::string *name = &__name__;
+        if (i < __func_order__.size()) {
+            Func &fn = __user_def_func__.find(__func_order__[i])->second;
+            chunk = &fn.__chunk__;
+            param_count = static_cast<int>(fn.params.size());
+            name = &fn.name;
+        }
+
+        Optimizer::TypeStats stats = Optimizer::specialize_types(*chunk, param_count);
+        if (__options__.report) {
+            __log__ << "[types] " << *name << ": " << stats.proven << "/" << stats.sites << " arithmetic sites proven numeric" << std::endl;
+        }
+        sites += stats.sites;
+        proven += stats.proven;
+    }
+    if (__options__.report && sites > 0) {
+        __log__ << "[types] total: " << proven << "/" << sites << " (" << proven * 100 / sites << "%)" << std::endl;
+    }
+}
+
+// 主程序和每个函数都编码成 VM 执行的紧凑字节码
+void Compiler::encode_chunks() {
+    size_t insts = 0, bytes = 0, wide = 0;
+    for (size_t i = 0; i <= __func_order__.size(); i++) {
+        Chunk &chunk = i < __func_order__.size() ? __user_def_func__.find(__func_order__[i])->second.__chunk__ : __chunk__;
+        wide += Optimizer::encode(chunk, __options__.instrument);
+        insts += chunk.__code__.size();
+        bytes += chunk.__bytecode__.size() * sizeof(CompactInst);
+    }
+    if (__options__.report) {
+        __log__ << "[encode] total: " << insts << " instructions, " << bytes << " bytes (was " << insts * sizeof(Instruction)
+                << "), " << wide << " with OP_WIDE" << std::endl;
+    }
 }
 
 void Compiler::compile_return_stmt(ReturnStmt *stmt) {
@@ -460,9 +1310,7 @@ void Compiler::compile_return_stmt(ReturnStmt *stmt) {
     if (stmt->expr) {
         reg = compile_expr(stmt->expr);
     } else {
-        int zero_idx = __chunk__.add_const_number(0.0);
-        reg = __tmp_counter__++;
-        __chunk__.write(OP_CONSTANT, zero_idx, 0, reg);
+        reg = emit_int(0, __tmp_counter__++);
     }
     __chunk__.write(OP_RETURN_VAL, reg, 0, 0);
 }
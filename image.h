@@ -0,0 +1,241 @@
+/*************************************************************************
+	> File Name: image.h
+	> Author: Bryan Si (SeongLam)
+	> Created Time: Mon Oct 19 21:36:52 2026
+ ************************************************************************/
+
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include "instruction.h"
+#include "optimizer.h"
+#include<string>
+#include<vector>
+#include<cstring>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<fcntl.h>
+#include<unistd.h>
+
+// 只读的字节码镜像（.mlc 文件），VM 可以直接在 mmap 进来的文件上执行，不需要反序列化
+// 镜像中所有的引用都是相对于文件开头的偏移，和映射到哪个地址无关，所以多个进程可以共享同一份物理页
+//
+// 布局（本机字节序，每一段都按 8 字节对齐）：
+//   ImageHeader
+//   各个 Chunk：CompactInst[] double[] StrRef[] 和 ImageChunk
+//   ImageFunc[func_count]
+//   u32 buckets[bucket_count]：按函数名的哈希分桶，值为函数下标 + 1，0 表示空桶，同一个桶里的函数用 ImageFunc::next 串起来
+//   字符串的内容（常量、函数名）穿插在中间，不对齐
+
+static const unsigned int IMAGE_VERSION = 4;
+
+struct ImageHeader {
+    char magic[4];                  // "MLC2"
+    unsigned int version;
+    unsigned long long key;         // 见 BytecodeCache::make_key
+    unsigned long long size;        // 整个镜像的字节数
+    unsigned long long main_chunk;  // 主程序 ImageChunk 的偏移
+    unsigned long long funcs;       // ImageFunc 数组的偏移
+    unsigned long long buckets;     // 哈希桶数组的偏移
+    unsigned int func_count;
+    unsigned int bucket_count;
+};
+
+struct ImageChunk {
+    int reg_count;                  // 字节码实际用到的寄存器数量（不少于参数个数），见 image_registers
+    unsigned int code_count;
+    unsigned int num_count;
+    unsigned int str_count;
+    unsigned long long code;        // CompactInst[code_count]
+    unsigned long long nums;        // double[num_count]
+    unsigned long long strs;        // StrRef[str_count]
+};
+
+struct ImageFunc {
+    StrRef name;
+    unsigned long long chunk;       // ImageChunk 的偏移
+    unsigned int param_count;
+    unsigned int next;              // 同一个桶里的下一个函数的下标 + 1
+};
+
+// BytecodeImage::find 的结果
+enum ImageLookup {
+    IMAGE_FOUND,
+    IMAGE_MISSING,
+    IMAGE_INVALID,  // 找到了，但是字节码不合法（镜像文件损坏）
+};
+
+// 字节码实际用到的寄存器数量：最大的寄存器编号 + 1，至少是参数个数
+// 编译器给的寄存器数量可能更大（-O0 不回收临时寄存器），镜像中只保存这个值，加载时要求 reg_count 和它完全相同
+static inline int image_registers(const CompactInst *code, size_t size, int param_count) {
+    int used = param_count;
+    std::vector<int> regs;
+    for (size_t pc = 0; pc < size; ) {
+        Instruction inst = decode_inst(code, pc);
+        regs.clear();
+        Optimizer::inst_uses(inst, regs);
+        regs.push_back(Optimizer::inst_def(inst));
+        for (size_t i = 0; i < regs.size(); i++) used = std::max(used, regs[i] + 1);
+    }
+    return used;
+}
+
+// 函数名哈希（32 位 FNV-1a），写镜像和查找时使用同一个函数
+static inline unsigned int image_hash(const char *s, size_t n) {
+    unsigned int h = 2166136261u;
+    for (size_t i = 0; i < n; i++) {
+        h ^= static_cast<unsigned char>(s[i]);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+class BytecodeImage {
+    void *__map__;
+    size_t __size__;
+    const char *__base__;
+    const ImageHeader *__header__;
+
+    BytecodeImage(void *map, size_t size) : __map__(map), __size__(size), __base__(static_cast<const char *>(map)),
+        __header__(static_cast<const ImageHeader *>(map)) {}
+
+    // [offset, offset + count * elem) 在镜像内，并且按 align 对齐
+    bool in_range(unsigned long long offset, unsigned long long count, size_t elem, size_t align) const {
+        if (offset > __size__ || offset % align != 0) return false;
+        return count <= (__size__ - offset) / elem;
+    }
+
+    // 只在第一次用到某个 Chunk 时检查：寄存器、跳转目标、常量下标都不能越界，否则 VM 会访问到寄存器文件或者常量池之外
+    // 跳转目标还必须是一条指令的开头，不能落在 OP_WIDE 和它修饰的指令中间
+    // 寄存器数量也不能超过指令实际用到的数量，否则一个被改坏的 reg_count 会让 VM 分配巨大的寄存器文件，这时按缓存失效处理
+    static bool valid_chunk(const ChunkView &chunk, size_t param_count) {
+        if (param_count > static_cast<size_t>(chunk.reg_count)) return false;
+        int used = static_cast<int>(param_count);
+        int size = static_cast<int>(chunk.code_size);
+        std::vector<bool> starts(chunk.code_size + 1, false);
+        std::vector<int> targets;
+        std::vector<int> regs;
+        for (size_t pc = 0; pc < chunk.code_size; ) {
+            starts[pc] = true;
+            if (chunk.code[pc].op == OP_WIDE && (pc + 1 >= chunk.code_size || chunk.code[pc + 1].op == OP_WIDE)) return false;
+            Instruction inst = decode_inst(chunk.code, pc);
+            if (inst.op > OP_HALT) return false;
+
+            regs.clear();
+            Optimizer::inst_uses(inst, regs);
+            // inst_def 用 -1 表示没有写入的寄存器，先把操作数清零判断这条指令是否写寄存器
+            Instruction probe(inst.op);
+            if (Optimizer::inst_def(probe) == 0) regs.push_back(Optimizer::inst_def(inst));
+            for (size_t i = 0; i < regs.size(); i++) {
+                if (regs[i] < 0 || regs[i] >= chunk.reg_count) return false;
+                used = std::max(used, regs[i] + 1);
+            }
+
+            if (inst.op == OP_CALL && (inst.arg2 < 0 || inst.arg2 > inst.result)) return false;
+            if (inst.op == OP_NEW_ARRAY && inst.arg2 < 0) return false;
+            if (Optimizer::is_jump(inst)) {
+                int t = Optimizer::jump_target(static_cast<const Instruction &>(inst));
+                if (t < 0 || t > size) return false;
+                targets.push_back(t);
+            }
+            if (inst.op == OP_CONSTANT) {
+                if (inst.arg1 >= 0 && static_cast<size_t>(inst.arg1) >= chunk.num_count) return false;
+                if (inst.arg1 < 0 && static_cast<size_t>(~inst.arg1) >= chunk.str_count) return false;
+            }
+        }
+        if (chunk.reg_count > used) return false;
+        starts[chunk.code_size] = true;
+        for (size_t i = 0; i < targets.size(); i++) {
+            if (!starts[targets[i]]) return false;
+        }
+        return true;
+    }
+
+    bool chunk_at(unsigned long long offset, size_t param_count, ChunkView &out) const {
+        if (!in_range(offset, 1, sizeof(ImageChunk), 8)) return false;
+        const ImageChunk &c = *reinterpret_cast<const ImageChunk *>(__base__ + offset);
+        if (c.reg_count < 0) return false;
+        if (!in_range(c.code, c.code_count, sizeof(CompactInst), 8)) return false;
+        if (!in_range(c.nums, c.num_count, sizeof(double), 8)) return false;
+        if (!in_range(c.strs, c.str_count, sizeof(StrRef), 8)) return false;
+
+        const StrRef *refs = reinterpret_cast<const StrRef *>(__base__ + c.strs);
+        for (unsigned int i = 0; i < c.str_count; i++) {
+            if (!in_range(refs[i].offset, refs[i].length, 1, 1)) return false;
+        }
+
+        ChunkView view;
+        view.code = reinterpret_cast<const CompactInst *>(__base__ + c.code);
+        view.code_size = c.code_count;
+        view.nums = reinterpret_cast<const double *>(__base__ + c.nums);
+        view.num_count = c.num_count;
+        view.str_count = c.str_count;
+        view.image = __base__;
+        view.str_refs = refs;
+        view.reg_count = c.reg_count;
+        if (!valid_chunk(view, param_count)) return false;
+
+        out = view;
+        return true;
+    }
+
+public:
+
+    ~BytecodeImage() {
+        munmap(__map__, __size__);
+    }
+
+    // 映射镜像文件，只检查文件头，所以不管镜像多大都是 O(1) 的
+    // 文件不存在、key 不同或者文件头不合法都返回 NULL
+    static BytecodeImage *open(const std::string &path, unsigned long long key) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return NULL;
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(ImageHeader)) {
+            close(fd);
+            return NULL;
+        }
+        size_t size = static_cast<size_t>(st.st_size);
+        void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) return NULL;
+
+        BytecodeImage *image = new BytecodeImage(map, size);
+        const ImageHeader &h = *image->__header__;
+        if (std::memcmp(h.magic, "MLC2", 4) != 0 || h.version != IMAGE_VERSION || h.key != key || h.size != size ||
+            !image->in_range(h.funcs, h.func_count, sizeof(ImageFunc), 8) ||
+            !image->in_range(h.buckets, h.bucket_count, sizeof(unsigned int), 4) ||
+            (h.func_count > 0 && h.bucket_count == 0)) {
+            delete image;
+            return NULL;
+        }
+        return image;
+    }
+
+    bool main_chunk(ChunkView &out) const {
+        return chunk_at(__header__->main_chunk, 0, out);
+    }
+
+    // 按函数名在镜像的哈希表中查找，找到的函数在这里才检查字节码
+    ImageLookup find(const std::string &name, size_t &param_count, ChunkView &out) const {
+        const ImageHeader &h = *__header__;
+        if (h.bucket_count == 0) return IMAGE_MISSING;
+
+        const ImageFunc *funcs = reinterpret_cast<const ImageFunc *>(__base__ + h.funcs);
+        const unsigned int *buckets = reinterpret_cast<const unsigned int *>(__base__ + h.buckets);
+        unsigned int idx = buckets[image_hash(name.data(), name.size()) % h.bucket_count];
+        for (unsigned int steps = 0; idx != 0 && idx <= h.func_count && steps < h.func_count; steps++) {
+            const ImageFunc &f = funcs[idx - 1];
+            if (!in_range(f.name.offset, f.name.length, 1, 1)) return IMAGE_INVALID;
+            if (f.name.length == name.size() && std::memcmp(__base__ + f.name.offset, name.data(), name.size()) == 0) {
+                param_count = f.param_count;
+                return chunk_at(f.chunk, f.param_count, out) ? IMAGE_FOUND : IMAGE_INVALID;
+            }
+            idx = f.next;
+        }
+        return IMAGE_MISSING;
+    }
+};
+
+#endif
@@ -8,9 +8,13 @@
 #define INSTRUCTION_H
 
 #include<string>
+#include<vector>
+#include<unordered_map>
+#include<cstring>
 
 enum Opcode {
     OP_CONSTANT,
+    OP_LOAD_INT,        // 整数立即数：arg1 为低 32 位，arg2 为高 32 位
     OP_GET_LOCAL,
     OP_SET_LOCAL,
     OP_REGISTER_LOCAL,
@@ -19,16 +23,32 @@ enum Opcode {
     OP_MUL,
     OP_DIV,
     OP_EQUAL,
+    OP_NOT_EQUAL,       // 由 peephole 把 OP_EQUAL + OP_NOT 合并得到
     OP_GREATER,
     OP_LESS,
     OP_GREATER_EQUAL,
     OP_LESS_EQUAL,
     OP_NOT,
     OP_JUMP,
-    OP_JUMP_IF_FALSE,
+    OP_JUMP_IF_FALSE,   // arg1: 条件, arg2: 分支编号 (profile 使用，0 表示没有), result: 跳转目标
+    OP_JUMP_IF_TRUE,    // 和 OP_JUMP_IF_FALSE 相反，profile 显示条件多半成立时用来翻转分支
     OP_CALL,
     OP_DECL_FUNC,
     OP_RETURN_VAL,
+    OP_NEW_ARRAY,       // arg1: 元素起始寄存器, arg2: 元素个数, result: 目标寄存器
+    OP_GET_INDEX,       // result = arg1[arg2]
+    OP_SET_INDEX,       // arg1[arg2] = result，注意这里 result 是被读取的寄存器
+    OP_FORLOOP,         // 计数循环：arg1 = A 为计数器，A + 1 为上限，A + 2 为步长；A += 步长，按 arg2 (OP_LESS 等) 和上限比较，成立则跳到 result
+    // 类型推导证明了两个操作数都是数字之后使用的版本，执行时不再检查类型标签
+    OP_ADD_NUM,
+    OP_SUB_NUM,
+    OP_MUL_NUM,
+    OP_DIV_NUM,
+    OP_GREATER_NUM,
+    OP_LESS_NUM,
+    OP_GREATER_EQUAL_NUM,
+    OP_LESS_EQUAL_NUM,
+    OP_WIDE,            // 紧凑编码的前缀：三个操作数是下一条指令三个操作数的高 16 位，只出现在 __bytecode__ 中
     OP_HALT,
 };
 
@@ -40,20 +60,57 @@ struct Instruction {
     Instruction(Opcode op, int arg1, int arg2, int res) : op(op), arg1(arg1), arg2(arg2), result(res) {}
 };
 
+// VM 执行的紧凑编码，一条指令 8 个字节：8 位操作码 + 3 个有符号 16 位操作数
+// 超出 16 位的操作数（很大的常量下标和跳转目标、OP_LOAD_INT 的立即数等）由前面的一条 OP_WIDE 补上高 16 位
+struct CompactInst {
+    unsigned char op;
+    unsigned char unused;
+    short arg1, arg2, result;
+
+    CompactInst() : op(OP_HALT), unused(0), arg1(0), arg2(0), result(0) {}
+    CompactInst(Opcode op, short arg1, short arg2, short result) : op(static_cast<unsigned char>(op)), unused(0), arg1(arg1), arg2(arg2), result(result) {}
+};
+
+static_assert(OP_HALT < 256, "opcode must fit in CompactInst::op");
+static_assert(sizeof(CompactInst) == 8, "CompactInst must be 8 bytes");
+
+// 解码 pc 处的一条指令，pc 移到下一条指令
+static inline Instruction decode_inst(const CompactInst *code, size_t &pc) {
+    CompactInst inst = code[pc++];
+    if (inst.op != OP_WIDE) return Instruction(static_cast<Opcode>(inst.op), inst.arg1, inst.arg2, inst.result);
+
+    CompactInst low = code[pc++];
+    return Instruction(static_cast<Opcode>(low.op),
+                       static_cast<int>(static_cast<unsigned int>(inst.arg1) << 16 | static_cast<unsigned short>(low.arg1)),
+                       static_cast<int>(static_cast<unsigned int>(inst.arg2) << 16 | static_cast<unsigned short>(low.arg2)),
+                       static_cast<int>(static_cast<unsigned int>(inst.result) << 16 | static_cast<unsigned short>(low.result)));
+}
+
 class Chunk {
 public: 
-    std::vector<Instruction> __code__;
+    std::vector<Instruction> __code__;      // 编译和优化使用的指令
+    std::vector<CompactInst> __bytecode__;  // 全部优化完之后由 Optimizer::encode 从 __code__ 生成，VM 执行这份
     std::vector<double> __const_num__;
     std::vector<std::string> __const_str__;
 
     int __reg_count__ = 0;
 
+    // 常量池的索引，相同的常量只保存一份；数字按二进制位比较，所以 0.0 和 -0.0 是两个常量
+    std::unordered_map<unsigned long long, size_t> __num_index__;
+    std::unordered_map<std::string, size_t> __str_index__;
+
     void write(Opcode op, int arg1, int arg2, int result) {
         __code__.push_back(Instruction(op, arg1, arg2, result));
     }
 
     size_t add_const_number(double val) {
+        unsigned long long bits;
+        std::memcpy(&bits, &val, sizeof(bits));
+        std::unordered_map<unsigned long long, size_t>::iterator it = __num_index__.find(bits);
+        if (it != __num_index__.end()) return it->second;
+
         __const_num__.push_back(val);
+        __num_index__[bits] = __const_num__.size() - 1;
         return __const_num__.size() - 1;
     }
 
@@ -62,17 +119,56 @@ public:
     }
 
     size_t add_const_str(std::string str) {
+        std::unordered_map<std::string, size_t>::iterator it = __str_index__.find(str);
+        if (it != __str_index__.end()) return it->second;
+
         __const_str__.push_back(str);
+        __str_index__[str] = __const_str__.size() - 1;
         return __const_str__.size() - 1;
     }
 
-    Chunk& operator=(const Chunk& right) {
-        if (&right == this) return *this;
-        __code__ = right.__code__;
-        __const_num__ = right.__const_num__;
-        __const_str__ = right.__const_str__;
-        __reg_count__ = right.__reg_count__;
-        return *this;
+    // 编译完成、交给 VM 之前调用：VM 只执行 __bytecode__，编译用的指令和常量池的索引都不再需要
+    void drop_compile_data() {
+        std::vector<Instruction>().swap(__code__);
+        std::unordered_map<unsigned long long, size_t>().swap(__num_index__);
+        std::unordered_map<std::string, size_t>().swap(__str_index__);
+    }
+};
+
+// 字节码镜像中的字符串：相对于镜像开头的偏移和长度
+struct StrRef {
+    unsigned long long offset;
+    unsigned long long length;
+};
+
+// VM 执行时看到的只读 Chunk：字节码和常量池都是指针 + 长度
+// 既可以指向编译器生成的 Chunk 中的 vector，也可以直接指向 mmap 进来的字节码镜像（见 image.h），不需要拷贝
+struct ChunkView {
+    const CompactInst *code;
+    size_t code_size;       // CompactInst 的条数，OP_WIDE 前缀也算一条
+    const double *nums;
+    size_t num_count;
+    size_t str_count;
+    const std::string *strs;    // 来自 Chunk 时的字符串常量
+    const char *image;          // 来自镜像时，str_refs 中的偏移相对于 image
+    const StrRef *str_refs;
+    int reg_count;
+
+    ChunkView() : code(NULL), code_size(0), nums(NULL), num_count(0), str_count(0), strs(NULL), image(NULL), str_refs(NULL), reg_count(0) {}
+
+    // chunk 必须比这个视图活得久
+    explicit ChunkView(const Chunk &chunk) : code(chunk.__bytecode__.data()), code_size(chunk.__bytecode__.size()),
+        nums(chunk.__const_num__.data()), num_count(chunk.__const_num__.size()), str_count(chunk.__const_str__.size()),
+        strs(chunk.__const_str__.data()), image(NULL), str_refs(NULL), reg_count(chunk.__reg_count__) {}
+
+    // 第 i 个字符串常量的内容，直接指向 Chunk 或者镜像中的数据，不拷贝
+    const char *str_data(size_t i, size_t &length) const {
+        if (strs) {
+            length = strs[i].size();
+            return strs[i].data();
+        }
+        length = static_cast<size_t>(str_refs[i].length);
+        return image + str_refs[i].offset;
     }
 };
 
@@ -82,7 +82,7 @@ private:
 
 public:
 
-    explicit Lexer(const std::string &source) : __source__(source), __pos__(0), __start__(0), __current_char__('\0') {
+    explicit Lexer(std::string source) : __source__(std::move(source)), __pos__(0), __start__(0), __current_char__('\0') {
     }
 
     Token next() {
@@ -104,6 +104,8 @@ public:
             case ')': return Token(TOK_RPAREN, ")");
             case '{': return Token(TOK_LBRACE, "{");
             case '}': return Token(TOK_RBRACE, "}");
+            case '[': return Token(TOK_LBRACKET, "[");
+            case ']': return Token(TOK_RBRACKET, "]");
             case ';': return Token(TOK_SEMICOLON, ";");
             case ',': return Token(TOK_COMMA, ",");
         }
@@ -8,45 +8,49 @@
 #include "parser.h"
 #include "compiler.h"
 #include "vm.h"
+#include "cache.h"
 #include<iostream>
 #include<fstream>
 #include<vector>
+#include<cstdlib>
+#include<sstream>
+#include<chrono>
+#include<memory>
+#include<utility>
+
+static std::string read_file(const char *path) {
+    std::ifstream in(path, std::ios::binary);
+    std::ostringstream ss;
+    ss << in.rdbuf();
+    return ss.str();
+}
 
-int main(int argc, char** argv) {
-
-    // 来点版权（不是
-    
-    std::cout<<"                 __  __ ___ _   _ ___ _        _    _   _  ____"<<std::endl;
-    std::cout<<"                |  \\/  |_ _| \\ | |_ _| |      / \\  | \\ | |/ ___|"<<std::endl;
-    std::cout<<"                | |\\/| || ||  \\| || || |     / _ \\ |  \\| | |  _"<<std::endl;
-    std::cout<<"                | |  | || || |\\  || || |___ / ___ \\| |\\  | |_| |"<<std::endl;
-    std::cout<<"                |_|  |_|___|_| \\_|___|_____/_/   \\_\\_| \\_|\\____|"<<std::endl;
-    std::cout<<""<<std::endl;
-    std::cout<<"This is a \"Toy\" Language written for teaching, do not use this language for production."<<std::endl;
-    std::cout<<"Please don't be hasitate to report any bugs or give any advise on MiniLang Github Page."<<std::endl;
-    std::cout<<""<<std::endl;
-    std::cout<<"                Github: https://github.com/NetherXiaoYu/MiniLang"<<std::endl;
-    std::cout<<""<<std::endl;
-    std::cout<<""<<std::endl;
-    
-    if(argc < 2) {
-        std::cerr << "Please enter which program file you are going to run." << std::endl;
-        exit(1);
-    }
+// --time 使用：距离上一次调用经过的毫秒数
+static double elapsed_ms(std::chrono::steady_clock::time_point &last) {
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    double ms = std::chrono::duration<double, std::milli>(now - last).count();
+    last = now;
+    return ms;
+}
 
-    std::ifstream inFile(argv[1]);
+// 词法分析、语法分析、编译，函数按声明顺序放进 funcs
+// --lazy 时函数还没有编译，VM 通过 c 编译，c 和 AST 所在的 ast 都由调用方持有
+static void compile_source(const std::string &source, Compiler &c, std::shared_ptr<AstArena> &ast, Chunk &chk, std::vector<Func> &funcs,
+                           bool show_time, std::chrono::steady_clock::time_point &clock) {
+    std::istringstream inFile(source);
     std::vector<Token> tokens;
 
     std::cout<<std::endl<<"Extracting Token..." <<std::endl;
 
     std::string line;
     while(std::getline(inFile, line)) {
-        Lexer lexer(line);
+        Lexer lexer(std::move(line));
         Token token;
 
         do {
             token = lexer.next();
-            if (token.type != TOK_EOF && token.type != TOK_UNKNOWN) tokens.push_back(token);
+            // 移动之后 token.type 不变，只有 lexeme 被取走
+            if (token.type != TOK_EOF && token.type != TOK_UNKNOWN) tokens.push_back(std::move(token));
         } while (token.type != TOK_EOF && token.type != TOK_UNKNOWN);
     }
     Token eof(TOK_EOF, "\0");
@@ -54,25 +58,176 @@ int main(int argc, char** argv) {
 
     std::cout<<"Parsing..." <<std::endl;
 
-    Parser p(tokens);
+    // --lazy 时函数体只预解析，第一次调用时才解析和编译
+    Parser p(std::move(tokens), c.get_options().lazy);
     Block *program = p.parse();
+    ast = p.arena();
+    if (show_time) std::cerr << "[time] lex + parse: " << elapsed_ms(clock) << " ms" << std::endl;
 
     std::cout<<"Compiling..." <<std::endl;
 
-
-    Compiler c(MainCompiler);
     c.compile(program);
+    if (show_time) std::cerr << "[time] compile: " << elapsed_ms(clock) << " ms" << std::endl;
+
+    // 编译结果直接从编译器中移出来，字节码只有这一份
+    chk = c.take_chunk();
+    std::unordered_map<std::string, Func> user_funcs = c.take_user_func();
+    const std::vector<std::string> &order = c.get_func_order();
+    funcs.reserve(order.size());
+    for (size_t i = 0; i < order.size(); i++) funcs.push_back(std::move(user_funcs.find(order[i])->second));
+}
 
-    Chunk chk = c.get_chunk();
+int main(int argc, char** argv) {
+    std::chrono::steady_clock::time_point clock = std::chrono::steady_clock::now();
+
+    // 来点版权（不是
+    
+    std::cout<<"                 __  __ ___ _   _ ___ _        _    _   _  ____"<<std::endl;
+    std::cout<<"                |  \\/  |_ _| \\ | |_ _| |      / \\  | \\ | |/ ___|"<<std::endl;
+    std::cout<<"                | |\\/| || ||  \\| || || |     / _ \\ |  \\| | |  _"<<std::endl;
+    std::cout<<"                | |  | || || |\\  || || |___ / ___ \\| |\\  | |_| |"<<std::endl;
+    std::cout<<"                |_|  |_|___|_| \\_|___|_____/_/   \\_\\_| \\_|\\____|"<<std::endl;
+    std::cout<<""<<std::endl;
+    std::cout<<"This is a \"Toy\" Language written for teaching, do not use this language for production."<<std::endl;
+    std::cout<<"Please don't be hasitate to report any bugs or give any advise on MiniLang Github Page."<<std::endl;
+    std::cout<<""<<std::endl;
+    std::cout<<"                Github: https://github.com/NetherXiaoYu/MiniLang"<<std::endl;
+    std::cout<<""<<std::endl;
+    std::cout<<""<<std::endl;
+    
+    // 用法: minilang [-O0|-O1|-O2] [-j[N]] [--lazy] [--report] [--time] [--cache | --cache-dir <dir>]
+    //                [--profile-gen <file> | --profile-use <file>] <program.ml>
+    CompileOptions options;
+    const char *path = NULL;
+    std::string profile_gen, profile_use, cache_dir;
+    bool use_cache = false, show_time = false;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--report") {
+            options.report = true;
+        } else if (arg == "--time") {
+            show_time = true;
+        } else if (arg == "--cache") {
+            use_cache = true;
+        } else if (arg == "--lazy") {
+            options.lazy = true;
+        } else if (arg == "--profile-gen" || arg == "--profile-use" || arg == "--cache-dir") {
+            if (i + 1 >= argc) {
+                std::cerr << "Missing file name after " << arg << std::endl;
+                exit(1);
+            }
+            if (arg == "--cache-dir") {
+                use_cache = true;
+                cache_dir = argv[++i];
+            } else {
+                (arg == "--profile-gen" ? profile_gen : profile_use) = argv[++i];
+            }
+        } else if (arg.compare(0, 2, "-j") == 0) {
+            // -j 使用全部核心，-jN 使用 N 个线程编译函数体
+            options.jobs = arg.size() == 2 ? static_cast<int>(ThreadPool::default_size()) : atoi(arg.c_str() + 2);
+            if (options.jobs < 1) {
+                std::cerr << "Invalid option " << arg << std::endl;
+                exit(1);
+            }
+        } else if (arg == "-O0" || arg == "-O1" || arg == "-O2") {
+            options.opt_level = arg[2] - '0';
+        } else if (arg.size() > 1 && arg[0] == '-') {
+            std::cerr << "Unknown option " << arg << std::endl;
+            exit(1);
+        } else {
+            path = argv[i];
+        }
+    }
+
+    if(path == NULL) {
+        std::cerr << "Please enter which program file you are going to run." << std::endl;
+        exit(1);
+    }
+
+    options.instrument = !profile_gen.empty();
+
+    Profile profile;
+    if (!profile_use.empty()) {
+        if (!profile.load(profile_use)) {
+            std::cerr << "Cannot read profile " << profile_use << std::endl;
+            exit(1);
+        }
+        if (profile.__opt_level__ != options.opt_level) {
+            std::cerr << "Profile " << profile_use << " was generated at -O" << profile.__opt_level__
+                      << ", but this run uses -O" << options.opt_level << std::endl;
+            exit(1);
+        }
+        options.profile = &profile;
+    }
 
     VirtualMachine vm;
-    for (auto &pair : c.get_user_func()) {
-        vm.define_function(pair.second);
+    std::vector<std::string> builtins = vm.builtin_names();
+    options.builtins.insert(builtins.begin(), builtins.end());
+
+    std::string source = read_file(path);
+
+    // 编译缓存：--report 需要看到编译过程，所以这时总是重新编译；--lazy 时大部分函数都没有编译，也不使用缓存
+    std::string cache_file;
+    unsigned long long cache_key = 0;
+    if (use_cache && !options.report && !options.lazy) {
+        std::ostringstream desc;
+        desc << "O" << options.opt_level << " instrument=" << options.instrument;
+        if (options.profile) desc << " profile=" << BytecodeCache::fnv1a(read_file(profile_use.c_str()));
+        cache_key = BytecodeCache::make_key(source, desc.str());
+        cache_file = BytecodeCache::cache_path(path, cache_dir, cache_key);
+    }
+    if (show_time) std::cerr << "[time] read: " << elapsed_ms(clock) << " ms" << std::endl;
+
+    // 命中缓存时直接在 mmap 进来的镜像上执行，只检查文件头，函数的字节码在第一次调用时才检查
+    BytecodeImage *image = cache_file.empty() ? NULL : BytecodeImage::open(cache_file, cache_key);
+    ChunkView main_view;
+    if (image != NULL && !image->main_chunk(main_view)) {
+        delete image;
+        image = NULL;
+    }
+
+    Compiler compiler(MainCompiler);
+    compiler.set_options(options);
+    std::shared_ptr<AstArena> ast;
+    Chunk chk;
+    std::vector<Func> funcs;
+    if (image != NULL) {
+        std::cout<<std::endl<<"Loading bytecode cache " << cache_file << "..." <<std::endl;
+        vm.attach_image(image);
+        if (show_time) std::cerr << "[time] cache load: " << elapsed_ms(clock) << " ms" << std::endl;
+    } else {
+        compile_source(source, compiler, ast, chk, funcs, show_time, clock);
+        if (options.lazy) vm.set_lazy_compiler(&compiler);
+
+        if (!cache_file.empty()) {
+            std::vector<const Func *> saved;
+            for (size_t i = 0; i < funcs.size(); i++) saved.push_back(&funcs[i]);
+            if (!BytecodeCache::save(cache_file, cache_key, chk, saved)) {
+                std::cerr << "Warning: cannot write bytecode cache " << cache_file << std::endl;
+            }
+            if (show_time) std::cerr << "[time] cache save: " << elapsed_ms(clock) << " ms" << std::endl;
+        }
+
+        for (size_t i = 0; i < funcs.size(); i++) {
+            vm.define_function(std::move(funcs[i]));
+        }
+        main_view = ChunkView(chk);
     }
 
     std::cout<<std::endl<<"Result: "<<std::endl;
 
-    vm.run(chk);
+    Profile recorded;
+    recorded.__opt_level__ = options.opt_level;
+    if (!profile_gen.empty()) vm.set_profile(&recorded);
+
+    vm.run(main_view);
+    if (show_time) std::cerr << "[time] run: " << elapsed_ms(clock) << " ms" << std::endl;
+
+    if (!profile_gen.empty() && !recorded.save(profile_gen)) {
+        std::cerr << "Cannot write profile " << profile_gen << std::endl;
+        exit(1);
+    }
 
+    delete image;
     return 9;
 }
@@ -0,0 +1,53 @@
+/*************************************************************************
+	> File Name: number.h
+	> Author: Bryan Si (SeongLam)
+	> Created Time: Mon Oct 19 16:10:27 2026
+ ************************************************************************/
+
+#ifndef NUMBER_H
+#define NUMBER_H
+
+#include<climits>
+
+// 数字运算的公共规则，VM 执行和编译期常量折叠都用这里的函数，保证两边结果一致
+
+// 整数运算的溢出检查，溢出时返回 true，调用方会退回到 double 运算
+inline bool int_add_overflow(long long a, long long b, long long *r) {
+#if defined(__GNUC__)
+    return __builtin_add_overflow(a, b, r);
+#else
+    if ((b > 0 && a > LLONG_MAX - b) || (b < 0 && a < LLONG_MIN - b)) return true;
+    *r = a + b;
+    return false;
+#endif
+}
+
+inline bool int_sub_overflow(long long a, long long b, long long *r) {
+#if defined(__GNUC__)
+    return __builtin_sub_overflow(a, b, r);
+#else
+    if ((b < 0 && a > LLONG_MAX + b) || (b > 0 && a < LLONG_MIN + b)) return true;
+    *r = a - b;
+    return false;
+#endif
+}
+
+inline bool int_mul_overflow(long long a, long long b, long long *r) {
+#if defined(__GNUC__)
+    return __builtin_mul_overflow(a, b, r);
+#else
+    if (a != 0 && b != 0) {
+        if ((a == -1 && b == LLONG_MIN) || (b == -1 && a == LLONG_MIN)) return true;
+        if (a > 0 ? (b > 0 ? a > LLONG_MAX / b : b < LLONG_MIN / a) : (b > 0 ? a < LLONG_MIN / b : a < LLONG_MAX / b)) return true;
+    }
+    *r = a * b;
+    return false;
+#endif
+}
+
+// 整数能否放进紧凑的 double 数组而不丢失精度
+inline bool int_fits_double(long long i) {
+    return i >= -(1LL << 53) && i <= (1LL << 53);
+}
+
+#endif
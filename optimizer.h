@@ -0,0 +1,1659 @@
+/*************************************************************************
+	> File Name: optimizer.h
+	> Author: Bryan Si (SeongLam)
+	> Created Time: Mon Oct 19 15:03:44 2026
+ ************************************************************************/
+
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include<vector>
+#include<map>
+#include<string>
+#include<unordered_map>
+#include<algorithm>
+#include<iterator>
+#include "instruction.h"
+
+// 作用在单个 Chunk 上的优化 Pass
+// 编译器一边遍历 AST 一边生成字节码，很多优化在字节码层面做反而更简单
+
+class Optimizer {
+public:
+
+    // 指令读取的寄存器
+    static void inst_uses(const Instruction &inst, std::vector<int> &out) {
+        switch (inst.op) {
+            case OP_GET_LOCAL:
+            case OP_SET_LOCAL:
+            case OP_REGISTER_LOCAL:
+            case OP_NOT:
+            case OP_JUMP_IF_FALSE:
+            case OP_JUMP_IF_TRUE:
+            case OP_RETURN_VAL:
+                out.push_back(inst.arg1);
+                break;
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_DIV:
+            case OP_EQUAL:
+            case OP_NOT_EQUAL:
+            case OP_GREATER:
+            case OP_LESS:
+            case OP_GREATER_EQUAL:
+            case OP_LESS_EQUAL:
+            case OP_ADD_NUM:
+            case OP_SUB_NUM:
+            case OP_MUL_NUM:
+            case OP_DIV_NUM:
+            case OP_GREATER_NUM:
+            case OP_LESS_NUM:
+            case OP_GREATER_EQUAL_NUM:
+            case OP_LESS_EQUAL_NUM:
+            case OP_GET_INDEX:
+                out.push_back(inst.arg1);
+                out.push_back(inst.arg2);
+                break;
+            case OP_SET_INDEX:
+                out.push_back(inst.arg1);
+                out.push_back(inst.arg2);
+                out.push_back(inst.result);
+                break;
+            case OP_CALL:
+                out.push_back(inst.arg1);
+                for (int i = inst.result - inst.arg2; i < inst.result; i++) out.push_back(i);
+                break;
+            case OP_NEW_ARRAY:
+                for (int i = 0; i < inst.arg2; i++) out.push_back(inst.arg1 + i);
+                break;
+            case OP_FORLOOP:
+                for (int i = 0; i < 3; i++) out.push_back(inst.arg1 + i);
+                break;
+            default:
+                break;
+        }
+    }
+
+    // 指令写入的寄存器，没有的话返回 -1
+    static int inst_def(const Instruction &inst) {
+        switch (inst.op) {
+            case OP_CONSTANT:
+            case OP_LOAD_INT:
+            case OP_GET_LOCAL:
+            case OP_SET_LOCAL:
+            case OP_REGISTER_LOCAL:
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_DIV:
+            case OP_EQUAL:
+            case OP_NOT_EQUAL:
+            case OP_GREATER:
+            case OP_LESS:
+            case OP_GREATER_EQUAL:
+            case OP_LESS_EQUAL:
+            case OP_NOT:
+            case OP_ADD_NUM:
+            case OP_SUB_NUM:
+            case OP_MUL_NUM:
+            case OP_DIV_NUM:
+            case OP_GREATER_NUM:
+            case OP_LESS_NUM:
+            case OP_GREATER_EQUAL_NUM:
+            case OP_LESS_EQUAL_NUM:
+            case OP_CALL:
+            case OP_NEW_ARRAY:
+            case OP_GET_INDEX:
+                return inst.result;
+            case OP_FORLOOP:
+                return inst.arg1;
+            default:
+                return -1;
+        }
+    }
+
+    static bool is_move(const Instruction &inst) {
+        return inst.op == OP_GET_LOCAL || inst.op == OP_SET_LOCAL || inst.op == OP_REGISTER_LOCAL;
+    }
+
+    // 跳转指令中保存跳转目标的字段，不是跳转指令时返回 NULL
+    static int *jump_target(Instruction &inst) {
+        switch (inst.op) {
+            case OP_JUMP:
+                return &inst.arg1;
+            case OP_JUMP_IF_FALSE:
+            case OP_JUMP_IF_TRUE:
+            case OP_FORLOOP:
+                return &inst.result;
+            default:
+                return NULL;
+        }
+    }
+
+    static int jump_target(const Instruction &inst) {
+        return inst.op == OP_JUMP ? inst.arg1 : inst.result;
+    }
+
+    static bool is_jump(const Instruction &inst) {
+        return inst.op == OP_JUMP || inst.op == OP_JUMP_IF_FALSE || inst.op == OP_JUMP_IF_TRUE || inst.op == OP_FORLOOP;
+    }
+
+    // 指令执行完之后可能到达的下一条指令，超出代码长度表示离开这个 Chunk
+    static void inst_successors(const Chunk &chunk, size_t pc, std::vector<size_t> &out) {
+        const Instruction &inst = chunk.__code__[pc];
+        switch (inst.op) {
+            case OP_JUMP:
+                out.push_back(static_cast<size_t>(inst.arg1));
+                break;
+            case OP_JUMP_IF_FALSE:
+            case OP_JUMP_IF_TRUE:
+            case OP_FORLOOP:
+                out.push_back(pc + 1);
+                out.push_back(static_cast<size_t>(inst.result));
+                break;
+            case OP_RETURN_VAL:
+            case OP_HALT:
+                break;
+            default:
+                out.push_back(pc + 1);
+                break;
+        }
+    }
+
+    // 按照 old -> new 的映射改写指令中所有的寄存器操作数
+    static void rename_regs(Instruction &inst, const std::vector<int> &color) {
+        switch (inst.op) {
+            case OP_CONSTANT:
+            case OP_LOAD_INT:
+                inst.result = color[inst.result];
+                break;
+            case OP_GET_LOCAL:
+            case OP_SET_LOCAL:
+            case OP_REGISTER_LOCAL:
+            case OP_NOT:
+                inst.arg1 = color[inst.arg1];
+                inst.result = color[inst.result];
+                break;
+            case OP_JUMP_IF_FALSE:
+            case OP_JUMP_IF_TRUE:
+            case OP_RETURN_VAL:
+                inst.arg1 = color[inst.arg1];
+                break;
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_DIV:
+            case OP_EQUAL:
+            case OP_NOT_EQUAL:
+            case OP_GREATER:
+            case OP_LESS:
+            case OP_GREATER_EQUAL:
+            case OP_LESS_EQUAL:
+            case OP_ADD_NUM:
+            case OP_SUB_NUM:
+            case OP_MUL_NUM:
+            case OP_DIV_NUM:
+            case OP_GREATER_NUM:
+            case OP_LESS_NUM:
+            case OP_GREATER_EQUAL_NUM:
+            case OP_LESS_EQUAL_NUM:
+            case OP_GET_INDEX:
+            case OP_SET_INDEX:
+                inst.arg1 = color[inst.arg1];
+                inst.arg2 = color[inst.arg2];
+                inst.result = color[inst.result];
+                break;
+            case OP_CALL:
+                // 参数窗口紧挨在 result 前面，分配时已经保证了整个窗口一起移动
+                inst.arg1 = color[inst.arg1];
+                inst.result = color[inst.result];
+                break;
+            case OP_NEW_ARRAY:
+                inst.arg1 = inst.arg2 > 0 ? color[inst.arg1] : 0;
+                inst.result = color[inst.result];
+                break;
+            case OP_FORLOOP:
+                inst.arg1 = color[inst.arg1];
+                break;
+            default:
+                break;
+        }
+    }
+
+    // 带偏移的并查集，offset[r] 是 r 相对于所在组根节点的颜色偏移
+    static int find_root(std::vector<int> &parent, std::vector<int> &offset, int r) {
+        if (parent[r] == r) return r;
+        int root = find_root(parent, offset, parent[r]);
+        offset[r] += offset[parent[r]];
+        parent[r] = root;
+        return root;
+    }
+
+    // 要求 color(b) = color(a) + k，和已有的约束矛盾时返回 false
+    static bool unite(std::vector<int> &parent, std::vector<int> &offset, int a, int b, int k) {
+        int ra = find_root(parent, offset, a), rb = find_root(parent, offset, b);
+        if (ra == rb) return offset[b] - offset[a] == k;
+        parent[rb] = ra;
+        offset[rb] = offset[a] + k - offset[b];
+        return true;
+    }
+
+    // 基本块组成的控制流图，块按代码顺序编号，第 b 块是 [start[b], start[b + 1])
+    struct BlockGraph {
+        std::vector<size_t> start;
+        std::vector<std::vector<int>> succ, pred;
+    };
+
+    static void build_blocks(const Chunk &chunk, BlockGraph &g) {
+        size_t n = chunk.__code__.size();
+        std::vector<bool> leader = block_leaders(chunk);
+        std::vector<int> block_of(n, -1);
+        g.start.clear();
+        for (size_t pc = 0; pc < n; pc++) {
+            if (leader[pc]) g.start.push_back(pc);
+            block_of[pc] = static_cast<int>(g.start.size()) - 1;
+        }
+        size_t count = g.start.size();
+        g.start.push_back(n);
+        g.succ.assign(count, std::vector<int>());
+        g.pred.assign(count, std::vector<int>());
+
+        std::vector<size_t> next;
+        for (size_t b = 0; b < count; b++) {
+            next.clear();
+            inst_successors(chunk, g.start[b + 1] - 1, next);
+            for (size_t k = 0; k < next.size(); k++) {
+                if (next[k] >= n) continue;
+                int t = block_of[next[k]];
+                if (std::find(g.succ[b].begin(), g.succ[b].end(), t) != g.succ[b].end()) continue;
+                g.succ[b].push_back(t);
+                g.pred[t].push_back(static_cast<int>(b));
+            }
+        }
+    }
+
+    // 稀疏集合：成员列表加上每个寄存器在列表中的位置，插入、删除、查询都是 O(1)，清空的开销只和成员数有关
+    struct LiveSet {
+        std::vector<int> members;
+        std::vector<int> pos;
+
+        explicit LiveSet(int reg_count) : pos(reg_count, -1) {}
+
+        bool has(int r) const {
+            return pos[r] >= 0;
+        }
+
+        void add(int r) {
+            if (pos[r] >= 0) return;
+            pos[r] = static_cast<int>(members.size());
+            members.push_back(r);
+        }
+
+        void remove(int r) {
+            int i = pos[r];
+            if (i < 0) return;
+            int last = members.back();
+            members[i] = last;
+            pos[last] = i;
+            members.pop_back();
+            pos[r] = -1;
+        }
+
+        void clear() {
+            for (size_t i = 0; i < members.size(); i++) pos[members[i]] = -1;
+            members.clear();
+        }
+    };
+
+    // 活跃变量分析的结果：只保存每个基本块入口 / 出口处活跃的寄存器（升序）
+    // 块内每条指令处的活跃集合用 scan_block 从块的出口倒着推出来，不为每条指令保存一份，大的 Chunk 也不会占用 指令数 x 寄存器数 的内存
+    struct Liveness {
+        BlockGraph blocks;
+        std::vector<int> block_of;
+        std::vector<std::vector<int>> in, out;
+
+        // pc 入口处 r 是否活跃，pc == 指令数 表示离开 Chunk；pc 不是块的开头时从 pc 往后找 r 第一次出现的位置
+        bool live_in(const Chunk &chunk, size_t pc, int r) const {
+            const std::vector<Instruction> &code = chunk.__code__;
+            if (pc >= code.size()) return false;
+            int b = block_of[pc];
+            if (pc == blocks.start[b]) return std::binary_search(in[b].begin(), in[b].end(), r);
+
+            std::vector<int> uses;
+            for (size_t q = pc; q < blocks.start[b + 1]; q++) {
+                uses.clear();
+                inst_uses(code[q], uses);
+                if (std::find(uses.begin(), uses.end(), r) != uses.end()) return true;
+                if (inst_def(code[q]) == r) return false;
+            }
+            return std::binary_search(out[b].begin(), out[b].end(), r);
+        }
+
+        // 从块 b 的出口倒着扫描，每条指令调用 visit(pc, live)，live 是这条指令出口处活跃的寄存器
+        template<typename Visit>
+        void scan_block(const Chunk &chunk, size_t b, LiveSet &live, Visit visit) const {
+            const std::vector<Instruction> &code = chunk.__code__;
+            live.clear();
+            for (size_t i = 0; i < out[b].size(); i++) live.add(out[b][i]);
+            std::vector<int> uses;
+            for (size_t pc = blocks.start[b + 1]; pc-- > blocks.start[b];) {
+                visit(pc, static_cast<const LiveSet &>(live));
+                int d = inst_def(code[pc]);
+                if (d >= 0) live.remove(d);
+                uses.clear();
+                inst_uses(code[pc], uses);
+                for (size_t i = 0; i < uses.size(); i++) live.add(uses[i]);
+            }
+        }
+    };
+
+    // Chunk 中实际用到的寄存器数量
+    static int count_registers(const Chunk &chunk, int param_count) {
+        int reg_count = std::max(chunk.__reg_count__, param_count);
+        std::vector<int> tmp;
+        for (size_t pc = 0; pc < chunk.__code__.size(); pc++) {
+            tmp.clear();
+            inst_uses(chunk.__code__[pc], tmp);
+            int d = inst_def(chunk.__code__[pc]);
+            if (d >= 0) tmp.push_back(d);
+            for (size_t i = 0; i < tmp.size(); i++) reg_count = std::max(reg_count, tmp[i] + 1);
+        }
+        return reg_count;
+    }
+
+    // 按基本块迭代求解：in[b] = gen[b] ∪ (out[b] - kill[b])，out[b] = 所有后继的 in 的并集
+    static void compute_liveness(const Chunk &chunk, int reg_count, Liveness &lv) {
+        const std::vector<Instruction> &code = chunk.__code__;
+        size_t n = code.size();
+        build_blocks(chunk, lv.blocks);
+        size_t count = lv.blocks.succ.size();
+        lv.block_of.assign(n, 0);
+        for (size_t b = 0; b < count; b++) {
+            for (size_t pc = lv.blocks.start[b]; pc < lv.blocks.start[b + 1]; pc++) lv.block_of[pc] = static_cast<int>(b);
+        }
+
+        // gen：块内先读后写的寄存器；kill：块内写入的寄存器
+        std::vector<std::vector<int>> gen(count), kill(count);
+        LiveSet live(reg_count);
+        std::vector<int> uses;
+        for (size_t b = 0; b < count; b++) {
+            live.clear();
+            for (size_t pc = lv.blocks.start[b + 1]; pc-- > lv.blocks.start[b];) {
+                int d = inst_def(code[pc]);
+                if (d >= 0) {
+                    live.remove(d);
+                    kill[b].push_back(d);
+                }
+                uses.clear();
+                inst_uses(code[pc], uses);
+                for (size_t i = 0; i < uses.size(); i++) live.add(uses[i]);
+            }
+            gen[b] = live.members;
+            std::sort(gen[b].begin(), gen[b].end());
+            std::sort(kill[b].begin(), kill[b].end());
+            kill[b].erase(std::unique(kill[b].begin(), kill[b].end()), kill[b].end());
+        }
+
+        lv.in = gen;
+        lv.out.assign(count, std::vector<int>());
+        std::vector<int> merged, rest, in;
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (size_t b = count; b-- > 0;) {
+                std::vector<int> &out = lv.out[b];
+                for (size_t k = 0; k < lv.blocks.succ[b].size(); k++) {
+                    const std::vector<int> &s = lv.in[lv.blocks.succ[b][k]];
+                    merged.clear();
+                    std::set_union(out.begin(), out.end(), s.begin(), s.end(), std::back_inserter(merged));
+                    out.swap(merged);
+                }
+
+                rest.clear();
+                std::set_difference(out.begin(), out.end(), kill[b].begin(), kill[b].end(), std::back_inserter(rest));
+                in.clear();
+                std::set_union(gen[b].begin(), gen[b].end(), rest.begin(), rest.end(), std::back_inserter(in));
+                if (in != lv.in[b]) {
+                    lv.in[b].swap(in);
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    // 删除 keep[pc] 为 false 的指令，并修正跳转目标
+    // 跳到被删除指令的跳转会落到它后面第一条保留下来的指令上
+    static void compact(Chunk &chunk, const std::vector<bool> &keep) {
+        std::vector<Instruction> &code = chunk.__code__;
+        size_t n = code.size();
+        std::vector<int> new_index(n + 1);
+        int next = 0;
+        for (size_t pc = 0; pc < n; pc++) {
+            new_index[pc] = next;
+            if (keep[pc]) next++;
+        }
+        new_index[n] = next;
+
+        std::vector<Instruction> result;
+        result.reserve(next);
+        for (size_t pc = 0; pc < n; pc++) {
+            if (!keep[pc]) continue;
+            Instruction inst = code[pc];
+            if (int *t = jump_target(inst)) *t = new_index[std::min(static_cast<size_t>(*t), n)];
+            result.push_back(inst);
+        }
+        code.swap(result);
+    }
+
+    // 基本块的起始位置：入口、跳转目标、跳转 / 返回之后的指令
+    static std::vector<bool> block_leaders(const Chunk &chunk) {
+        const std::vector<Instruction> &code = chunk.__code__;
+        size_t n = code.size();
+        std::vector<bool> leader(n + 1, false);
+        leader[0] = true;
+        for (size_t pc = 0; pc < n; pc++) {
+            const Instruction &inst = code[pc];
+            if (is_jump(inst)) leader[std::min(static_cast<size_t>(jump_target(inst)), n)] = true;
+            if (is_jump(inst) || inst.op == OP_RETURN_VAL || inst.op == OP_HALT) leader[pc + 1] = true;
+        }
+        return leader;
+    }
+
+    // 没有副作用、结果只取决于操作数的指令，可以做公共子表达式消除
+    static bool is_pure(Opcode op) {
+        switch (op) {
+            case OP_CONSTANT:
+            case OP_LOAD_INT:
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_DIV:
+            case OP_EQUAL:
+            case OP_NOT_EQUAL:
+            case OP_GREATER:
+            case OP_LESS:
+            case OP_GREATER_EQUAL:
+            case OP_LESS_EQUAL:
+            case OP_NOT:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // 结果没人用的时候可以直接删掉的指令：不会在运行时报错，也没有副作用
+    static bool is_removable(const Instruction &inst) {
+        switch (inst.op) {
+            case OP_CONSTANT:
+            case OP_LOAD_INT:
+            case OP_GET_LOCAL:
+            case OP_SET_LOCAL:
+            case OP_REGISTER_LOCAL:
+            case OP_EQUAL:
+            case OP_NOT_EQUAL:
+            case OP_NOT:
+            case OP_NEW_ARRAY:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // 每个块的直接支配块（Cooper-Harvey-Kennedy 迭代算法），入口块是它自己，从入口到不了的块是 -1
+    static std::vector<int> immediate_dominators(const BlockGraph &g) {
+        size_t count = g.succ.size();
+        std::vector<int> idom(count, -1);
+        if (count == 0) return idom;
+
+        // 逆后序
+        std::vector<int> rpo;
+        std::vector<bool> seen(count, false);
+        std::vector<std::pair<int, size_t>> stack;
+        stack.push_back(std::make_pair(0, static_cast<size_t>(0)));
+        seen[0] = true;
+        while (!stack.empty()) {
+            int b = stack.back().first;
+            size_t k = stack.back().second;
+            if (k < g.succ[b].size()) {
+                stack.back().second++;
+                int s = g.succ[b][k];
+                if (!seen[s]) {
+                    seen[s] = true;
+                    stack.push_back(std::make_pair(s, static_cast<size_t>(0)));
+                }
+            } else {
+                rpo.push_back(b);
+                stack.pop_back();
+            }
+        }
+        std::reverse(rpo.begin(), rpo.end());
+        std::vector<size_t> order(count, 0);
+        for (size_t i = 0; i < rpo.size(); i++) order[rpo[i]] = i;
+
+        idom[0] = 0;
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (size_t i = 1; i < rpo.size(); i++) {
+                int b = rpo[i], dom = -1;
+                for (size_t k = 0; k < g.pred[b].size(); k++) {
+                    int p = g.pred[b][k];
+                    if (idom[p] < 0) continue;
+                    if (dom < 0) {
+                        dom = p;
+                        continue;
+                    }
+                    int x = p, y = dom;
+                    while (x != y) {
+                        while (order[x] > order[y]) x = idom[x];
+                        while (order[y] > order[x]) y = idom[y];
+                    }
+                    dom = x;
+                }
+                if (idom[b] != dom) {
+                    idom[b] = dom;
+                    changed = true;
+                }
+            }
+        }
+        return idom;
+    }
+
+    // 值编号：沿着支配树给寄存器中的值编号，每个块从直接支配块出口处的编号开始
+    // 1. 操作数换成最早保存同一个值的寄存器（复写传播）
+    // 2. 已经算过的纯运算换成一次 move（公共子表达式消除）
+    // 寄存器不是 SSA 形式，从直接支配块到这个块的路径上（不经过直接支配块）可能被写入的寄存器在块的入口处作废
+    // 参数窗口的位置是固定的，窗口里的寄存器不会被替换；从入口到不了的块保持不变
+    static void value_numbering(Chunk &chunk, int reg_count) {
+        std::vector<Instruction> &code = chunk.__code__;
+        if (code.empty()) return;
+
+        BlockGraph g;
+        build_blocks(chunk, g);
+        std::vector<int> idom = immediate_dominators(g);
+        size_t count = g.succ.size();
+        std::vector<std::vector<int>> children(count);
+        for (size_t b = 1; b < count; b++) {
+            if (idom[b] >= 0) children[idom[b]].push_back(static_cast<int>(b));
+        }
+
+        typedef std::pair<int, std::pair<long long, long long>> ExprKey;
+        std::vector<int> reg_vn(reg_count, -1);
+        std::vector<int> holder;
+        std::map<ExprKey, int> expr_vn;
+
+        // 离开一个块的子树时按日志恢复进入时的状态
+        std::vector<std::pair<int, int>> reg_log, holder_log;
+        std::vector<ExprKey> expr_log;
+        auto set_reg = [&](int r, int vn) {
+            reg_log.push_back(std::make_pair(r, reg_vn[r]));
+            reg_vn[r] = vn;
+        };
+        auto set_holder = [&](int vn, int r) {
+            holder_log.push_back(std::make_pair(vn, holder[vn]));
+            holder[vn] = r;
+        };
+
+        // 寄存器 r 中值的编号，第一次见到的寄存器保存的是从外面流进来的值
+        auto vn_of = [&](int r) -> int {
+            if (reg_vn[r] < 0) {
+                set_reg(r, static_cast<int>(holder.size()));
+                holder.push_back(r);
+            }
+            return reg_vn[r];
+        };
+        // 保存同一个值的寄存器中最早的那一个
+        auto canon = [&](int r) -> int {
+            int v = vn_of(r);
+            int h = holder[v];
+            return (h >= 0 && reg_vn[h] == v) ? h : r;
+        };
+
+        std::vector<size_t> visit(count, 0);
+        size_t stamp = 0;
+        std::vector<int> work;
+
+        struct Mark {
+            int block;
+            size_t reg_log, holder_log, expr_log, holders;
+        };
+        std::vector<Mark> stack;
+        Mark root = { 0, 0, 0, 0, 0 };
+        stack.push_back(root);
+        while (!stack.empty()) {
+            Mark m = stack.back();
+            stack.pop_back();
+
+            // 负数表示离开 ~block 的子树
+            if (m.block < 0) {
+                while (reg_log.size() > m.reg_log) {
+                    reg_vn[reg_log.back().first] = reg_log.back().second;
+                    reg_log.pop_back();
+                }
+                while (holder_log.size() > m.holder_log) {
+                    holder[holder_log.back().first] = holder_log.back().second;
+                    holder_log.pop_back();
+                }
+                while (expr_log.size() > m.expr_log) {
+                    expr_vn.erase(expr_log.back());
+                    expr_log.pop_back();
+                }
+                holder.resize(m.holders);
+                continue;
+            }
+
+            int b = m.block;
+            Mark undo = { ~b, reg_log.size(), holder_log.size(), expr_log.size(), holder.size() };
+            stack.push_back(undo);
+            for (size_t k = 0; k < children[b].size(); k++) {
+                Mark child = { children[b][k], 0, 0, 0, 0 };
+                stack.push_back(child);
+            }
+
+            // 从直接支配块出发、不再经过它就能到达 b 的块都可能在 b 之前执行
+            if (b != 0) {
+                int d = idom[b];
+                stamp++;
+                work.clear();
+                for (size_t k = 0; k < g.pred[b].size(); k++) {
+                    int p = g.pred[b][k];
+                    if (p != d && idom[p] >= 0 && visit[p] != stamp) {
+                        visit[p] = stamp;
+                        work.push_back(p);
+                    }
+                }
+                while (!work.empty()) {
+                    int x = work.back();
+                    work.pop_back();
+                    for (size_t pc = g.start[x]; pc < g.start[x + 1]; pc++) {
+                        int r = inst_def(code[pc]);
+                        if (r >= 0 && reg_vn[r] >= 0) set_reg(r, -1);
+                    }
+                    for (size_t k = 0; k < g.pred[x].size(); k++) {
+                        int p = g.pred[x][k];
+                        if (p != d && idom[p] >= 0 && visit[p] != stamp) {
+                            visit[p] = stamp;
+                            work.push_back(p);
+                        }
+                    }
+                }
+            }
+
+            for (size_t pc = g.start[b]; pc < g.start[b + 1]; pc++) {
+                Instruction &inst = code[pc];
+
+                switch (inst.op) {
+                    case OP_GET_LOCAL:
+                    case OP_SET_LOCAL:
+                    case OP_REGISTER_LOCAL:
+                    case OP_NOT:
+                    case OP_JUMP_IF_FALSE:
+                    case OP_JUMP_IF_TRUE:
+                    case OP_RETURN_VAL:
+                        inst.arg1 = canon(inst.arg1);
+                        break;
+                    case OP_ADD:
+                    case OP_SUB:
+                    case OP_MUL:
+                    case OP_DIV:
+                    case OP_EQUAL:
+                    case OP_NOT_EQUAL:
+                    case OP_GREATER:
+                    case OP_LESS:
+                    case OP_GREATER_EQUAL:
+                    case OP_LESS_EQUAL:
+                    case OP_GET_INDEX:
+                        inst.arg1 = canon(inst.arg1);
+                        inst.arg2 = canon(inst.arg2);
+                        break;
+                    case OP_SET_INDEX:
+                        inst.arg1 = canon(inst.arg1);
+                        inst.arg2 = canon(inst.arg2);
+                        inst.result = canon(inst.result);
+                        break;
+                    case OP_CALL:
+                        inst.arg1 = canon(inst.arg1);
+                        break;
+                    default:
+                        break;
+                }
+
+                int d = inst_def(inst);
+                if (d < 0) continue;
+
+                int vn = -1;
+                if (is_move(inst)) {
+                    vn = vn_of(inst.arg1);
+                } else if (is_pure(inst.op)) {
+                    ExprKey key;
+                    if (inst.op == OP_CONSTANT || inst.op == OP_LOAD_INT) {
+                        key = std::make_pair(static_cast<int>(inst.op), std::make_pair(static_cast<long long>(inst.arg1), static_cast<long long>(inst.arg2)));
+                    } else {
+                        long long a = vn_of(inst.arg1), c = inst.op == OP_NOT ? 0 : vn_of(inst.arg2);
+                        // 加法、乘法、相等比较满足交换律
+                        if ((inst.op == OP_ADD || inst.op == OP_MUL || inst.op == OP_EQUAL || inst.op == OP_NOT_EQUAL) && a > c) std::swap(a, c);
+                        key = std::make_pair(static_cast<int>(inst.op), std::make_pair(a, c));
+                    }
+
+                    std::map<ExprKey, int>::iterator it = expr_vn.find(key);
+                    if (it != expr_vn.end()) {
+                        vn = it->second;
+                        int h = holder[vn];
+                        if (h >= 0 && reg_vn[h] == vn) inst = Instruction(OP_GET_LOCAL, h, 0, d);
+                    } else {
+                        vn = static_cast<int>(holder.size());
+                        holder.push_back(-1);
+                        expr_vn[key] = vn;
+                        expr_log.push_back(key);
+                    }
+                } else {
+                    vn = static_cast<int>(holder.size());
+                    holder.push_back(-1);
+                }
+
+                set_reg(d, vn);
+                if (holder[vn] < 0 || reg_vn[holder[vn]] != vn) set_holder(vn, d);
+            }
+        }
+    }
+
+    // 删除结果不再被使用的指令，以及自己拷贝给自己的 move，直到没有可以删除的指令为止
+    // 返回删除的指令数
+    static size_t eliminate_dead_code(Chunk &chunk, int param_count) {
+        size_t removed = 0;
+        while (true) {
+            int reg_count = count_registers(chunk, param_count);
+            Liveness lv;
+            compute_liveness(chunk, reg_count, lv);
+
+            std::vector<Instruction> &code = chunk.__code__;
+            std::vector<bool> keep(code.size(), true);
+            size_t dead = 0;
+            LiveSet live(reg_count);
+            for (size_t b = 0; b < lv.in.size(); b++) {
+                lv.scan_block(chunk, b, live, [&](size_t pc, const LiveSet &live_out) {
+                    const Instruction &inst = code[pc];
+                    if (is_move(inst) && inst.arg1 == inst.result) {
+                        keep[pc] = false;
+                    } else if (is_removable(inst) && !live_out.has(inst_def(inst))) {
+                        keep[pc] = false;
+                    }
+                    if (!keep[pc]) dead++;
+                });
+            }
+
+            if (dead == 0) break;
+            compact(chunk, keep);
+            removed += dead;
+        }
+        return removed;
+    }
+
+    // 只会写入数字的寄存器：它的每一次定值都产生数字（VM 中寄存器的初始值 0 也是数字）
+    // 参数的类型未知，不算数字
+    static std::vector<bool> numeric_registers(const Chunk &chunk, int reg_count, int param_count) {
+        std::vector<bool> numeric(reg_count, true);
+        for (int p = 0; p < param_count && p < reg_count; p++) numeric[p] = false;
+
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (size_t pc = 0; pc < chunk.__code__.size(); pc++) {
+                const Instruction &inst = chunk.__code__[pc];
+                int d = inst_def(inst);
+                if (d < 0 || !numeric[d]) continue;
+
+                bool ok;
+                switch (inst.op) {
+                    case OP_LOAD_INT:
+                    case OP_ADD:
+                    case OP_SUB:
+                    case OP_MUL:
+                    case OP_DIV:
+                    case OP_EQUAL:
+                    case OP_NOT_EQUAL:
+                    case OP_GREATER:
+                    case OP_LESS:
+                    case OP_GREATER_EQUAL:
+                    case OP_LESS_EQUAL:
+                    case OP_NOT:
+                    case OP_ADD_NUM:
+                    case OP_SUB_NUM:
+                    case OP_MUL_NUM:
+                    case OP_DIV_NUM:
+                    case OP_GREATER_NUM:
+                    case OP_LESS_NUM:
+                    case OP_GREATER_EQUAL_NUM:
+                    case OP_LESS_EQUAL_NUM:
+                        ok = true;
+                        break;
+                    case OP_CONSTANT:
+                        ok = inst.arg1 >= 0;
+                        break;
+                    case OP_FORLOOP:
+                        ok = numeric[inst.arg1 + 2];
+                        break;
+                    case OP_GET_LOCAL:
+                    case OP_SET_LOCAL:
+                    case OP_REGISTER_LOCAL:
+                        ok = numeric[inst.arg1];
+                        break;
+                    default:
+                        ok = false;
+                        break;
+                }
+                if (!ok) {
+                    numeric[d] = false;
+                    changed = true;
+                }
+            }
+        }
+        return numeric;
+    }
+
+    // 指令能否提到循环外面：必须是纯运算并且不会在运行时报错，否则循环一次都不执行的时候行为会改变
+    static bool hoistable(const Instruction &inst, const std::vector<bool> &numeric) {
+        switch (inst.op) {
+            case OP_CONSTANT:
+            case OP_LOAD_INT:
+            case OP_GET_LOCAL:
+            case OP_SET_LOCAL:
+            case OP_REGISTER_LOCAL:
+            case OP_EQUAL:
+            case OP_NOT_EQUAL:
+            case OP_NOT:
+                return true;
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_GREATER:
+            case OP_LESS:
+            case OP_GREATER_EQUAL:
+            case OP_LESS_EQUAL:
+                return numeric[inst.arg1] && numeric[inst.arg2];
+            default:
+                return false;
+        }
+    }
+
+    // 循环不变量外提
+    // 编译器生成的循环是连续的一段代码 [header, back]，back 是跳回 header 的指令，这里只处理只能从 header 进入的循环
+    // 满足下面条件的指令会被移到 header 之前（新的 preheader）：
+    // 1. hoistable，并且读取的寄存器在循环中没有被修改（或者也被外提了）
+    // 2. 写入的寄存器在循环中只有这一次定值，并且在 header 处和所有出口处都不活跃
+    // 每一轮处理互不重叠的循环（从小到大），嵌套的外层循环在下一轮继续处理
+    // 外提的值在整个循环中都占着寄存器：header 处活跃的寄存器（包括之前几轮外提的）达到 LICM_MAX_LIVE 个就不再外提，
+    // 否则常量很多的大循环会把几万个值同时留在寄存器中，寄存器分配的冲突图随之平方增长
+    // 返回外提的指令数
+    static size_t hoist_loop_invariants(Chunk &chunk, int param_count) {
+        static const size_t LICM_MAX_LIVE = 64;
+        size_t total = 0;
+        for (int round = 0; round < 16; round++) {
+            std::vector<Instruction> &code = chunk.__code__;
+            size_t n = code.size();
+            int reg_count = count_registers(chunk, param_count);
+            if (n == 0 || reg_count == 0) break;
+
+            // 每个 header 对应最远的回跳
+            std::map<size_t, size_t> back;
+            for (size_t pc = 0; pc < n; pc++) {
+                size_t t = n;
+                if (is_jump(code[pc])) t = static_cast<size_t>(jump_target(static_cast<const Instruction &>(code[pc])));
+                if (t <= pc) back[t] = std::max(back[t], pc);
+            }
+            if (back.empty()) break;
+
+            std::vector<std::pair<size_t, size_t>> loops; // (大小, header)
+            for (std::map<size_t, size_t>::iterator it = back.begin(); it != back.end(); ++it) {
+                loops.push_back(std::make_pair(it->second - it->first, it->first));
+            }
+            std::sort(loops.begin(), loops.end());
+
+            Liveness lv;
+            compute_liveness(chunk, reg_count, lv);
+            std::vector<bool> numeric = numeric_registers(chunk, reg_count, param_count);
+
+            std::vector<bool> hoisted(n, false);
+            std::vector<bool> in_chosen(n, false);
+            std::map<size_t, size_t> chosen; // header -> back
+            std::vector<size_t> succ;
+            for (size_t l = 0; l < loops.size(); l++) {
+                size_t h = loops[l].second, e = back[h];
+
+                bool overlap = false;
+                for (size_t pc = h; pc <= e && !overlap; pc++) overlap = in_chosen[pc];
+                if (overlap) continue;
+
+                // 只能从 header 进入，同时收集出口
+                bool single_entry = true;
+                std::vector<size_t> exits;
+                for (size_t pc = 0; pc < n && single_entry; pc++) {
+                    succ.clear();
+                    inst_successors(chunk, pc, succ);
+                    bool inside = pc >= h && pc <= e;
+                    for (size_t k = 0; k < succ.size(); k++) {
+                        size_t t = succ[k];
+                        if (!inside && t > h && t <= e && t != pc + 1) single_entry = false;
+                        if (inside && (t < h || t > e)) exits.push_back(t);
+                    }
+                }
+                if (!single_entry) continue;
+
+                std::vector<int> def_count(reg_count, 0);
+                for (size_t pc = h; pc <= e; pc++) {
+                    int d = inst_def(code[pc]);
+                    if (d >= 0) def_count[d]++;
+                }
+
+                std::vector<bool> invariant_def(reg_count, false); // 定值已经被外提的寄存器
+                std::vector<int> uses;
+                size_t count = 0, live = lv.in[lv.block_of[h]].size();
+                bool changed = true;
+                while (changed) {
+                    changed = false;
+                    for (size_t pc = h; pc <= e && live + count < LICM_MAX_LIVE; pc++) {
+                        const Instruction &inst = code[pc];
+                        int d = inst_def(inst);
+                        if (hoisted[pc] || d < 0 || def_count[d] != 1 || !hoistable(inst, numeric)) continue;
+                        if (lv.live_in(chunk, h, d)) continue;
+
+                        bool ok = true;
+                        for (size_t k = 0; k < exits.size() && ok; k++) ok = !lv.live_in(chunk, exits[k], d);
+                        uses.clear();
+                        inst_uses(inst, uses);
+                        for (size_t k = 0; k < uses.size() && ok; k++) ok = def_count[uses[k]] == 0 || invariant_def[uses[k]];
+                        if (!ok) continue;
+
+                        hoisted[pc] = true;
+                        invariant_def[d] = true;
+                        count++;
+                        changed = true;
+                    }
+                }
+
+                if (count > 0) {
+                    chosen[h] = e;
+                    for (size_t pc = h; pc <= e; pc++) in_chosen[pc] = true;
+                }
+            }
+            if (chosen.empty()) break;
+
+            // 重新排列代码：外提的指令按原来的顺序放在 header 之前
+            std::vector<int> new_pc(n + 1), pre_start(n + 1, -1);
+            int pos = 0;
+            for (size_t pc = 0; pc < n; pc++) {
+                if (chosen.count(pc)) {
+                    pre_start[pc] = pos;
+                    for (size_t q = pc; q <= chosen[pc]; q++) {
+                        if (hoisted[q]) pos++;
+                    }
+                }
+                new_pc[pc] = pos;
+                if (!hoisted[pc]) pos++;
+            }
+            new_pc[n] = pos;
+
+            // 从循环外面跳到 header 的跳转要先经过 preheader
+            std::vector<long> owner(n, -1);
+            for (std::map<size_t, size_t>::iterator it = chosen.begin(); it != chosen.end(); ++it) {
+                for (size_t q = it->first; q <= it->second; q++) owner[q] = static_cast<long>(it->first);
+            }
+            auto target = [&](size_t from, size_t t) -> int {
+                t = std::min(t, n);
+                if (t < n && pre_start[t] >= 0 && owner[from] != static_cast<long>(t)) return pre_start[t];
+                return new_pc[t];
+            };
+
+            std::vector<Instruction> out;
+            out.reserve(pos);
+            for (size_t pc = 0; pc < n; pc++) {
+                if (chosen.count(pc)) {
+                    for (size_t q = pc; q <= chosen[pc]; q++) {
+                        if (hoisted[q]) {
+                            out.push_back(code[q]);
+                            total++;
+                        }
+                    }
+                }
+                if (hoisted[pc]) continue;
+                Instruction inst = code[pc];
+                if (int *t = jump_target(inst)) *t = target(pc, static_cast<size_t>(*t));
+                out.push_back(inst);
+            }
+            code.swap(out);
+        }
+        return total;
+    }
+
+    // 可以被内联的函数
+    // max_size 是它的大小限制；函数体自己也可能因为内联而变大，所以在每个调用点按当前大小检查
+    struct InlineCandidate {
+        const Chunk *chunk;
+        int param_count;
+        size_t max_size;
+    };
+
+    // 每条 OP_CALL 调用的函数名，其他指令或者确定不了的调用为空字符串
+    // 编译器总是在同一个基本块中用 OP_CONSTANT 把函数名放进 arg1 寄存器
+    static std::vector<std::string> call_targets(const Chunk &chunk) {
+        const std::vector<Instruction> &code = chunk.__code__;
+        std::vector<std::string> targets(code.size());
+        std::vector<bool> leader = block_leaders(chunk);
+        std::map<int, int> name_reg; // 寄存器 -> 字符串常量下标
+
+        for (size_t pc = 0; pc < code.size(); pc++) {
+            if (leader[pc]) name_reg.clear();
+            const Instruction &inst = code[pc];
+            if (inst.op == OP_CALL) {
+                std::map<int, int>::iterator it = name_reg.find(inst.arg1);
+                if (it != name_reg.end()) targets[pc] = chunk.__const_str__[it->second];
+            }
+
+            int d = inst_def(inst);
+            if (d < 0) continue;
+            if (inst.op == OP_CONSTANT && inst.arg1 < 0) name_reg[d] = ~inst.arg1;
+            else if (is_move(inst) && name_reg.count(inst.arg1)) name_reg[d] = name_reg[inst.arg1];
+            else name_reg.erase(d);
+        }
+        return targets;
+    }
+
+    // 函数体能否被内联
+    // 必须以 OP_RETURN_VAL 结尾，并且不能读取还没写入过的寄存器：函数帧中它们是 0，内联之后就不一定了
+    static bool inlinable(const Chunk &chunk, int param_count) {
+        if (chunk.__code__.empty() || chunk.__code__.back().op != OP_RETURN_VAL) return false;
+
+        int reg_count = count_registers(chunk, param_count);
+        Liveness lv;
+        compute_liveness(chunk, reg_count, lv);
+        for (int r = param_count; r < reg_count; r++) {
+            if (lv.live_in(chunk, 0, r)) return false;
+        }
+        return true;
+    }
+
+    // 把调用 callees 中函数的 OP_CALL 替换成函数体
+    // 函数的寄存器 r 映射到调用方的 base + r，参数从调用窗口中拷贝过来，OP_RETURN_VAL 变成写入返回值寄存器并跳到末尾
+    // 被内联函数当前的大小不能超过它的 max_size，growth_budget 限制调用方最多增加的指令数
+    // 返回内联的调用点个数
+    static size_t inline_calls(Chunk &caller, const std::unordered_map<std::string, InlineCandidate> &callees,
+                               size_t growth_budget) {
+        std::vector<Instruction> &code = caller.__code__;
+        size_t n = code.size();
+        std::vector<std::string> targets = call_targets(caller);
+
+        // 选出要内联的调用点，并计算每条指令在新代码中的位置
+        std::vector<const InlineCandidate *> site(n, NULL);
+        std::vector<int> new_pc(n + 1);
+        size_t growth = 0, count = 0;
+        int pos = 0;
+        for (size_t pc = 0; pc < n; pc++) {
+            new_pc[pc] = pos;
+            std::unordered_map<std::string, InlineCandidate>::const_iterator it;
+            if (code[pc].op == OP_CALL && !targets[pc].empty() && (it = callees.find(targets[pc])) != callees.end()) {
+                const InlineCandidate &c = it->second;
+                const std::vector<Instruction> &body = c.chunk->__code__;
+                size_t size = c.param_count;
+                for (size_t j = 0; j < body.size(); j++) {
+                    size += (body[j].op == OP_RETURN_VAL && j + 1 < body.size()) ? 2 : 1;
+                }
+                if (c.param_count == code[pc].arg2 && body.size() <= c.max_size && growth + size <= growth_budget) {
+                    site[pc] = &c;
+                    growth += size;
+                    count++;
+                    pos += static_cast<int>(size);
+                    continue;
+                }
+            }
+            pos++;
+        }
+        new_pc[n] = pos;
+        if (count == 0) return 0;
+
+        int base = count_registers(caller, 0);
+        int reg_count = base;
+        std::vector<Instruction> out;
+        out.reserve(pos);
+        for (size_t pc = 0; pc < n; pc++) {
+            Instruction inst = code[pc];
+            if (!site[pc]) {
+                if (int *t = jump_target(inst)) *t = new_pc[std::min(static_cast<size_t>(*t), n)];
+                out.push_back(inst);
+                continue;
+            }
+
+            const Chunk &callee = *site[pc]->chunk;
+            const std::vector<Instruction> &body = callee.__code__;
+            int callee_regs = count_registers(callee, site[pc]->param_count);
+            reg_count = std::max(reg_count, base + callee_regs);
+            std::vector<int> shift(callee_regs);
+            for (int r = 0; r < callee_regs; r++) shift[r] = base + r;
+
+            int argc = inst.arg2, ret = inst.result;
+            for (int i = 0; i < argc; i++) out.push_back(Instruction(OP_SET_LOCAL, ret - argc + i, 0, base + i));
+
+            std::vector<int> body_pc(body.size() + 1);
+            int p = static_cast<int>(out.size());
+            for (size_t j = 0; j < body.size(); j++) {
+                body_pc[j] = p;
+                p += (body[j].op == OP_RETURN_VAL && j + 1 < body.size()) ? 2 : 1;
+            }
+            body_pc[body.size()] = p;
+
+            for (size_t j = 0; j < body.size(); j++) {
+                Instruction ci = body[j];
+                if (ci.op == OP_RETURN_VAL) {
+                    out.push_back(Instruction(OP_SET_LOCAL, base + ci.arg1, 0, ret));
+                    if (j + 1 < body.size()) out.push_back(Instruction(OP_JUMP, body_pc[body.size()], 0, 0));
+                    continue;
+                }
+
+                if (ci.op == OP_CONSTANT) {
+                    if (ci.arg1 < 0) ci.arg1 = ~static_cast<int>(caller.add_const_str(callee.__const_str__[~ci.arg1]));
+                    else ci.arg1 = static_cast<int>(caller.add_const_number(callee.__const_num__[ci.arg1]));
+                }
+                rename_regs(ci, shift);
+                if (int *t = jump_target(ci)) *t = body_pc[std::min(static_cast<size_t>(*t), body.size())];
+                out.push_back(ci);
+            }
+        }
+
+        code.swap(out);
+        caller.__reg_count__ = std::max(caller.__reg_count__, reg_count);
+        return count;
+    }
+
+    // -O2 各个 Pass 的统计
+    struct OptimizeStats {
+        size_t hoisted;  // 外提到循环外的指令
+        size_t dead;     // 删除的死代码
+
+        OptimizeStats() : hoisted(0), dead(0) {}
+    };
+
+    // -O2 的优化流程
+    static OptimizeStats optimize(Chunk &chunk, int param_count) {
+        OptimizeStats stats;
+        value_numbering(chunk, count_registers(chunk, param_count));
+        stats.hoisted = hoist_loop_invariants(chunk, param_count);
+        stats.dead = eliminate_dead_code(chunk, param_count);
+        return stats;
+    }
+
+    // 窥孔优化，在寄存器分配之后执行，返回删除的指令数
+    // 1. 删除自己拷贝给自己的 move（分配之后参数本来就在调用窗口中的情况）
+    // 2. "t = a op b; x = t" 并且 t 之后不再使用，合并成 "x = a op b"
+    // 3. OP_EQUAL + OP_NOT 合并成 OP_NOT_EQUAL
+    // 4. 跳到跳转指令的跳转直接跳到最终的目标，删除跳到下一条指令的跳转
+    // 5. 删除不可达的指令
+    static size_t peephole(Chunk &chunk, int param_count) {
+        size_t before = chunk.__code__.size();
+        for (int round = 0; round < 16; round++) {
+            std::vector<Instruction> &code = chunk.__code__;
+            size_t n = code.size();
+            if (n == 0) break;
+
+            int reg_count = count_registers(chunk, param_count);
+            Liveness lv;
+            compute_liveness(chunk, reg_count, lv);
+            std::vector<bool> leader = block_leaders(chunk);
+            std::vector<bool> keep(n, true);
+            bool changed = false;
+
+            // prev_dead[pc]：上一条指令写入的寄存器在 pc 之后不再活跃
+            std::vector<bool> prev_dead(n, false);
+            LiveSet live(reg_count);
+            for (size_t b = 0; b < lv.in.size(); b++) {
+                lv.scan_block(chunk, b, live, [&](size_t pc, const LiveSet &live_out) {
+                    int t = pc > 0 ? inst_def(code[pc - 1]) : -1;
+                    prev_dead[pc] = t >= 0 && !live_out.has(t);
+                });
+            }
+
+            for (size_t pc = 0; pc < n; pc++) {
+                Instruction &inst = code[pc];
+                if (is_move(inst) && inst.arg1 == inst.result) {
+                    keep[pc] = false;
+                    changed = true;
+                    continue;
+                }
+                if (pc == 0 || leader[pc] || !keep[pc - 1]) continue;
+
+                Instruction &prev = code[pc - 1];
+                int t = inst_def(prev);
+                if (t < 0 || t != prev.result || prev.op == OP_CALL) continue;
+
+                if (is_move(inst) && inst.arg1 == t && prev_dead[pc]) {
+                    prev.result = inst.result;
+                    keep[pc] = false;
+                    changed = true;
+                } else if (prev.op == OP_EQUAL && inst.op == OP_NOT && inst.arg1 == t && (t == inst.result || prev_dead[pc])) {
+                    prev.op = OP_NOT_EQUAL;
+                    prev.result = inst.result;
+                    keep[pc] = false;
+                    changed = true;
+                }
+            }
+
+            // 跳转链
+            for (size_t pc = 0; pc < n; pc++) {
+                Instruction &inst = code[pc];
+                int *target = jump_target(inst);
+                if (!target) continue;
+                for (size_t hops = 0; hops < n && static_cast<size_t>(*target) < n && code[*target].op == OP_JUMP && keep[*target]; hops++) {
+                    if (code[*target].arg1 == *target) break;
+                    *target = code[*target].arg1;
+                    changed = true;
+                }
+            }
+
+            // 不可达的指令
+            std::vector<bool> reachable(n, false);
+            std::vector<size_t> work(1, 0), succ;
+            reachable[0] = true;
+            while (!work.empty()) {
+                size_t pc = work.back();
+                work.pop_back();
+                succ.clear();
+                inst_successors(chunk, pc, succ);
+                for (size_t k = 0; k < succ.size(); k++) {
+                    if (succ[k] < n && !reachable[succ[k]]) {
+                        reachable[succ[k]] = true;
+                        work.push_back(succ[k]);
+                    }
+                }
+            }
+            for (size_t pc = 0; pc < n; pc++) {
+                if (!reachable[pc] && keep[pc]) {
+                    keep[pc] = false;
+                    changed = true;
+                }
+            }
+
+            // 跳到下一条（保留下来的）指令的跳转
+            for (size_t pc = 0; pc < n; pc++) {
+                const Instruction &inst = code[pc];
+                if (!keep[pc] || (inst.op != OP_JUMP && inst.op != OP_JUMP_IF_FALSE && inst.op != OP_JUMP_IF_TRUE)) continue;
+                size_t target = static_cast<size_t>(inst.op == OP_JUMP ? inst.arg1 : inst.result);
+                size_t next = pc + 1;
+                while (next < n && !keep[next]) next++;
+                if (target > pc && target <= next) {
+                    keep[pc] = false;
+                    changed = true;
+                }
+            }
+
+            if (!changed) break;
+            compact(chunk, keep);
+        }
+        return before - chunk.__code__.size();
+    }
+
+    // 基于活跃变量分析的寄存器分配
+    // 1. 按基本块求出活跃变量，再在每个块内倒着扫描得到每条指令出口处活跃的寄存器
+    // 2. 在每个定值点，被写入的寄存器和此时所有活跃的寄存器冲突（move 的源寄存器除外）
+    // 3. 贪心染色；函数参数固定在 0 ~ param_count - 1，OP_CALL / OP_NEW_ARRAY 的参数窗口作为一组整体染色
+    // 窗口之间的约束互相矛盾时保持 Chunk 不变并返回 false
+    static bool allocate_registers(Chunk &chunk, int param_count) {
+        std::vector<Instruction> &code = chunk.__code__;
+        size_t n = code.size();
+
+        int reg_count = count_registers(chunk, param_count);
+        if (reg_count == 0) return true;
+
+        Liveness lv;
+        compute_liveness(chunk, reg_count, lv);
+        std::vector<int> tmp;
+
+        // 冲突图
+        std::vector<std::vector<int>> adj(reg_count);
+        std::vector<bool> seen(reg_count, false);
+        for (size_t pc = 0; pc < n; pc++) {
+            int d = inst_def(code[pc]);
+            if (d >= 0) seen[d] = true;
+            tmp.clear();
+            inst_uses(code[pc], tmp);
+            for (size_t i = 0; i < tmp.size(); i++) seen[tmp[i]] = true;
+        }
+        LiveSet live(reg_count);
+        for (size_t b = 0; b < lv.in.size(); b++) {
+            lv.scan_block(chunk, b, live, [&](size_t pc, const LiveSet &live_out) {
+                int d = inst_def(code[pc]);
+                if (d < 0) return;
+                int move_src = is_move(code[pc]) ? code[pc].arg1 : -1;
+                for (size_t i = 0; i < live_out.members.size(); i++) {
+                    int x = live_out.members[i];
+                    if (x == d || x == move_src) continue;
+                    adj[d].push_back(x);
+                    adj[x].push_back(d);
+                }
+            });
+        }
+
+        // 入口处已经有值的寄存器：参数，以及还没写入就被读取的寄存器（VM 会初始化为 0）
+        std::vector<int> entry;
+        for (int p = 0; p < param_count; p++) entry.push_back(p);
+        for (int x = param_count; x < reg_count; x++) {
+            if (n > 0 && lv.live_in(chunk, 0, x)) entry.push_back(x);
+        }
+        for (size_t i = 0; i < entry.size(); i++) {
+            seen[entry[i]] = true;
+            for (size_t j = i + 1; j < entry.size(); j++) {
+                adj[entry[i]].push_back(entry[j]);
+                adj[entry[j]].push_back(entry[i]);
+            }
+        }
+
+        // 参数窗口分组：窗口内第 k 个寄存器必须染成 窗口首寄存器的颜色 + k
+        // 循环体会复用临时寄存器，同一个寄存器可能出现在多个窗口里，这里用带偏移的并查集把它们合并成一组
+        std::vector<int> parent(reg_count), offset(reg_count, 0);
+        for (int r = 0; r < reg_count; r++) parent[r] = r;
+        for (size_t pc = 0; pc < n; pc++) {
+            const Instruction &inst = code[pc];
+            int base, len;
+            if (inst.op == OP_CALL) {
+                base = inst.result - inst.arg2;
+                len = inst.arg2 + 1; // 返回值寄存器也在窗口中
+            } else if (inst.op == OP_NEW_ARRAY && inst.arg2 > 0) {
+                base = inst.arg1;
+                len = inst.arg2;
+            } else if (inst.op == OP_FORLOOP) {
+                base = inst.arg1;
+                len = 3;
+            } else {
+                continue;
+            }
+
+            for (int k = 0; k < len; k++) {
+                if (base + k < param_count) return false;
+                if (!unite(parent, offset, base, base + k, k)) return false;
+            }
+        }
+
+        std::vector<std::vector<int>> members(reg_count);
+        for (int r = 0; r < reg_count; r++) {
+            members[find_root(parent, offset, r)].push_back(r);
+        }
+        // 同一组内偏移相同的寄存器会染成同一种颜色，它们之间不能冲突
+        for (int r = 0; r < reg_count; r++) {
+            if (members[r].size() < 2) continue;
+            for (size_t i = 0; i < members[r].size(); i++) {
+                int m = members[r][i];
+                for (size_t j = 0; j < adj[m].size(); j++) {
+                    int x = adj[m][j];
+                    if (find_root(parent, offset, x) == r && offset[x] == offset[m]) return false;
+                }
+            }
+        }
+
+        // 贪心染色
+        std::vector<int> color(reg_count, -1);
+        for (int p = 0; p < param_count; p++) color[p] = p;
+
+        for (int r = param_count; r < reg_count; r++) {
+            if (color[r] >= 0 || !seen[r]) continue;
+            const std::vector<int> &unit = members[find_root(parent, offset, r)];
+
+            // 组内最小的偏移可能是负数，base 要保证所有寄存器的颜色都不小于 0
+            int min_off = 0;
+            for (size_t i = 0; i < unit.size(); i++) min_off = std::min(min_off, offset[unit[i]]);
+
+            // 找到最小的 base，使得组内每个寄存器 base + offset 都不和已经染色的邻居冲突
+            for (int base = -min_off; ; base++) {
+                bool ok = true;
+                for (size_t i = 0; i < unit.size() && ok; i++) {
+                    int m = unit[i];
+                    int c = base + offset[m];
+                    for (size_t j = 0; j < adj[m].size(); j++) {
+                        if (color[adj[m][j]] == c) {
+                            ok = false;
+                            break;
+                        }
+                    }
+                }
+                if (ok) {
+                    for (size_t i = 0; i < unit.size(); i++) color[unit[i]] = base + offset[unit[i]];
+                    break;
+                }
+            }
+        }
+
+        int new_count = param_count;
+        for (int r = 0; r < reg_count; r++) {
+            if (color[r] < 0) color[r] = 0; // 从未出现过的寄存器
+            new_count = std::max(new_count, color[r] + 1);
+        }
+
+        for (size_t pc = 0; pc < n; pc++) rename_regs(code[pc], color);
+        chunk.__reg_count__ = new_count;
+        return true;
+    }
+
+    // 类型推导中寄存器的类型是下面几个位的组合，0 表示执行不到
+    enum {
+        TYPE_INT = 1,
+        TYPE_DOUBLE = 2,
+        TYPE_OTHER = 4, // 字符串、数组、Map
+        TYPE_NUM = TYPE_INT | TYPE_DOUBLE,
+        TYPE_ANY = TYPE_INT | TYPE_DOUBLE | TYPE_OTHER,
+    };
+
+    // 带类型检查的指令对应的 _NUM 版本，没有的话返回 OP_HALT
+    static Opcode numeric_variant(Opcode op) {
+        switch (op) {
+            case OP_ADD: return OP_ADD_NUM;
+            case OP_SUB: return OP_SUB_NUM;
+            case OP_MUL: return OP_MUL_NUM;
+            case OP_DIV: return OP_DIV_NUM;
+            case OP_GREATER: return OP_GREATER_NUM;
+            case OP_LESS: return OP_LESS_NUM;
+            case OP_GREATER_EQUAL: return OP_GREATER_EQUAL_NUM;
+            case OP_LESS_EQUAL: return OP_LESS_EQUAL_NUM;
+            default: return OP_HALT;
+        }
+    }
+
+    // 加、减、乘的结果类型：两个整数运算溢出的时候会变成 double
+    static unsigned char arith_type(unsigned char a, unsigned char b) {
+        unsigned char t = 0;
+        if ((a & TYPE_INT) && (b & TYPE_INT)) t |= TYPE_NUM;
+        if (((a & TYPE_DOUBLE) && (b & TYPE_NUM)) || ((b & TYPE_DOUBLE) && (a & TYPE_NUM))) t |= TYPE_DOUBLE;
+        return t;
+    }
+
+    // 一条指令执行之后的类型状态
+    // 数值指令遇到非数字会直接报错退出，所以能执行到下一条指令说明操作数都是数字
+    static void transfer_types(const Instruction &inst, std::vector<unsigned char> &types) {
+        switch (inst.op) {
+            case OP_LOAD_INT:
+                types[inst.result] = TYPE_INT;
+                break;
+            case OP_CONSTANT:
+                types[inst.result] = inst.arg1 >= 0 ? TYPE_DOUBLE : TYPE_OTHER;
+                break;
+            case OP_GET_LOCAL:
+            case OP_SET_LOCAL:
+            case OP_REGISTER_LOCAL:
+                types[inst.result] = types[inst.arg1];
+                break;
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_ADD_NUM:
+            case OP_SUB_NUM:
+            case OP_MUL_NUM: {
+                unsigned char t = arith_type(types[inst.arg1], types[inst.arg2]);
+                types[inst.arg1] &= TYPE_NUM;
+                types[inst.arg2] &= TYPE_NUM;
+                types[inst.result] = t;
+                break;
+            }
+            case OP_DIV:
+            case OP_DIV_NUM:
+                types[inst.arg1] &= TYPE_NUM;
+                types[inst.arg2] &= TYPE_NUM;
+                types[inst.result] = TYPE_DOUBLE;
+                break;
+            case OP_GREATER:
+            case OP_LESS:
+            case OP_GREATER_EQUAL:
+            case OP_LESS_EQUAL:
+            case OP_GREATER_NUM:
+            case OP_LESS_NUM:
+            case OP_GREATER_EQUAL_NUM:
+            case OP_LESS_EQUAL_NUM:
+                types[inst.arg1] &= TYPE_NUM;
+                types[inst.arg2] &= TYPE_NUM;
+                types[inst.result] = TYPE_INT;
+                break;
+            case OP_EQUAL:
+            case OP_NOT_EQUAL:
+            case OP_NOT:
+                types[inst.result] = TYPE_INT;
+                break;
+            case OP_FORLOOP: {
+                unsigned char t = arith_type(types[inst.arg1], types[inst.arg1 + 2]);
+                types[inst.arg1 + 1] &= TYPE_NUM;
+                types[inst.arg1 + 2] &= TYPE_NUM;
+                types[inst.arg1] = t;
+                break;
+            }
+            default: {
+                int d = inst_def(inst);
+                if (d >= 0) types[d] = TYPE_ANY;
+                break;
+            }
+        }
+    }
+
+    struct TypeStats {
+        size_t sites;   // 算术、比较指令的个数
+        size_t proven;  // 其中操作数被证明是数字的个数
+    };
+
+    // 流敏感的类型推导：求出每条指令执行之前每个寄存器可能的类型
+    // 入口处参数的类型未知，其他寄存器都是 VM 初始化的 0.0
+    // 两个操作数都被证明是数字的指令换成 _NUM 版本；其他 Pass 只认识带检查的指令，所以这一步放在最后
+    static TypeStats specialize_types(Chunk &chunk, int param_count) {
+        TypeStats stats = {0, 0};
+        std::vector<Instruction> &code = chunk.__code__;
+        size_t n = code.size();
+        if (n == 0) return stats;
+        int reg_count = count_registers(chunk, param_count);
+
+        std::vector<std::vector<unsigned char>> in(n);
+        std::vector<bool> reached(n, false), queued(n, false);
+        in[0].assign(reg_count, TYPE_DOUBLE);
+        for (int p = 0; p < param_count && p < reg_count; p++) in[0][p] = TYPE_ANY;
+        reached[0] = queued[0] = true;
+
+        std::vector<size_t> work(1, 0), succ;
+        std::vector<unsigned char> out;
+        while (!work.empty()) {
+            size_t pc = work.back();
+            work.pop_back();
+            queued[pc] = false;
+
+            out = in[pc];
+            transfer_types(code[pc], out);
+
+            succ.clear();
+            inst_successors(chunk, pc, succ);
+            for (size_t k = 0; k < succ.size(); k++) {
+                size_t t = succ[k];
+                if (t >= n) continue;
+                bool changed = false;
+                if (!reached[t]) {
+                    in[t] = out;
+                    reached[t] = changed = true;
+                } else {
+                    for (int r = 0; r < reg_count; r++) {
+                        unsigned char m = in[t][r] | out[r];
+                        if (m != in[t][r]) {
+                            in[t][r] = m;
+                            changed = true;
+                        }
+                    }
+                }
+                if (changed && !queued[t]) {
+                    queued[t] = true;
+                    work.push_back(t);
+                }
+            }
+        }
+
+        for (size_t pc = 0; pc < n; pc++) {
+            Opcode v = numeric_variant(code[pc].op);
+            if (v == OP_HALT) continue;
+            stats.sites++;
+            if (!reached[pc]) continue;
+            if ((in[pc][code[pc].arg1] & ~TYPE_NUM) == 0 && (in[pc][code[pc].arg2] & ~TYPE_NUM) == 0) {
+                code[pc].op = v;
+                stats.proven++;
+            }
+        }
+        return stats;
+    }
+
+    static bool fits_short(int v) {
+        return v >= -32768 && v <= 32767;
+    }
+
+    static short low_half(int v) {
+        return static_cast<short>(static_cast<unsigned short>(static_cast<unsigned int>(v) & 0xffff));
+    }
+
+    static short high_half(int v) {
+        return static_cast<short>(static_cast<unsigned short>(static_cast<unsigned int>(v) >> 16));
+    }
+
+    // 最后一步：把 __code__ 编码成 VM 执行的 __bytecode__，返回加了 OP_WIDE 前缀的指令条数
+    // 跳转目标换成编码后的下标。一条指令加了前缀之后，后面所有指令的下标都会变，可能又让别的跳转超出 16 位，
+    // 所以反复计算到没有新的前缀为止；前缀只加不减，循环一定会结束
+    // 分支编号只有 --profile-gen 时才用得到，其他时候清零，函数中的分支编号都超出了 16 位
+    static size_t encode(Chunk &chunk, bool keep_branch_ids) {
+        std::vector<Instruction> code = chunk.__code__;
+        size_t n = code.size();
+        for (size_t pc = 0; pc < n; pc++) {
+            if (!keep_branch_ids && (code[pc].op == OP_JUMP_IF_FALSE || code[pc].op == OP_JUMP_IF_TRUE)) code[pc].arg2 = 0;
+        }
+
+        std::vector<bool> wide(n, false);
+        std::vector<size_t> pos(n + 1);
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            size_t p = 0;
+            for (size_t pc = 0; pc <= n; pc++) {
+                pos[pc] = p;
+                if (pc < n) p += wide[pc] ? 2 : 1;
+            }
+            for (size_t pc = 0; pc < n; pc++) {
+                if (wide[pc]) continue;
+                Instruction inst = code[pc];
+                if (is_jump(inst)) *jump_target(inst) = static_cast<int>(pos[std::min(static_cast<size_t>(jump_target(static_cast<const Instruction &>(code[pc]))), n)]);
+                if (!fits_short(inst.arg1) || !fits_short(inst.arg2) || !fits_short(inst.result)) {
+                    wide[pc] = true;
+                    changed = true;
+                }
+            }
+        }
+
+        size_t wide_count = 0;
+        chunk.__bytecode__.clear();
+        chunk.__bytecode__.reserve(pos[n]);
+        for (size_t pc = 0; pc < n; pc++) {
+            Instruction inst = code[pc];
+            if (is_jump(inst)) *jump_target(inst) = static_cast<int>(pos[std::min(static_cast<size_t>(jump_target(static_cast<const Instruction &>(code[pc]))), n)]);
+            if (wide[pc]) {
+                chunk.__bytecode__.push_back(CompactInst(OP_WIDE, high_half(inst.arg1), high_half(inst.arg2), high_half(inst.result)));
+                wide_count++;
+            }
+            chunk.__bytecode__.push_back(CompactInst(inst.op, low_half(inst.arg1), low_half(inst.arg2), low_half(inst.result)));
+        }
+        return wide_count;
+    }
+};
+
+#endif
@@ -9,72 +9,88 @@
 
 #include "lexer.h"
 #include "ast.h"
+#include<cerrno>
+#include<cstdlib>
+#include<memory>
+#include<mutex>
 
 class Parser {
-    std::vector<Token> __tokens__;
+    std::shared_ptr<const std::vector<Token>> __tokens__; // 预解析的函数体之后还要从这里解析，所以和 FuncStmt 共享
     size_t __current__;
+    bool __lazy__;  // 预解析：函数体只按括号配对跳过，第一次编译时再解析
+    std::shared_ptr<AstArena> __arena__;  // 解析出的所有节点都分配在这里
 
-    bool is_at_end() { return __current__ >= __tokens__.size() || __tokens__[__current__].type == TOK_EOF; }
+    template<class T, class... Args>
+    T *make(Args&&... args) {
+        return __arena__->make<T>(std::forward<Args>(args)...);
+    }
 
-    Token peek() {
-        if(is_at_end()) {
-            Token eof(TOK_EOF, "\0");
-            return eof;
-        }
-        return __tokens__[__current__];
+    bool is_at_end() { return __current__ >= __tokens__->size() || (*__tokens__)[__current__].type == TOK_EOF; }
+
+    // 越界时返回的 EOF，多个线程同时解析函数体时也只初始化一次
+    static const Token &eof_token() {
+        static const Token eof(TOK_EOF, "\0");
+        return eof;
     }
 
-    Token previous() {
-        if(__current__ <= 0) {
-            Token dummy(TOK_EOF, "\0");
-            return dummy;
-        }
-        return __tokens__[__current__ - 1];
+    // token 序列在解析期间不会变化，下面几个函数都直接返回其中的引用，不拷贝 lexeme
+    const Token &peek() {
+        if(is_at_end()) return eof_token();
+        return (*__tokens__)[__current__];
+    }
+
+    const Token &previous() {
+        if(__current__ <= 0) return eof_token();
+        return (*__tokens__)[__current__ - 1];
     }
     
-    bool match(TokenType type) { return __tokens__[__current__].type == type; }
+    bool match(TokenType type) { return (*__tokens__)[__current__].type == type; }
 
-    Token advance() {
-        if(is_at_end()) {
-            Token eof(TOK_EOF, "\0");
-            return eof;
-        }
-        return __tokens__[__current__++];
+    const Token &advance() {
+        if(is_at_end()) return eof_token();
+        return (*__tokens__)[__current__++];
     }
 
     // 消费 ; 使用
-    Token consume(TokenType type, const char* message) {
+    const Token &consume(TokenType type, const char* message) {
         if(match(type)) {
             advance();
             return previous();
         }
 
-        std::cerr << message << ", received: " << __tokens__[__current__].lexeme << std::endl;
+        std::cerr << message << ", received: " << (*__tokens__)[__current__].lexeme << std::endl;
         exit(1);
     }
 
     // Primary Expression
     Expr* parse_primary_expression() {
         if (match(TOK_NUMBER)) {
-            return new LiteralExpr(strtod(advance().lexeme.c_str(), nullptr));
+            const std::string &lexeme = advance().lexeme;
+            if (lexeme.find('.') == std::string::npos) {
+                // 整数字面量，超出 64 位范围的按 double 处理
+                errno = 0;
+                long long i = strtoll(lexeme.c_str(), nullptr, 10);
+                if (errno == 0) return make<LiteralExpr>(i);
+            }
+            return make<LiteralExpr>(strtod(lexeme.c_str(), nullptr));
         }
 
         if (match(TOK_STRING)) {
-            return new StringExpr(advance().lexeme);
+            return make<StringExpr>(advance().lexeme);
         }
 
         if (match(TOK_IDENTIFIER)) {
-            return new VariableExpr(advance().lexeme);
+            return make<VariableExpr>(advance().lexeme);
         }
 
         if (match(TOK_TRUE)) {
             advance();
-            return new LiteralExpr(1.0);
+            return make<LiteralExpr>(1LL);
         }
 
         if (match(TOK_FALSE)) {
             advance();
-            return new LiteralExpr(0.0);
+            return make<LiteralExpr>(0LL);
         }
         
         // 不用担心会跟函数调用的括号重复
@@ -84,6 +100,11 @@ class Parser {
             return expr;
         }
 
+        if (match(TOK_LBRACKET)) {
+            advance(); // 吃掉 [
+            return finish_array();
+        }
+
         std::cerr << "Unknown expression for token " << peek().lexeme <<"("<< __current__ <<")"<<std::endl;
         exit(1);
     }
@@ -93,13 +114,18 @@ class Parser {
 
         while(true) {
             if(match(TOK_LPAREN)) {
-                VariableExpr *e = dynamic_cast<VariableExpr *> (expr);
+                VariableExpr *e = ast_cast<VariableExpr>(expr);
                 if (!e) {
                     std::cerr << "Funciton name must be VariableExpr while calling" << std::endl;
                     exit(1);
                 }
                 advance(); // 吃掉 (
                 expr = finish_call(expr);
+            } else if(match(TOK_LBRACKET)) {
+                advance(); // 吃掉 [
+                Expr *index = parse_expression();
+                consume(TOK_RBRACKET, "Missing terminating ']' character!");
+                expr = make<IndexExpr>(expr, index);
             } else {
                 break;
             }
@@ -119,6 +145,8 @@ class Parser {
                 arguments.push_back(parse_expression());
                 advance();
             } while (previous().type == TOK_COMMA);
+        } else {
+            advance(); // 没有参数的时候直接吃掉 )
         }
 
         if(previous().type != TOK_RPAREN) {
@@ -126,14 +154,28 @@ class Parser {
             exit(1);
         }
 
-        return new CallExpr(callee, arguments);
+        return make<CallExpr>(callee, std::move(arguments));
+    }
+
+    Expr* finish_array() {
+        std::vector<Expr*> elements;
+        if(!match(TOK_RBRACKET)) {
+            elements.push_back(parse_expression());
+            while (match(TOK_COMMA)) {
+                advance(); // 吃掉 ,
+                elements.push_back(parse_expression());
+            }
+        }
+        consume(TOK_RBRACKET, "Missing terminating ']' character for array literal.");
+
+        return make<ArrayExpr>(std::move(elements));
     }
 
     Expr* parse_unary_expression() {
         if (match(TOK_BANG) || match(TOK_MINUS)) {
-            Token op = advance();
+            const Token &op = advance();
             Expr *right = parse_unary_expression();
-            return new UnaryExpr(op.lexeme, right);
+            return make<UnaryExpr>(op.lexeme, right);
         }
 
         return parse_call_expression();
@@ -142,9 +184,9 @@ class Parser {
     Expr* parse_factor_expression() {
         Expr *expr = parse_unary_expression();
         while (match(TOK_STAR) || match(TOK_SLASH)) {
-            Token op = advance();
+            const Token &op = advance();
             Expr *right = parse_unary_expression();
-            expr = new BinaryExpr(expr, op.lexeme, right);
+            expr = make<BinaryExpr>(expr, op.lexeme, right);
         }
         return expr;
     }
@@ -152,9 +194,9 @@ class Parser {
     Expr* parse_term_expression() {
         Expr *expr = parse_factor_expression();
         while (match(TOK_PLUS) || match(TOK_MINUS)) {
-            Token op = advance();
+            const Token &op = advance();
             Expr *right = parse_factor_expression();
-            expr = new BinaryExpr(expr, op.lexeme, right);
+            expr = make<BinaryExpr>(expr, op.lexeme, right);
         }
         return expr;
     }
@@ -163,9 +205,9 @@ class Parser {
         Expr *expr = parse_term_expression();
         while (match(TOK_GREATER) || match(TOK_GREATEREQUAL) ||
                match(TOK_LESS) || match(TOK_LESSEQUAL)) {
-            Token op = advance();
+            const Token &op = advance();
             Expr *right = parse_term_expression();
-            expr = new BinaryExpr(expr, op.lexeme, right);
+            expr = make<BinaryExpr>(expr, op.lexeme, right);
         }
         return expr;
     }
@@ -173,9 +215,9 @@ class Parser {
     Expr* parse_equality_expression() {
         Expr *expr = parse_comparison_expression();
         while (match(TOK_EQUALEQUAL) || match(TOK_NOTEQUAL)) {
-            Token op = advance();
+            const Token &op = advance();
             Expr *right = parse_comparison_expression();
-            expr = new BinaryExpr(expr, op.lexeme, right);
+            expr = make<BinaryExpr>(expr, op.lexeme, right);
         }
         return expr;
     }
@@ -184,16 +226,18 @@ class Parser {
         Expr *expr = parse_equality_expression();
 
         if (match(TOK_EQUAL)) {
-            Token eq = advance();
+            advance(); // 吃掉 =
             Expr *value = parse_assignment_expression();
             
-            VariableExpr *var = dynamic_cast<VariableExpr*>(expr);
+            VariableExpr *var = ast_cast<VariableExpr>(expr);
+            IndexExpr *idx = ast_cast<IndexExpr>(expr);
             if(var) {
-                return new AssignExpr(var->name, value);
+                return make<AssignExpr>(var->name, value);
+            } else if(idx) {
+                // 原来的 IndexExpr 不用释放，和其他节点一起随 arena 释放
+                return make<IndexAssignExpr>(idx->object, idx->index, value);
             } else {
                 std::cerr<<"Invalid assignment target."<<std::endl;
-                delete expr;
-                delete value;
                 exit(1);
             }
         }
@@ -233,14 +277,14 @@ class Parser {
             advance(); // 吃掉 else
             if (match(TOK_IF)) {
                 Stmt* elIf = parse_if_statement();
-                elseBranch = new Block();
+                elseBranch = make<Block>();
                 elseBranch->statements.push_back(elIf);
             } else {
                 elseBranch = parse_block();
             }
         }
 
-        return new IfStmt(condition, thenBranch, elseBranch);
+        return make<IfStmt>(condition, thenBranch, elseBranch);
     }
 
     Stmt* parse_for_statement() {
@@ -275,7 +319,7 @@ class Parser {
         Block *body = parse_block();
         // std::cout<<"Parsed successfully"<<std::endl;
 
-        return new ForStmt(initializer, condition, increment, body);
+        return make<ForStmt>(initializer, condition, increment, body);
     }
 
     Stmt* parse_while_statement() {
@@ -285,12 +329,12 @@ class Parser {
         consume(TOK_RPAREN, "Missing terminating ')' character.");
 
         Block *body = parse_block();
-        return new WhileStmt(condition, body);
+        return make<WhileStmt>(condition, body);
     }
 
     Stmt* parse_let_statement() {
         advance(); // 吃掉 let
-        Token name = consume(TOK_IDENTIFIER, "Expected identifier as a variable name.");
+        const Token &name = consume(TOK_IDENTIFIER, "Expected identifier as a variable name.");
 
         Expr* initializer = nullptr;
         if (match(TOK_EQUAL)) {
@@ -299,13 +343,13 @@ class Parser {
         }
 
         consume(TOK_SEMICOLON, "Expected ; after let statement.");
-        return new LetStmt(name.lexeme, initializer);
+        return make<LetStmt>(name.lexeme, initializer);
     }
 
     Stmt* parse_func_statement() {
         std::cout << "Parsing function statement." << std::endl;
         advance(); // 吃掉 func 
-        Token name = consume(TOK_IDENTIFIER, "Expected identifier as a function name.");
+        const Token &name = consume(TOK_IDENTIFIER, "Expected identifier as a function name.");
         consume(TOK_LPAREN, "Expected '(' character after function name.");
 
         std::vector<std::string> params;
@@ -319,47 +363,66 @@ class Parser {
                     exit(1);
                 }
 
-                Token param = consume(TOK_IDENTIFIER, "Expected identifier as a parameter name.");
+                const Token &param = consume(TOK_IDENTIFIER, "Expected identifier as a parameter name.");
                 params.push_back(param.lexeme);
             } while (match(TOK_COMMA));
         }
         consume(TOK_RPAREN, "Missing terminating ')' character while defining function.");
+        if (__lazy__) {
+            FuncStmt *fn = make<FuncStmt>(name.lexeme, std::move(params), nullptr);
+            fn->tokens = __tokens__;
+            fn->body_begin = __current__;
+            skip_block();
+            return fn;
+        }
         std::cout << "Parsing function body ..." << std::endl;
         Block *body = parse_block();
         std::cout << "Parsed function body successfully."<<std::endl;
-        return new FuncStmt(name.lexeme, params, body);
+        return make<FuncStmt>(name.lexeme, std::move(params), body);
     }
 
     Stmt* parse_return_statement() {
         advance(); // 吃掉 return
         Expr *expr = parse_expression();
         consume(TOK_SEMICOLON, "Expected ; after return statement.");
-        return new ReturnStmt(expr);
+        return make<ReturnStmt>(expr);
     }
 
     Stmt* parse_expression_statement() {
         Expr *expr = parse_expression();
         consume(TOK_SEMICOLON, "Expected ; after expression");
-        return new ExprStmt(expr);
+        return make<ExprStmt>(expr);
     }
 
     Stmt* parse_break_statement() {
         advance(); // 吃掉 break
         consume(TOK_SEMICOLON, "Expected ; after break");
-        return new BreakStmt();
+        return make<BreakStmt>();
     }
 
     Stmt* parse_continue_statement() {
         advance(); // 吃掉 continue
         consume(TOK_SEMICOLON, "Expected ; after continue");
-        return new ContinueStmt();
+        return make<ContinueStmt>();
+    }
+
+    // 跳过一个 { ... }，只做括号配对，不生成 AST。字符串是单独的 token，里面的括号不会被算进去
+    void skip_block() {
+        consume(TOK_LBRACE, "Expected LBRACE as start of block.");
+        size_t depth = 1;
+        while (depth > 0) {
+            if (is_at_end()) consume(TOK_RBRACE, "Missing terminating RBRACE after a block");
+            TokenType type = (*__tokens__)[__current__++].type;
+            if (type == TOK_LBRACE) depth++;
+            else if (type == TOK_RBRACE) depth--;
+        }
     }
 
     Block* parse_block() {
-        Block *block = new Block();
+        Block *block = make<Block>();
         consume(TOK_LBRACE, "Expected LBRACE as start of block.");
         while (!match(TOK_RBRACE) && !is_at_end()) {
-            // std::cout<<"Parsing statement starting with " << __tokens__[__current__].lexeme << std::endl;
+            // std::cout<<"Parsing statement starting with " << (*__tokens__)[__current__].lexeme << std::endl;
             block->statements.push_back(parse_statement());
         }
         consume(TOK_RBRACE, "Missing terminating RBRACE after a block");
@@ -368,12 +431,34 @@ class Parser {
 
 public:
 
-    explicit Parser(const std::vector<Token> tokens) : __tokens__(tokens), __current__(0) {}
+    // tokens 按值传入，调用方不再需要时可以 std::move 进来，整个 token 序列只保存一份
+    explicit Parser(std::vector<Token> tokens, bool lazy = false) : __tokens__(std::make_shared<const std::vector<Token>>(std::move(tokens))), __current__(0), __lazy__(lazy),
+        __arena__(std::make_shared<AstArena>()) {}
+
+    // 从 tokens 的 start 处开始解析，用于预解析过的函数体
+    Parser(const std::shared_ptr<const std::vector<Token>> &tokens, size_t start) : __tokens__(tokens), __current__(start), __lazy__(false),
+        __arena__(std::make_shared<AstArena>()) {}
+
+    // parse 返回的 AST 属于这个 arena，Parser 析构之后还要使用 AST 的话需要持有它
+    const std::shared_ptr<AstArena> &arena() const {
+        return __arena__;
+    }
+
+    // 返回函数体，预解析过的函数在这里才解析。函数可能在多个线程中同时编译（-j、pmap 中第一次调用），所以用 call_once
+    static Block *parse_body(FuncStmt *stmt) {
+        std::call_once(stmt->body_parsed, [stmt]() {
+            if (stmt->body != NULL) return;
+            Parser p(stmt->tokens, stmt->body_begin);
+            stmt->body = p.parse_block();
+            stmt->body_arena = p.arena();
+        });
+        return stmt->body;
+    }
 
     Block* parse() {
-        Block* program = new Block();
+        Block* program = make<Block>();
         while(!is_at_end()) {
-            // std::cout << "Parsing statement starting with " << __tokens__[__current__].lexeme <<std::endl;
+            // std::cout << "Parsing statement starting with " << (*__tokens__)[__current__].lexeme <<std::endl;
             program->statements.push_back(parse_statement());
         }
 
@@ -0,0 +1,133 @@
+/*************************************************************************
+	> File Name: profile.h
+	> Author: Bryan Si (SeongLam)
+	> Created Time: Mon Oct 19 18:42:05 2026
+ ************************************************************************/
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include<string>
+#include<vector>
+#include<unordered_map>
+#include<fstream>
+#include<sstream>
+#include<iostream>
+#include<algorithm>
+
+// 运行时收集的 profile：每个条件分支的条件成立 / 不成立的次数，以及每个用户函数的调用次数
+// --profile-gen 运行时由 VM 记录并写入文件，--profile-use 编译时读入，用来决定分支布局和内联
+//
+// 分支编号在编译时按源码顺序分配：高 16 位是函数的序号（主程序为 0，函数按声明顺序从 1 开始），
+// 低 16 位是函数内的第几个条件，0 表示没有编号。-O1 的计数 for 循环也占用一个编号，所以源码不变时各个优化级别下的编号一致
+// 但是各级别生成的代码不同，同一个分支的计数也不同（比如计数 for 循环只在进入时检查一次条件），
+// 所以文件中记录了生成它的优化级别，--profile-use 只接受同一级别生成的 profile
+//
+// 文件格式（文本）：
+//   minilang-profile 2
+//   opt-level <优化级别>
+//   branch <编号> <成立次数> <不成立次数>
+//   call <函数名> <调用次数>
+
+struct BranchCount {
+    unsigned long long taken;       // 条件成立
+    unsigned long long not_taken;   // 条件不成立
+
+    BranchCount() : taken(0), not_taken(0) {}
+};
+
+class Profile {
+public:
+    std::unordered_map<int, BranchCount> __branches__;
+    std::unordered_map<std::string, unsigned long long> __calls__;
+    unsigned long long __total_calls__ = 0;
+    int __opt_level__ = -1;     // 生成这份 profile 时的优化级别
+
+    void record_branch(int id, bool cond) {
+        BranchCount &c = __branches__[id];
+        if (cond) c.taken++;
+        else c.not_taken++;
+    }
+
+    void record_call(const std::string &name) {
+        __calls__[name]++;
+        __total_calls__++;
+    }
+
+    // 条件执行过，并且成立的次数多于不成立的次数
+    bool mostly_true(int id) const {
+        std::unordered_map<int, BranchCount>::const_iterator it = __branches__.find(id);
+        return it != __branches__.end() && it->second.taken > it->second.not_taken;
+    }
+
+    unsigned long long call_count(const std::string &name) const {
+        std::unordered_map<std::string, unsigned long long>::const_iterator it = __calls__.find(name);
+        return it == __calls__.end() ? 0 : it->second;
+    }
+
+    // 热函数：至少调用了 HOT_CALLS 次，并且占全部调用的 1% 以上
+    bool hot(const std::string &name) const {
+        static const unsigned long long HOT_CALLS = 100;
+        unsigned long long n = call_count(name);
+        return n >= HOT_CALLS && n * 100 >= __total_calls__;
+    }
+
+    bool save(const std::string &path) const {
+        std::ofstream out(path.c_str());
+        if (!out) return false;
+
+        // 按编号排序输出，同一个程序得到的文件内容是确定的
+        std::vector<int> ids;
+        for (std::unordered_map<int, BranchCount>::const_iterator it = __branches__.begin(); it != __branches__.end(); ++it) ids.push_back(it->first);
+        std::sort(ids.begin(), ids.end());
+        std::vector<std::string> names;
+        for (std::unordered_map<std::string, unsigned long long>::const_iterator it = __calls__.begin(); it != __calls__.end(); ++it) names.push_back(it->first);
+        std::sort(names.begin(), names.end());
+
+        out << "minilang-profile 2" << std::endl;
+        out << "opt-level " << __opt_level__ << std::endl;
+        for (size_t i = 0; i < ids.size(); i++) {
+            const BranchCount &c = __branches__.find(ids[i])->second;
+            out << "branch " << ids[i] << " " << c.taken << " " << c.not_taken << std::endl;
+        }
+        for (size_t i = 0; i < names.size(); i++) {
+            out << "call " << names[i] << " " << __calls__.find(names[i])->second << std::endl;
+        }
+        return static_cast<bool>(out);
+    }
+
+    bool load(const std::string &path) {
+        std::ifstream in(path.c_str());
+        if (!in) return false;
+
+        std::string line;
+        if (!std::getline(in, line) || line != "minilang-profile 2") return false;
+        if (!std::getline(in, line)) return false;
+        std::istringstream header(line);
+        std::string key;
+        if (!(header >> key >> __opt_level__) || key != "opt-level") return false;
+
+        while (std::getline(in, line)) {
+            std::istringstream ss(line);
+            std::string kind;
+            ss >> kind;
+            if (kind == "branch") {
+                int id;
+                BranchCount c;
+                if (!(ss >> id >> c.taken >> c.not_taken)) return false;
+                __branches__[id] = c;
+            } else if (kind == "call") {
+                std::string name;
+                unsigned long long n;
+                if (!(ss >> name >> n)) return false;
+                __calls__[name] = n;
+                __total_calls__ += n;
+            } else if (!kind.empty()) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,12 @@
+let primes = [2, 3, 5, 7];
+push(primes, 11);
+
+let sum = 0;
+for (let i = 0; i < len(primes); i = i + 1) {
+    sum = sum + primes[i];
+}
+print(sum);
+
+primes[0] = "two";
+print(primes);
+print(len(primes));
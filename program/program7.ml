@@ -0,0 +1,17 @@
+let words = ["apple", "pear", "apple", "fig", "pear", "apple"];
+let count = map();
+
+for (let i = 0; i < len(words); i = i + 1) {
+    count[words[i]] = get(count, words[i], 0) + 1;
+}
+
+let it = map_next(count, -1);
+while (it >= 0) {
+    print(map_key(count, it));
+    print(map_value(count, it));
+    it = map_next(count, it);
+}
+
+del(count, "fig");
+print(has(count, "fig"));
+print(len(count));
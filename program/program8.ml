@@ -0,0 +1,17 @@
+func square(x) {
+    return x * x;
+}
+
+func add(acc, x) {
+    return acc + x;
+}
+
+let nums = [];
+for (let i = 1; i <= 5000; i = i + 1) {
+    push(nums, i);
+}
+
+let squares = pmap(square, nums);
+print(squares[4999]);
+print(preduce(add, squares, 0));
+print(pmap(square, [1, 2, 3]));
@@ -0,0 +1,350 @@
+/*************************************************************************
+	> File Name: simd.h
+	> Author: Bryan Si (SeongLam)
+	> Created Time: Mon Oct 19 10:12:40 2026
+ ************************************************************************/
+
+#ifndef SIMD_H
+#define SIMD_H
+
+#include<cstddef>
+
+// 批量数值运算的内核，VM 中的 sum / dot / min / max / scale / axpy / prefix_sum 都会调用这里
+// 在 x86 上根据运行时的 CPU 能力选择 AVX2 或 SSE2 的实现，其他平台使用标量实现
+// 注意：向量化的求和会改变加法的结合顺序，结果和标量循环可能有最后几位的差别
+// min / max 中只要有 NaN，结果就是数组中的第一个 NaN，和它的位置无关；
+// _mm_min_pd / _mm_max_pd 遇到 NaN 时只返回第二个操作数，所以向量实现另外用无序比较记录 NaN，发现之后交给标量实现
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MINILANG_SIMD_X86 1
+#include<immintrin.h>
+#endif
+
+struct SimdKernels {
+    const char *name;
+    double (*sum)(const double *a, size_t n);
+    double (*dot)(const double *a, const double *b, size_t n);
+    double (*min)(const double *a, size_t n); // n 必须大于 0
+    double (*max)(const double *a, size_t n); // n 必须大于 0
+    void (*scale)(double *a, size_t n, double k);
+    void (*axpy)(double alpha, const double *x, double *y, size_t n);
+    void (*prefix_sum)(double *a, size_t n);
+};
+
+// 标量实现
+
+inline double scalar_sum(const double *a, size_t n) {
+    double s = 0.0;
+    for (size_t i = 0; i < n; i++) s += a[i];
+    return s;
+}
+
+inline double scalar_dot(const double *a, const double *b, size_t n) {
+    double s = 0.0;
+    for (size_t i = 0; i < n; i++) s += a[i] * b[i];
+    return s;
+}
+
+// a[0] 是 NaN 时比较总是 false，m 一直是 a[0]；后面的 NaN 会让 a[i] < m 不成立，单独检查
+inline double scalar_min(const double *a, size_t n) {
+    double m = a[0];
+    if (m != m) return m;
+    for (size_t i = 1; i < n; i++) {
+        if (a[i] < m) m = a[i];
+        else if (a[i] != a[i]) return a[i];
+    }
+    return m;
+}
+
+inline double scalar_max(const double *a, size_t n) {
+    double m = a[0];
+    if (m != m) return m;
+    for (size_t i = 1; i < n; i++) {
+        if (a[i] > m) m = a[i];
+        else if (a[i] != a[i]) return a[i];
+    }
+    return m;
+}
+
+inline void scalar_scale(double *a, size_t n, double k) {
+    for (size_t i = 0; i < n; i++) a[i] *= k;
+}
+
+inline void scalar_axpy(double alpha, const double *x, double *y, size_t n) {
+    for (size_t i = 0; i < n; i++) y[i] += alpha * x[i];
+}
+
+inline void scalar_prefix_sum(double *a, size_t n) {
+    double carry = 0.0;
+    for (size_t i = 0; i < n; i++) {
+        carry += a[i];
+        a[i] = carry;
+    }
+}
+
+#ifdef MINILANG_SIMD_X86
+
+// SSE2 实现，每次处理 2 个 double
+
+__attribute__((target("sse2")))
+inline double sse2_hsum(__m128d v) {
+    return _mm_cvtsd_f64(_mm_add_sd(v, _mm_unpackhi_pd(v, v)));
+}
+
+__attribute__((target("sse2")))
+inline double sse2_sum(const double *a, size_t n) {
+    __m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        acc0 = _mm_add_pd(acc0, _mm_loadu_pd(a + i));
+        acc1 = _mm_add_pd(acc1, _mm_loadu_pd(a + i + 2));
+    }
+    double s = sse2_hsum(_mm_add_pd(acc0, acc1));
+    for (; i < n; i++) s += a[i];
+    return s;
+}
+
+__attribute__((target("sse2")))
+inline double sse2_dot(const double *a, const double *b, size_t n) {
+    __m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        acc0 = _mm_add_pd(acc0, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+        acc1 = _mm_add_pd(acc1, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+    }
+    double s = sse2_hsum(_mm_add_pd(acc0, acc1));
+    for (; i < n; i++) s += a[i] * b[i];
+    return s;
+}
+
+__attribute__((target("sse2")))
+inline double sse2_min(const double *a, size_t n) {
+    if (n < 2) return a[0];
+    __m128d m = _mm_loadu_pd(a);
+    __m128d nan = _mm_cmpunord_pd(m, m);
+    size_t i = 2;
+    for (; i + 2 <= n; i += 2) {
+        __m128d x = _mm_loadu_pd(a + i);
+        nan = _mm_or_pd(nan, _mm_cmpunord_pd(x, x));
+        m = _mm_min_pd(m, x);
+    }
+    if (_mm_movemask_pd(nan)) return scalar_min(a, n);
+    m = _mm_min_sd(m, _mm_unpackhi_pd(m, m));
+    double r = _mm_cvtsd_f64(m);
+    for (; i < n; i++) {
+        if (a[i] != a[i]) return scalar_min(a, n);
+        if (a[i] < r) r = a[i];
+    }
+    return r;
+}
+
+__attribute__((target("sse2")))
+inline double sse2_max(const double *a, size_t n) {
+    if (n < 2) return a[0];
+    __m128d m = _mm_loadu_pd(a);
+    __m128d nan = _mm_cmpunord_pd(m, m);
+    size_t i = 2;
+    for (; i + 2 <= n; i += 2) {
+        __m128d x = _mm_loadu_pd(a + i);
+        nan = _mm_or_pd(nan, _mm_cmpunord_pd(x, x));
+        m = _mm_max_pd(m, x);
+    }
+    if (_mm_movemask_pd(nan)) return scalar_max(a, n);
+    m = _mm_max_sd(m, _mm_unpackhi_pd(m, m));
+    double r = _mm_cvtsd_f64(m);
+    for (; i < n; i++) {
+        if (a[i] != a[i]) return scalar_max(a, n);
+        if (a[i] > r) r = a[i];
+    }
+    return r;
+}
+
+__attribute__((target("sse2")))
+inline void sse2_scale(double *a, size_t n, double k) {
+    __m128d kv = _mm_set1_pd(k);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) _mm_storeu_pd(a + i, _mm_mul_pd(_mm_loadu_pd(a + i), kv));
+    for (; i < n; i++) a[i] *= k;
+}
+
+__attribute__((target("sse2")))
+inline void sse2_axpy(double alpha, const double *x, double *y, size_t n) {
+    __m128d av = _mm_set1_pd(alpha);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        _mm_storeu_pd(y + i, _mm_add_pd(_mm_loadu_pd(y + i), _mm_mul_pd(av, _mm_loadu_pd(x + i))));
+    }
+    for (; i < n; i++) y[i] += alpha * x[i];
+}
+
+__attribute__((target("sse2")))
+inline void sse2_prefix_sum(double *a, size_t n) {
+    __m128d zero = _mm_setzero_pd();
+    __m128d carry = zero;
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128d x = _mm_loadu_pd(a + i);
+        x = _mm_add_pd(x, _mm_unpacklo_pd(zero, x)); // [x0, x0 + x1]
+        x = _mm_add_pd(x, carry);
+        _mm_storeu_pd(a + i, x);
+        carry = _mm_unpackhi_pd(x, x);
+    }
+    double c = _mm_cvtsd_f64(carry);
+    for (; i < n; i++) {
+        c += a[i];
+        a[i] = c;
+    }
+}
+
+// AVX2 实现，每次处理 4 个 double
+
+__attribute__((target("avx2")))
+inline double avx2_hsum(__m256d v) {
+    __m128d lo = _mm256_castpd256_pd128(v);
+    __m128d hi = _mm256_extractf128_pd(v, 1);
+    lo = _mm_add_pd(lo, hi);
+    return _mm_cvtsd_f64(_mm_add_sd(lo, _mm_unpackhi_pd(lo, lo)));
+}
+
+__attribute__((target("avx2")))
+inline double avx2_sum(const double *a, size_t n) {
+    __m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm256_add_pd(acc0, _mm256_loadu_pd(a + i));
+        acc1 = _mm256_add_pd(acc1, _mm256_loadu_pd(a + i + 4));
+    }
+    double s = avx2_hsum(_mm256_add_pd(acc0, acc1));
+    for (; i < n; i++) s += a[i];
+    return s;
+}
+
+__attribute__((target("avx2")))
+inline double avx2_dot(const double *a, const double *b, size_t n) {
+    __m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+        acc1 = _mm256_add_pd(acc1, _mm256_mul_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4)));
+    }
+    double s = avx2_hsum(_mm256_add_pd(acc0, acc1));
+    for (; i < n; i++) s += a[i] * b[i];
+    return s;
+}
+
+__attribute__((target("avx2")))
+inline double avx2_min(const double *a, size_t n) {
+    if (n < 4) return scalar_min(a, n);
+    __m256d m = _mm256_loadu_pd(a);
+    __m256d nan = _mm256_cmp_pd(m, m, _CMP_UNORD_Q);
+    size_t i = 4;
+    for (; i + 4 <= n; i += 4) {
+        __m256d x = _mm256_loadu_pd(a + i);
+        nan = _mm256_or_pd(nan, _mm256_cmp_pd(x, x, _CMP_UNORD_Q));
+        m = _mm256_min_pd(m, x);
+    }
+    if (_mm256_movemask_pd(nan)) return scalar_min(a, n);
+    __m128d h = _mm_min_pd(_mm256_castpd256_pd128(m), _mm256_extractf128_pd(m, 1));
+    h = _mm_min_sd(h, _mm_unpackhi_pd(h, h));
+    double r = _mm_cvtsd_f64(h);
+    for (; i < n; i++) {
+        if (a[i] != a[i]) return scalar_min(a, n);
+        if (a[i] < r) r = a[i];
+    }
+    return r;
+}
+
+__attribute__((target("avx2")))
+inline double avx2_max(const double *a, size_t n) {
+    if (n < 4) return scalar_max(a, n);
+    __m256d m = _mm256_loadu_pd(a);
+    __m256d nan = _mm256_cmp_pd(m, m, _CMP_UNORD_Q);
+    size_t i = 4;
+    for (; i + 4 <= n; i += 4) {
+        __m256d x = _mm256_loadu_pd(a + i);
+        nan = _mm256_or_pd(nan, _mm256_cmp_pd(x, x, _CMP_UNORD_Q));
+        m = _mm256_max_pd(m, x);
+    }
+    if (_mm256_movemask_pd(nan)) return scalar_max(a, n);
+    __m128d h = _mm_max_pd(_mm256_castpd256_pd128(m), _mm256_extractf128_pd(m, 1));
+    h = _mm_max_sd(h, _mm_unpackhi_pd(h, h));
+    double r = _mm_cvtsd_f64(h);
+    for (; i < n; i++) {
+        if (a[i] != a[i]) return scalar_max(a, n);
+        if (a[i] > r) r = a[i];
+    }
+    return r;
+}
+
+__attribute__((target("avx2")))
+inline void avx2_scale(double *a, size_t n, double k) {
+    __m256d kv = _mm256_set1_pd(k);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) _mm256_storeu_pd(a + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), kv));
+    for (; i < n; i++) a[i] *= k;
+}
+
+__attribute__((target("avx2")))
+inline void avx2_axpy(double alpha, const double *x, double *y, size_t n) {
+    __m256d av = _mm256_set1_pd(alpha);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(y + i, _mm256_add_pd(_mm256_loadu_pd(y + i), _mm256_mul_pd(av, _mm256_loadu_pd(x + i))));
+    }
+    for (; i < n; i++) y[i] += alpha * x[i];
+}
+
+__attribute__((target("avx2")))
+inline void avx2_prefix_sum(double *a, size_t n) {
+    __m256d zero = _mm256_setzero_pd();
+    __m256d carry = zero;
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d x = _mm256_loadu_pd(a + i);
+        // 寄存器内做两次错位相加：先错开 1 个 lane，再错开 2 个 lane
+        __m256d t = _mm256_blend_pd(_mm256_permute4x64_pd(x, _MM_SHUFFLE(2, 1, 0, 0)), zero, 0x1);
+        x = _mm256_add_pd(x, t);
+        t = _mm256_blend_pd(_mm256_permute4x64_pd(x, _MM_SHUFFLE(1, 0, 0, 0)), zero, 0x3);
+        x = _mm256_add_pd(x, t);
+        x = _mm256_add_pd(x, carry);
+        _mm256_storeu_pd(a + i, x);
+        carry = _mm256_permute4x64_pd(x, _MM_SHUFFLE(3, 3, 3, 3));
+    }
+    double c = _mm256_cvtsd_f64(carry);
+    for (; i < n; i++) {
+        c += a[i];
+        a[i] = c;
+    }
+}
+
+#endif
+
+inline const SimdKernels& scalar_kernels() {
+    static const SimdKernels k = {
+        "scalar", scalar_sum, scalar_dot, scalar_min, scalar_max, scalar_scale, scalar_axpy, scalar_prefix_sum
+    };
+    return k;
+}
+
+inline const SimdKernels& detect_simd_kernels() {
+#ifdef MINILANG_SIMD_X86
+    static const SimdKernels avx2 = {
+        "avx2", avx2_sum, avx2_dot, avx2_min, avx2_max, avx2_scale, avx2_axpy, avx2_prefix_sum
+    };
+    static const SimdKernels sse2 = {
+        "sse2", sse2_sum, sse2_dot, sse2_min, sse2_max, sse2_scale, sse2_axpy, sse2_prefix_sum
+    };
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return avx2;
+    if (__builtin_cpu_supports("sse2")) return sse2;
+#endif
+    return scalar_kernels();
+}
+
+// 第一次调用时检测 CPU，之后直接返回选好的内核表
+inline const SimdKernels& simd_kernels() {
+    static const SimdKernels &selected = detect_simd_kernels();
+    return selected;
+}
+
+#endif
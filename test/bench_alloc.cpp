@@ -0,0 +1,126 @@
+/*************************************************************************
+	> File Name: bench_alloc.cpp
+	> Author: Bryan Si (SeongLam)
+	> Created Time: Tue Oct 20 02:41:17 2026
+ ************************************************************************/
+
+// 统计一个大脚本从源码到交给 VM 的每个阶段的堆分配次数和字节数
+// 各阶段的写法和 main.cpp 中的 compile_source 一致，用来观察各阶段之间的数据是不是被拷贝了
+// 编译: g++ --std=c++11 -O2 -pthread bench_alloc.cpp -o bench_alloc
+//
+// 改动前的数字（d07e2fe 之前各阶段之间拷贝数据）这样得到，BENCH_BASELINE 换用当时的取出接口：
+//   git worktree add /tmp/before d07e2fe~1
+//   cp test/bench_alloc.cpp test/bench_common.h /tmp/before/test/
+//   g++ --std=c++11 -O2 -pthread -DBENCH_BASELINE /tmp/before/test/bench_alloc.cpp -o bench_alloc_before
+
+// 下面替换了全局的 operator new/delete，GCC 把 new 内联成 malloc 之后会认为每个 delete 都不匹配
+// 这里的 new 和 delete 是成对替换的，关掉这个警告
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+#include "../lexer.h"
+#include "../parser.h"
+#include "../compiler.h"
+#include "../vm.h"
+#include "bench_common.h"
+#include<iostream>
+#include<iomanip>
+#include<vector>
+#include<string>
+#include<utility>
+#include<cstdlib>
+#include<new>
+
+static size_t g_alloc_count = 0, g_alloc_bytes = 0;
+
+void *operator new(size_t size) {
+    g_alloc_count++;
+    g_alloc_bytes += size;
+    void *p = std::malloc(size ? size : 1);
+    if (p == NULL) throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    std::free(p);
+}
+
+struct Stage {
+    const char *name;
+    size_t count, bytes;
+};
+
+static std::vector<Stage> stages;
+static size_t last_count = 0, last_bytes = 0;
+
+static void end_stage(const char *name) {
+    Stage s = { name, g_alloc_count - last_count, g_alloc_bytes - last_bytes };
+    last_count = g_alloc_count;
+    last_bytes = g_alloc_bytes;
+    stages.push_back(s);
+}
+
+int main() {
+    const int funcs = 4000;
+    std::string source = make_program(funcs);
+    stages.reserve(8);
+
+    // 编译器和解析器会输出日志，统计时关掉标准输出
+    std::streambuf *saved = std::cout.rdbuf(NULL);
+    VirtualMachine vm;
+    CompileOptions options;
+    std::vector<std::string> builtins = vm.builtin_names();
+    options.builtins.insert(builtins.begin(), builtins.end());
+    Compiler c(MainCompiler);
+    c.set_options(options);
+    last_count = g_alloc_count;
+    last_bytes = g_alloc_bytes;
+
+    std::vector<Token> tokens = lex(source);
+    end_stage("lex");
+
+    Parser p(std::move(tokens));
+    Block *program = p.parse();
+    end_stage("parse");
+
+    c.compile(program);
+    end_stage("compile");
+
+#ifdef BENCH_BASELINE
+    Chunk chk = c.get_chunk();
+    std::unordered_map<std::string, Func> user_funcs = c.get_user_func();
+    const std::vector<std::string> &order = c.get_func_order();
+    std::vector<Func> defined;
+    defined.reserve(order.size());
+    for (size_t i = 0; i < order.size(); i++) defined.push_back(user_funcs.find(order[i])->second);
+    for (size_t i = 0; i < defined.size(); i++) vm.define_function(defined[i]);
+#else
+    Chunk chk = c.take_chunk();
+    std::unordered_map<std::string, Func> user_funcs = c.take_user_func();
+    const std::vector<std::string> &order = c.get_func_order();
+    std::vector<Func> defined;
+    defined.reserve(order.size());
+    for (size_t i = 0; i < order.size(); i++) defined.push_back(std::move(user_funcs.find(order[i])->second));
+    for (size_t i = 0; i < defined.size(); i++) vm.define_function(std::move(defined[i]));
+#endif
+    end_stage("hand-off to VM");
+    std::cout.rdbuf(saved);
+    std::cout.clear();
+
+    size_t total_count = 0, total_bytes = 0;
+    std::cout << "program: " << funcs << " functions, " << source.size() / 1024 << " KB" << std::endl;
+    for (size_t i = 0; i < stages.size(); i++) {
+        std::cout << std::left << std::setw(16) << stages[i].name << std::right << std::setw(10) << stages[i].count << " allocations "
+                  << std::setw(10) << std::fixed << std::setprecision(1) << stages[i].bytes / 1048576.0 << " MB" << std::endl;
+        total_count += stages[i].count;
+        total_bytes += stages[i].bytes;
+    }
+    std::cout << std::left << std::setw(16) << "total" << std::right << std::setw(10) << total_count << " allocations "
+              << std::setw(10) << total_bytes / 1048576.0 << " MB" << std::endl;
+    return 0;
+}
@@ -0,0 +1,63 @@
+/*************************************************************************
+	> File Name: bench_common.h
+	> Author: Bryan Si (SeongLam)
+	> Created Time: Tue Oct 20 03:12:40 2026
+ ************************************************************************/
+
+#ifndef BENCH_COMMON_H
+#define BENCH_COMMON_H
+
+// 各个 benchmark 共用的计时、词法分析和生成源码的函数
+
+#include "../lexer.h"
+#include<sstream>
+#include<vector>
+#include<string>
+#include<utility>
+#include<chrono>
+
+static inline double now_ms() {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// 和 main.cpp 中的 compile_source 一样逐行分析，行和 token 都移动而不拷贝
+static inline std::vector<Token> lex(const std::string &source) {
+    std::vector<Token> tokens;
+    std::istringstream in(source);
+    std::string line;
+    while(std::getline(in, line)) {
+        Lexer lexer(std::move(line));
+        Token token;
+        do {
+            token = lexer.next();
+            if (token.type != TOK_EOF && token.type != TOK_UNKNOWN) tokens.push_back(std::move(token));
+        } while (token.type != TOK_EOF && token.type != TOK_UNKNOWN);
+    }
+    tokens.push_back(Token(TOK_EOF, "\0"));
+    return tokens;
+}
+
+// funcs 个函数，每个 14 行，覆盖所有的语句和表达式种类，最后调用最后一个函数
+static inline std::string make_program(int funcs) {
+    std::ostringstream src;
+    for (int i = 0; i < funcs; i++) {
+        src << "func f_" << i << "(a, b) {\n";
+        src << "    let s = 0;\n";
+        src << "    let arr = [a, b, " << i << ", \"x\"];\n";
+        src << "    for (let i = 0; i < a; i = i + 1) {\n";
+        src << "        if (i * 3 == b + 1) {\n";
+        src << "            s = s + i * " << i % 7 + 1 << " - b / 2;\n";
+        src << "        } else {\n";
+        src << "            arr[b - 1] = arr[b - 2] + -s;\n";
+        src << "        }\n";
+        src << "    }\n";
+        src << "    while (s > 100) { s = s - 100; if (s == 50) { break; } }\n";
+        if (i > 0) src << "    return s + f_" << i - 1 << "(a - 1, b);\n";
+        else src << "    return s;\n";
+        src << "}\n";
+    }
+    src << "print(f_" << funcs - 1 << "(10, 3));\n";
+    return src.str();
+}
+
+#endif
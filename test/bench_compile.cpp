@@ -0,0 +1,60 @@
+/*************************************************************************
+	> File Name: bench_compile.cpp
+	> Author: Bryan Si (SeongLam)
+	> Created Time: Tue Oct 20 00:12:05 2026
+ ************************************************************************/
+
+// 编译吞吐量：在生成的大源码上只计时 Compiler::compile（AST -> 字节码），不含词法分析和语法分析
+// 编译器按 AST 节点的 kind 分派，节点种类多、表达式嵌套深的源码最能体现分派的开销
+// 编译: g++ --std=c++11 -O2 -pthread bench_compile.cpp -o bench_compile
+
+#include "../lexer.h"
+#include "../parser.h"
+#include "../compiler.h"
+#include "bench_common.h"
+#include<iostream>
+#include<iomanip>
+#include<vector>
+#include<string>
+#include<algorithm>
+
+// 编译器会修改 AST（比如内联时），每一轮都重新解析一份，只计时编译
+static double compile_once(const std::vector<Token> &tokens, int opt_level) {
+    Parser p(tokens);
+    Block *program = p.parse();
+
+    CompileOptions options;
+    options.opt_level = opt_level;
+    options.builtins.insert("print");
+    Compiler c(MainCompiler);
+    c.set_options(options);
+
+    double start = now_ms();
+    c.compile(program);
+    double elapsed = now_ms() - start;
+    return elapsed;
+}
+
+int main() {
+    const int funcs = 4000, rounds = 5;
+    std::string source = make_program(funcs);
+    size_t lines = std::count(source.begin(), source.end(), '\n');
+    std::vector<Token> tokens = lex(source);
+
+    std::cout << "program: " << lines << " lines, " << funcs << " functions, " << tokens.size() << " tokens" << std::endl;
+
+    // 编译器会为每个函数输出日志，测量时关掉标准输出
+    std::streambuf *saved = std::cout.rdbuf(NULL);
+    double best[3] = {1e30, 1e30, 1e30};
+    for (int r = 0; r < rounds; r++) {
+        for (int level = 0; level < 3; level++) best[level] = std::min(best[level], compile_once(tokens, level));
+    }
+    std::cout.rdbuf(saved);
+    std::cout.clear();
+
+    for (int level = 0; level < 3; level++) {
+        std::cout << "-O" << level << std::fixed << std::setprecision(2) << std::setw(12) << best[level] << " ms  "
+                  << std::setprecision(0) << std::setw(10) << lines / best[level] * 1000 << " lines/s" << std::endl;
+    }
+    return 0;
+}
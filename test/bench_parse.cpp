@@ -0,0 +1,98 @@
+/*************************************************************************
+	> File Name: bench_parse.cpp
+	> Author: Bryan Si (SeongLam)
+	> Created Time: Mon Oct 19 23:08:41 2026
+ ************************************************************************/
+
+// 对比完整解析和预解析（函数体只做括号配对）的耗时
+// 用生成的 10 万行函数库，主程序只调用其中很少的几个函数
+// 编译: g++ --std=c++11 -O2 -pthread bench_parse.cpp -o bench_parse
+
+#include "../lexer.h"
+#include "../parser.h"
+#include "bench_common.h"
+#include<iostream>
+#include<iomanip>
+#include<sstream>
+#include<vector>
+#include<string>
+#include<algorithm>
+#include<cstdlib>
+
+// 每个函数 10 行，funcs 个函数，最后由主程序调用其中的 called 个
+static std::string make_library(int funcs, int called) {
+    std::ostringstream src;
+    for (int i = 0; i < funcs; i++) {
+        src << "func lib_" << i << "(a, b) {\n";
+        src << "    let s = 0;\n";
+        src << "    for (let i = 0; i < a; i = i + 1) {\n";
+        src << "        if (i > b) {\n";
+        src << "            s = s + i * " << i % 7 + 1 << ";\n";
+        src << "        } else {\n";
+        src << "            s = s - \"}\" == \"{\";\n";
+        src << "        }\n";
+        src << "    }\n";
+        src << "    return s;\n";
+        src << "}\n";
+    }
+    for (int i = 0; i < called; i++) src << "print(lib_" << i * (funcs / called) << "(10, 3));\n";
+    return src.str();
+}
+
+// 解析一次并返回耗时；parse_called 时再解析主程序调用到的函数体，相当于 --lazy 运行时实际解析的部分
+// Parser 的构造函数会拷贝整个 token 序列，两种模式都一样，不计入时间
+static double parse_once(const std::vector<Token> &tokens, bool lazy, bool parse_called, size_t &bodies) {
+    Parser p(tokens, lazy);
+    double start = now_ms();
+    Block *program = p.parse();
+    bodies = 0;
+    for (size_t i = 0; i < program->statements.size(); i++) {
+        FuncStmt *fn = ast_cast<FuncStmt>(program->statements[i]);
+        if (fn && fn->body) bodies++;
+    }
+    if (parse_called) {
+        for (size_t i = 0; i < program->statements.size(); i++) {
+            FuncStmt *fn = ast_cast<FuncStmt>(program->statements[i]);
+            // 生成的主程序调用的是 lib_0, lib_k, lib_2k ...，这里直接按名字挑出来
+            if (fn && fn->body == NULL && std::atoi(fn->name.c_str() + 4) % 1000 == 0) {
+                Parser::parse_body(fn);
+                bodies++;
+            }
+        }
+    }
+    double elapsed = now_ms() - start;
+    return elapsed;
+}
+
+int main() {
+    const int funcs = 10000, called = 10, rounds = 5;
+    std::string source = make_library(funcs, called);
+    size_t lines = std::count(source.begin(), source.end(), '\n');
+
+    double start = now_ms();
+    std::vector<Token> tokens = lex(source);
+    double lex_ms = now_ms() - start;
+
+    std::cout << "library: " << lines << " lines, " << funcs << " functions, " << tokens.size() << " tokens" << std::endl;
+    std::cout << "lex: " << std::fixed << std::setprecision(2) << lex_ms << " ms" << std::endl;
+
+    // 解析时每个函数都会输出几行进度，测量时关掉标准输出
+    std::streambuf *saved = std::cout.rdbuf(NULL);
+    double best[3] = {1e30, 1e30, 1e30};
+    size_t bodies[3] = {0, 0, 0};
+    for (int r = 0; r < rounds; r++) {
+        best[0] = std::min(best[0], parse_once(tokens, false, false, bodies[0]));
+        best[1] = std::min(best[1], parse_once(tokens, true, false, bodies[1]));
+        best[2] = std::min(best[2], parse_once(tokens, true, true, bodies[2]));
+    }
+    std::cout.rdbuf(saved);
+    std::cout.clear();
+
+    const char *names[3] = {"full parse", "pre-parse", "pre-parse + called bodies"};
+    for (int i = 0; i < 3; i++) {
+        std::cout << std::left << std::setw(28) << names[i] << std::right << std::setw(10) << best[i] << " ms  "
+                  << bodies[i] << " bodies parsed" << std::endl;
+    }
+    std::cout << "speedup: " << std::setprecision(1) << best[0] / best[2] << "x" << std::endl;
+    return 0;
+}
@@ -0,0 +1,134 @@
+/*************************************************************************
+	> File Name: bench_simd.cpp
+	> Author: Bryan Si (SeongLam)
+	> Created Time: Mon Oct 19 11:02:17 2026
+ ************************************************************************/
+
+// 对比 SIMD 内置函数与解释执行的循环
+// 编译: g++ --std=c++11 -O2 bench_simd.cpp -o bench_simd
+
+#include "../lexer.h"
+#include "../parser.h"
+#include "../compiler.h"
+#include "../vm.h"
+#include<iostream>
+#include<iomanip>
+#include<sstream>
+#include<vector>
+#include<chrono>
+#include<cmath>
+#include<algorithm>
+#include<cstdlib>
+
+static double now_ms() {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static double run_source(const std::string &source) {
+    std::vector<Token> tokens;
+    std::istringstream in(source);
+    std::string line;
+    while(std::getline(in, line)) {
+        Lexer lexer(line);
+        Token token;
+        do {
+            token = lexer.next();
+            if (token.type != TOK_EOF && token.type != TOK_UNKNOWN) tokens.push_back(token);
+        } while (token.type != TOK_EOF && token.type != TOK_UNKNOWN);
+    }
+    tokens.push_back(Token(TOK_EOF, "\0"));
+
+    Parser p(tokens);
+    Block *program = p.parse();
+    Compiler c(MainCompiler);
+    c.compile(program);
+    Chunk chk = c.get_chunk();
+
+    VirtualMachine vm;
+    double start = now_ms();
+    vm.run(chk);
+    return now_ms() - start;
+}
+
+static void bench_kernels(const SimdKernels &k, const std::vector<double> &data) {
+    std::vector<double> work(data);
+    std::vector<double> other(data.size(), 1.0);
+    const int rounds = 20;
+
+    double start = now_ms();
+    double s = 0.0, d = 0.0, lo = 0.0, hi = 0.0;
+    for (int r = 0; r < rounds; r++) {
+        s += k.sum(work.data(), work.size());
+        d += k.dot(work.data(), other.data(), work.size());
+        lo += k.min(work.data(), work.size());
+        hi += k.max(work.data(), work.size());
+    }
+    double reduce_ms = (now_ms() - start) / rounds;
+
+    start = now_ms();
+    for (int r = 0; r < rounds; r++) {
+        k.scale(work.data(), work.size(), 1.0);
+        k.axpy(0.0, other.data(), work.data(), work.size());
+    }
+    double update_ms = (now_ms() - start) / rounds;
+
+    start = now_ms();
+    k.prefix_sum(work.data(), work.size());
+    double scan_ms = now_ms() - start;
+
+    std::cout << std::setw(8) << k.name
+              << std::setw(14) << reduce_ms
+              << std::setw(14) << update_ms
+              << std::setw(14) << scan_ms
+              << "   (sum=" << s / rounds << ", last prefix=" << work.back() << ")" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    size_t n = argc > 1 ? static_cast<size_t>(atol(argv[1])) : 1000000;
+
+    std::vector<double> data(n);
+    for (size_t i = 0; i < n; i++) data[i] = static_cast<double>(i % 1000) * 0.5;
+
+    std::cout << "Kernel timings for " << n << " doubles (ms), selected: " << simd_kernels().name << std::endl;
+    std::cout << std::setw(8) << "kernel" << std::setw(14) << "sum+dot+mm" << std::setw(14) << "scale+axpy" << std::setw(14) << "prefix_sum" << std::endl;
+    bench_kernels(scalar_kernels(), data);
+#ifdef MINILANG_SIMD_X86
+    const SimdKernels sse2 = { "sse2", sse2_sum, sse2_dot, sse2_min, sse2_max, sse2_scale, sse2_axpy, sse2_prefix_sum };
+    bench_kernels(sse2, data);
+    if (__builtin_cpu_supports("avx2")) {
+        const SimdKernels avx2 = { "avx2", avx2_sum, avx2_dot, avx2_min, avx2_max, avx2_scale, avx2_axpy, avx2_prefix_sum };
+        bench_kernels(avx2, data);
+    }
+#endif
+
+    // 脚本层面：解释执行的求和循环 vs sum() 内置函数，各做 10 遍，再减去构造数组的时间
+    std::ostringstream build;
+    build << "let n = " << n << ";\n"
+          << "let a = [];\n"
+          << "for (let i = 0; i < n; i = i + 1) { push(a, i); }\n"
+          << "let s = 0;\n";
+
+    std::string loop_src = build.str() +
+        "for (let r = 0; r < 10; r = r + 1) {\n"
+        "    for (let i = 0; i < n; i = i + 1) { s = s + a[i]; }\n"
+        "}\n"
+        "print(s);\n";
+    std::string builtin_src = build.str() +
+        "for (let r = 0; r < 10; r = r + 1) { s = s + sum(a); }\n"
+        "print(s);\n";
+
+    // 每个脚本跑 3 次取最快的一次，减小噪声
+    double build_ms = 1e300, loop_ms = 1e300, builtin_ms = 1e300;
+    for (int i = 0; i < 3; i++) {
+        build_ms = std::min(build_ms, run_source(build.str()));
+        loop_ms = std::min(loop_ms, run_source(loop_src));
+        builtin_ms = std::min(builtin_ms, run_source(builtin_src));
+    }
+    loop_ms = std::max(0.0, loop_ms - build_ms) / 10;
+    builtin_ms = std::max(0.0, builtin_ms - build_ms) / 10;
+
+    std::cout << std::endl;
+    std::cout << "Interpreted loop sum: " << loop_ms << " ms per pass" << std::endl;
+    std::cout << "Builtin sum():        " << builtin_ms << " ms per pass" << std::endl;
+    return 0;
+}
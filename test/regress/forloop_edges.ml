@@ -0,0 +1,92 @@
+let n = 5;
+let c = 0;
+for (let i = 0; i < n; i = i + 1) {
+    c = c + 1;
+    if (i == 1) {
+        n = 3;
+    }
+}
+print(c);
+
+let st = 1;
+c = 0;
+for (let i = 0; i < 10; i = i + st) {
+    c = c + 1;
+    st = st + 1;
+}
+print(c);
+
+c = 0;
+for (let i = 0; i < 10; i = i + 1) {
+    c = c + 1;
+    i = i + 2;
+}
+print(c);
+
+let s = 0;
+for (let i = 10; i > 0; i = i - 3) {
+    s = s + i;
+}
+print(s);
+
+s = 0;
+for (let i = 3; i >= -3; i = i + -2) {
+    s = s * 10 + i;
+}
+print(s);
+
+s = 0;
+for (let x = 0; x < 1; x = x + 0.25) {
+    s = s + x;
+}
+print(s);
+
+c = 0;
+for (let x = 0; x < 1; x = x + 0.1) {
+    c = c + 1;
+}
+print(c);
+
+c = 0;
+for (let x = 0.5; x <= 3; x = x + 1) {
+    c = c + x;
+}
+print(c);
+
+c = 0;
+for (let i = 5; i < 5; i = i + 1) {
+    c = c + 1;
+}
+print(c);
+
+let big = 9223372036854775807;
+c = 0;
+for (let i = big - 3; i < big; i = i + 1) {
+    c = c + 1;
+}
+print(c);
+
+c = 0;
+for (let i = big - 1; i < big; i = i + 5) {
+    c = c + 1;
+}
+print(c);
+
+let small = -9223372036854775807 - 1;
+c = 0;
+for (let i = small + 2; i > small; i = i - 1) {
+    c = c + 1;
+}
+print(c);
+
+c = 0;
+for (let i = 0; i < 100; i = i + 1) {
+    if (i == 7) {
+        break;
+    }
+    if (i == 2) {
+        continue;
+    }
+    c = c + i;
+}
+print(c);
@@ -0,0 +1,12 @@
+func leaf(x) {
+    let y = x * 3 + 1;
+    return y - x / 2;
+}
+func mid(x) {
+    return leaf(x) + leaf(x + 1) + leaf(x + 2) + leaf(x + 3);
+}
+let s = 0;
+for (let i = 0; i < 10; i = i + 1) {
+    s = s + mid(i);
+}
+print(s);
@@ -0,0 +1,49 @@
+let z = 0;
+let n = 0;
+let r = 0;
+while (n > 0) {
+    r = r + 10 / z;
+    n = n - 1;
+}
+print(r);
+
+let arr = [1, 2, 3];
+let acc = 0;
+for (let i = 0; i < 3; i = i + 1) {
+    acc = acc + arr[0];
+    arr[0] = arr[0] + 1;
+}
+print(acc);
+
+let base = 7;
+let w = 0;
+for (let i = 0; i < 4; i = i + 1) {
+    w = base * 3;
+    if (i == 2) {
+        base = 1;
+    }
+}
+print(w);
+
+let c = 5;
+let d = 6;
+let total = 0;
+for (let i = 0; i < 10; i = i + 1) {
+    let e = c * d + 1;
+    let f = [e, c];
+    if (i == 9) {
+        print(f[0] - f[1]);
+    }
+    total = total + e;
+}
+print(total);
+
+let g = 0;
+let h = 0;
+for (let i = 0; i < 4; i = i + 1) {
+    if (i > 1) {
+        g = c + d;
+    }
+    h = h + g;
+}
+print(h);
@@ -0,0 +1,10 @@
+func lookup(m, k) {
+    if (has(m, k)) {
+        return get(m, k, 0) * 10;
+    }
+    return get(m, k, 0 - 1);
+}
+let m = map();
+m["a"] = 3;
+print(lookup(m, "a"));
+print(lookup(m, "b"));
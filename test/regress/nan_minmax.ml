@@ -0,0 +1,21 @@
+let inf = 1.5;
+for (let i = 0; i < 12; i = i + 1) {
+    inf = inf * inf;
+}
+let q = inf - inf;
+let a = [q, 1, 2, 3, 4, 5, 6, 7, 8, 9];
+for (let p = 0; p < 10; p = p + 1) {
+    let t = a[0];
+    a[0] = a[p];
+    a[p] = t;
+    let lo = min(a);
+    let hi = max(a);
+    print(lo == lo);
+    print(hi == hi);
+    a[p] = a[0];
+    a[0] = t;
+}
+a[0] = 0;
+print(min(a));
+print(max(a));
+print(max([inf, q, 1]) == max([inf, q, 1]));
@@ -0,0 +1,39 @@
+func poly(x) {
+    return x * x + 2 * x + 1;
+}
+print(poly(3));
+print(poly(1.5));
+print(poly(0 - 4));
+
+let s = 0;
+for (let i = 0; i < 10; i = i + 1) {
+    s = s + i * 2 - i / 2;
+}
+print(s);
+
+let big = 9223372036854775807;
+let t = big - 1;
+t = t + 1;
+print(t);
+t = t + 1;
+print(t);
+print(big * 2);
+print(-big - 1);
+
+let m = 7;
+let q = m / 2;
+print(q);
+print(m - 0.5);
+
+let v = 1;
+for (let i = 0; i < 3; i = i + 1) {
+    v = v * 10;
+    if (i == 1) {
+        v = v + 0.5;
+    }
+}
+print(v);
+
+let neg = 0 - 5;
+print(neg * neg);
+print(-neg);
@@ -0,0 +1,14 @@
+let a = [9007199254740993, 0];
+print(sum(a));
+print(a[0]);
+print(dot(a, [1, 2]));
+print(min(a));
+print(max(a));
+let b = [9007199254740993, 2, 3];
+let c = [1, 1, 1];
+axpy(2, b, c);
+print(c[1]);
+prefix_sum(b);
+print(b[2]);
+scale(b, 2);
+print(b[1]);
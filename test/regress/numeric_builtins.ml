@@ -0,0 +1,7 @@
+func largest(xs) {
+    return max(xs) + min(xs) * 0;
+}
+let xs = [3, 9, 4];
+print(largest(xs));
+print(sum(xs));
+print(dot(xs, xs));
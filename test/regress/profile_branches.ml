@@ -0,0 +1,15 @@
+let s = 0;
+for (let i = 0; i < 50; i = i + 1) {
+    s = s + i;
+}
+let n = 0;
+while (n < 40) {
+    if (n < 30) {
+        s = s + 1;
+    } else {
+        s = s - 1;
+    }
+    n = n + 1;
+}
+print(s);
+print(n);
@@ -0,0 +1,113 @@
+#!/bin/sh
+# 回归测试：每个 foo.ml 旁边放期望的结果
+#   foo.out：期望 "Result:" 之后的输出
+#   foo.err：期望编译失败，标准错误输出和它一致
+# 太大的脚本不放进仓库，用 foo.gen 生成：它是一个输出 foo.ml 内容的 shell 脚本
+# 每个用例都限制 1GB 的地址空间，编译器的内存占用失控时用例会失败
+# 用法（在仓库根目录）：sh test/regress/run.sh [minilang 可执行文件]
+
+dir=$(dirname "$0")
+bin=${1:-./minilang}
+if [ ! -x "$bin" ]; then
+    g++ --std=c++11 -pthread main.cpp -o "$bin" || exit 1
+fi
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+failed=0
+
+# check <源文件> <期望结果的前缀>
+# 每个优化级别和 --lazy 各运行一次，再用 -j4 并行编译函数体运行一次
+# 最后用一个空的缓存目录先后运行两次：cold 编译并写入缓存，warm 必须从缓存加载
+check() {
+    src=$1
+    name=$2
+    rm -rf "$tmp/cc" && mkdir "$tmp/cc"
+    for opt in -O0 -O1 -O2 --lazy -j4 cold warm; do
+        args=$opt
+        case $opt in cold|warm) args="--cache-dir $tmp/cc" ;; esac
+        if [ -f "$name.err" ]; then
+            err=$(ulimit -v 1048576; "$bin" $args "$src" 2>&1 >/dev/null </dev/null)
+            if [ $? -eq 0 ] || [ "$err" != "$(cat "$name.err")" ]; then
+                echo "FAIL $src $opt: $err"
+                failed=1
+            fi
+        else
+            all=$(ulimit -v 1048576; "$bin" $args "$src" 2>&1 </dev/null)
+            out=$(printf '%s\n' "$all" | sed '1,/^Result: $/d')
+            if [ "$out" != "$(cat "$name.out")" ]; then
+                echo "FAIL $src $opt"
+                failed=1
+            elif [ $opt = warm ] && ! printf '%s\n' "$all" | grep -q '^Loading bytecode cache'; then
+                echo "FAIL $src warm: the cache written by the cold run was not loaded"
+                failed=1
+            fi
+        fi
+    done
+}
+
+for src in "$dir"/*.ml; do
+    check "$src" "${src%.ml}"
+done
+
+for gen in "$dir"/*.gen; do
+    [ -f "$gen" ] || continue
+    name=${gen%.gen}
+    src="$tmp/$(basename "$name").ml"
+    sh "$gen" > "$src"
+    check "$src" "$name"
+done
+
+# profile：各个优化级别下的分支编号必须一致，其他优化级别生成的 profile 会被拒绝
+prof=$dir/profile_branches.ml
+for level in 0 1 2; do
+    "$bin" -O$level --profile-gen "$tmp/O$level.prof" "$prof" >/dev/null 2>&1 </dev/null
+    grep '^branch' "$tmp/O$level.prof" | cut -d' ' -f2 > "$tmp/O$level.ids"
+    if [ ! -s "$tmp/O$level.ids" ] || ! cmp -s "$tmp/O0.ids" "$tmp/O$level.ids"; then
+        echo "FAIL $prof: branch ids at -O$level differ from -O0"
+        failed=1
+    fi
+    out=$("$bin" -O$level --profile-use "$tmp/O$level.prof" "$prof" 2>&1 </dev/null | sed '1,/^Result: $/d')
+    if [ "$out" != "$(cat "${prof%.ml}.out")" ]; then
+        echo "FAIL $prof --profile-use at -O$level"
+        failed=1
+    fi
+done
+err=$("$bin" -O1 --profile-use "$tmp/O0.prof" "$prof" 2>&1 >/dev/null </dev/null)
+if [ "$err" != "Profile $tmp/O0.prof was generated at -O0, but this run uses -O1" ]; then
+    echo "FAIL $prof: -O1 accepted a profile generated at -O0"
+    failed=1
+fi
+
+# 内联：mid 内联了 leaf 之后超过了非热函数的大小限制，不能再被内联到主程序中
+inl=$dir/inline_growth.ml
+if "$bin" -O1 --report "$inl" 2>&1 </dev/null | grep -q '^\[inline\] <main>'; then
+    echo "FAIL $inl: a callee grown past the size limit was inlined"
+    failed=1
+fi
+
+# 损坏的缓存文件：必须当作缓存失效重新编译，不能崩溃
+# check_cache <说明>：用 cache/ 中现有的 .mlc 运行，输出必须和 numeric_builtins.out 一致
+cached=$dir/numeric_builtins.ml
+check_cache() {
+    out=$(ulimit -v 1048576; "$bin" --cache-dir "$tmp/cache" "$cached" 2>&1 </dev/null | sed '1,/^Result: $/d')
+    if [ "$out" != "$(cat "${cached%.ml}.out")" ]; then
+        echo "FAIL $cached --cache-dir: $1"
+        failed=1
+    fi
+}
+mkdir "$tmp/cache"
+check_cache "cold run"
+mlc=$(ls "$tmp/cache"/*.mlc)
+# 文件头的第 24 个字节开始是主程序 ImageChunk 的偏移，ImageChunk 的第一项就是 reg_count
+main_chunk=$(od -An -t u8 -j 24 -N 8 "$mlc" | tr -d ' ')
+printf '\000\000\000\100' | dd of="$mlc" bs=1 seek="$main_chunk" conv=notrunc 2>/dev/null
+check_cache "reg_count of the main chunk set to 0x40000000"
+check_cache "cache rewritten after the corrupted run"
+size=$(wc -c < "$mlc")
+head -c $((size / 2)) "$mlc" > "$tmp/half" && cp "$tmp/half" "$mlc"
+check_cache "truncated cache file"
+
+[ $failed -eq 0 ] && echo "all regression tests passed"
+exit $failed
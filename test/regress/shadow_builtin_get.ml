@@ -0,0 +1,4 @@
+func get(x) {
+    return x + 1;
+}
+print(get(1));
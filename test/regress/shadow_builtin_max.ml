@@ -0,0 +1,7 @@
+func max(a, b) {
+    if (a > b) {
+        return a;
+    }
+    return b;
+}
+print(max(3, 4));
@@ -0,0 +1,43 @@
+let a = 3;
+let b = 4;
+let x = 0;
+if (a > 2) {
+    x = a * b;
+} else {
+    x = a + b;
+}
+let y = a + b;
+print(x + y);
+
+let p = 2;
+let q = 5;
+let u = p + q;
+if (u > 6) {
+    p = 10;
+}
+let v = p + q;
+print(u);
+print(v);
+
+let i = 0;
+let t = 0;
+while (i < 5) {
+    t = t + a * b;
+    a = a + 1;
+    t = t + a * b;
+    i = i + 1;
+}
+print(t);
+print(a * b);
+
+let s = 0;
+let k = 1;
+for (let n = 0; n < 3; n = n + 1) {
+    let m = k * 2;
+    for (let j = 0; j < 2; j = j + 1) {
+        s = s + k * 2;
+        k = k + 1;
+    }
+    s = s + k * 2 + m;
+}
+print(s);
@@ -16,6 +16,7 @@
 
 std::string opcode_to_string(Opcode op) {
     if (op == OP_CONSTANT) return std::string("OP_CONSTANT");
+    if (op == OP_LOAD_INT) return std::string("OP_LOAD_INT");
     if (op == OP_GET_LOCAL) return std::string("OP_GET_LOCAL");
     if (op == OP_SET_LOCAL) return std::string("OP_SET_LOCAL");
     if (op == OP_REGISTER_LOCAL) return std::string("OP_REGISTER_LOCAL");
@@ -24,6 +25,7 @@ std::string opcode_to_string(Opcode op) {
     if (op == OP_MUL) return std::string("OP_MUL");
     if (op == OP_DIV) return std::string("OP_DIV");
     if (op == OP_EQUAL) return std::string("OP_EQUAL");
+    if (op == OP_NOT_EQUAL) return std::string("OP_NOT_EQUAL");
     if (op == OP_GREATER) return std::string("OP_GREATER");
     if (op == OP_LESS) return std::string("OP_LESS");
     if (op == OP_NOT) return std::string("OP_NOT");
@@ -31,9 +33,23 @@ std::string opcode_to_string(Opcode op) {
     if (op == OP_LESS_EQUAL) return std::string("OP_LESS_EQUAL");
     if (op == OP_JUMP) return std::string("OP_JUMP");
     if (op == OP_JUMP_IF_FALSE) return std::string("OP_JUMP_IF_FALSE");
+    if (op == OP_JUMP_IF_TRUE) return std::string("OP_JUMP_IF_TRUE");
     if (op == OP_CALL) return std::string("OP_CALL");
     if (op == OP_DECL_FUNC) return std::string("OP_DECL_FUNC");
     if (op == OP_RETURN_VAL) return std::string("OP_RETURN_VAL");
+    if (op == OP_NEW_ARRAY) return std::string("OP_NEW_ARRAY");
+    if (op == OP_GET_INDEX) return std::string("OP_GET_INDEX");
+    if (op == OP_SET_INDEX) return std::string("OP_SET_INDEX");
+    if (op == OP_FORLOOP) return std::string("OP_FORLOOP");
+    if (op == OP_ADD_NUM) return std::string("OP_ADD_NUM");
+    if (op == OP_SUB_NUM) return std::string("OP_SUB_NUM");
+    if (op == OP_MUL_NUM) return std::string("OP_MUL_NUM");
+    if (op == OP_DIV_NUM) return std::string("OP_DIV_NUM");
+    if (op == OP_GREATER_NUM) return std::string("OP_GREATER_NUM");
+    if (op == OP_LESS_NUM) return std::string("OP_LESS_NUM");
+    if (op == OP_GREATER_EQUAL_NUM) return std::string("OP_GREATER_EQUAL_NUM");
+    if (op == OP_LESS_EQUAL_NUM) return std::string("OP_LESS_EQUAL_NUM");
+    if (op == OP_WIDE) return std::string("OP_WIDE");
     if (op == OP_HALT) return std::string("OP_HALT");
     return std::string("OP_UNKNOWN");
 }
@@ -46,6 +46,8 @@ int main(int argc, char** argv) {
             case TOK_IF:         std::cout << "IF"; break;
             case TOK_LBRACE:     std::cout << "LBRACE"; break;
             case TOK_RBRACE:     std::cout << "RBRACE"; break;
+            case TOK_LBRACKET:   std::cout << "LBRACKET"; break;
+            case TOK_RBRACKET:   std::cout << "RBRACKET"; break;
             case TOK_INPUT:      std::cout << "INPUT"; break;
             case TOK_LESSEQUAL:  std::cout << "LESSQUEAL"; break;
             default:             std::cout << "UNKNOWN"; break;
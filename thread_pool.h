@@ -0,0 +1,87 @@
+/*************************************************************************
+	> File Name: thread_pool.h
+	> Author: Bryan Si (SeongLam)
+	> Created Time: Mon Oct 19 13:20:51 2026
+ ************************************************************************/
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include<vector>
+#include<queue>
+#include<thread>
+#include<mutex>
+#include<condition_variable>
+#include<functional>
+
+// 固定大小的线程池，只提供 "提交一批任务并等待全部完成" 这一种用法
+class ThreadPool {
+    std::vector<std::thread> __workers__;
+    std::queue<std::function<void()>> __tasks__;
+    std::mutex __mutex__;
+    std::condition_variable __task_cv__;  // 有新任务或者需要退出
+    std::condition_variable __done_cv__;  // 一批任务全部完成
+    size_t __pending__;
+    bool __stop__;
+
+    void worker_loop() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(__mutex__);
+                __task_cv__.wait(lock, [this] { return __stop__ || !__tasks__.empty(); });
+                if (__stop__ && __tasks__.empty()) return;
+                task = std::move(__tasks__.front());
+                __tasks__.pop();
+            }
+
+            task();
+
+            std::lock_guard<std::mutex> lock(__mutex__);
+            if (--__pending__ == 0) __done_cv__.notify_all();
+        }
+    }
+
+public:
+    explicit ThreadPool(size_t threads) : __pending__(0), __stop__(false) {
+        if (threads == 0) threads = 1;
+        for (size_t i = 0; i < threads; i++) {
+            __workers__.push_back(std::thread(&ThreadPool::worker_loop, this));
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(__mutex__);
+            __stop__ = true;
+        }
+        __task_cv__.notify_all();
+        for (size_t i = 0; i < __workers__.size(); i++) __workers__[i].join();
+    }
+
+    size_t size() const {
+        return __workers__.size();
+    }
+
+    // 提交一批任务，阻塞到这批任务全部执行完毕
+    // 任务之间不能再向同一个线程池提交任务，否则会死锁
+    void run_batch(std::vector<std::function<void()>> &tasks) {
+        if (tasks.empty()) return;
+        {
+            std::lock_guard<std::mutex> lock(__mutex__);
+            for (size_t i = 0; i < tasks.size(); i++) __tasks__.push(std::move(tasks[i]));
+            __pending__ += tasks.size();
+        }
+        __task_cv__.notify_all();
+
+        std::unique_lock<std::mutex> lock(__mutex__);
+        __done_cv__.wait(lock, [this] { return __pending__ == 0; });
+    }
+
+    static size_t default_size() {
+        unsigned int n = std::thread::hardware_concurrency();
+        return n == 0 ? 1 : n;
+    }
+};
+
+#endif
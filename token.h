@@ -30,6 +30,8 @@ enum TokenType {
     TOK_WHILE,
     TOK_LBRACE,
     TOK_RBRACE,
+    TOK_LBRACKET,
+    TOK_RBRACKET,
     TOK_STRING,
     TOK_TRUE,
     TOK_FALSE,
@@ -54,13 +56,6 @@ struct Token {
 
     Token() : type(TOK_UNKNOWN), lexeme("\0") {}
     Token(TokenType t, const std::string &lex) : type(t), lexeme(lex) {}
-
-    Token& operator=(const Token& t) {
-        if (&t == this) return *this;
-        type = t.type;
-        lexeme = t.lexeme;
-        return *this;
-    }
 };
 
 #endif
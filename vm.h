@@ -8,76 +8,405 @@
 #define VM_H
 
 #include "compiler.h"
+#include "simd.h"
+#include "thread_pool.h"
+#include "number.h"
+#include "profile.h"
+#include "image.h"
 #include<vector>
 #include<stack>
 #include<string>
 #include<unordered_map>
+#include<list>
 #include<iostream>
+#include<cstring>
+#include<climits>
+#include<cerrno>
 
 enum ValueType {
     VAL_NUMBER,
+    VAL_INT,    // 64 位整数，整数字面量和计数器走整数运算，溢出或者和 double 混合运算时提升为 double
     VAL_STRING,
+    VAL_ARRAY,
+    VAL_MAP,
 };
 
+class ArrayObject;
+class MapObject;
+
 class Value {
 public:
     ValueType __type__;
     union {
         double number;
+        long long integer;
         std::string str;
+        ArrayObject *array; // 数组是引用语义，寄存器之间拷贝只会增加引用计数
+        MapObject *map;     // Map 同理
     };
 
     Value() : __type__(VAL_NUMBER), number(0.0) {}
 
     explicit Value(double n) : __type__(VAL_NUMBER), number(n) {}
+    explicit Value(long long i) : __type__(VAL_INT), integer(i) {}
     explicit Value(const std::string &s) : __type__(VAL_STRING), str(s) {}
+    explicit Value(ArrayObject *arr);
+    explicit Value(MapObject *m);
 
-    Value(const Value &other) : __type__(other.__type__) {
-        if (other.__type__ == VAL_NUMBER) {
-            number = other.number;
-        } else if (other.__type__ == VAL_STRING) {
-            new (&str) std::string(other.str);
-        }
+    Value(const Value &other) : __type__(VAL_NUMBER), number(0.0) {
+        copy_from(other);
     }
 
     Value& operator=(const Value &right) {
         if(&right == this) return *this;
 
-        __type__ = right.__type__;
+        release();
+        copy_from(right);
+
+        return *this;
+    }
+
+    ~Value() {
+        release();
+    }
 
-        if (right.__type__ == VAL_NUMBER) {
-            number = right.number;
-        } else if (right.__type__ == VAL_STRING) {
-            new (&str) std::string(right.str);
+    // 把字符串写进这个值；原来就是字符串时直接复用它的缓冲区，加载字符串常量时通常不用分配内存
+    void set_string(const char *s, size_t n) {
+        if (__type__ != VAL_STRING) {
+            release();
+            new (&str) std::string(s, n);
+            __type__ = VAL_STRING;
         } else {
-            std::cerr << "Unknown value type!" << std::endl;
-            exit(1);
+            str.assign(s, n);
         }
+    }
 
-        return *this;
+    bool is_numeric() const {
+        return __type__ == VAL_NUMBER || __type__ == VAL_INT;
     }
 
-    ~Value() {
+    double as_double() const {
+        return __type__ == VAL_INT ? static_cast<double>(integer) : number;
+    }
+
+    // 能否精确地作为整数使用（数组下标、map 的 key 等）
+    bool as_integer(long long &out) const {
+        if (__type__ == VAL_INT) {
+            out = integer;
+            return true;
+        }
+        if (__type__ == VAL_NUMBER && number >= -9223372036854775808.0 && number < 9223372036854775808.0 &&
+            number == static_cast<double>(static_cast<long long>(number))) {
+            out = static_cast<long long>(number);
+            return true;
+        }
+        return false;
+    }
+
+private:
+    void copy_from(const Value &other);
+    void release();
+};
+
+// 数组对象：全部元素都是数字的时候使用紧凑的 double 数组存储，
+// 一旦放入了非数字的元素就退化为通用的 Value 存储
+class ArrayObject {
+public:
+    int __ref__;
+    bool __packed__;
+    std::vector<double> __num__;
+    std::vector<Value> __val__;
+
+    ArrayObject() : __ref__(0), __packed__(true) {}
+
+    size_t size() const {
+        return __packed__ ? __num__.size() : __val__.size();
+    }
+
+    Value get(size_t i) const {
+        if (__packed__) return Value(__num__[i]);
+        return __val__[i];
+    }
+
+    // 整数放进紧凑存储时会转成 double，超出 double 精确范围的整数只能使用通用存储
+    static bool packable(const Value &v) {
+        return v.__type__ == VAL_NUMBER || (v.__type__ == VAL_INT && int_fits_double(v.integer));
+    }
+
+    void set(size_t i, const Value &v) {
+        if (__packed__ && !packable(v)) unpack();
+
+        if (__packed__) __num__[i] = v.as_double();
+        else __val__[i] = v;
+    }
+
+    void push(const Value &v) {
+        if (__packed__ && !packable(v)) unpack();
+
+        if (__packed__) __num__.push_back(v.as_double());
+        else __val__.push_back(v);
+    }
+
+    // 通用存储中如果全部都是数字，可以重新压缩回紧凑存储
+    bool try_pack() {
+        if (__packed__) return true;
+        for (size_t i = 0; i < __val__.size(); i++) {
+            if (!packable(__val__[i])) return false;
+        }
+        __num__.resize(__val__.size());
+        for (size_t i = 0; i < __val__.size(); i++) __num__[i] = __val__[i].as_double();
+        __val__.clear();
+        __packed__ = true;
+        return true;
+    }
+
+    bool all_numeric() const {
+        if (__packed__) return true;
+        for (size_t i = 0; i < __val__.size(); i++) {
+            if (!__val__[i].is_numeric()) return false;
+        }
+        return true;
+    }
+
+    // 全部是数字的通用存储强制转换成紧凑存储，超出 double 精确范围的整数会被舍入
+    // 只给原地修改数组的数值内置函数使用，它们的结果本来就是 double；调用前要先检查 all_numeric
+    void pack_rounded() {
+        if (__packed__) return;
+        __num__.resize(__val__.size());
+        for (size_t i = 0; i < __val__.size(); i++) __num__[i] = __val__[i].as_double();
+        __val__.clear();
+        __packed__ = true;
+    }
+
+    void unpack() {
+        if (!__packed__) return;
+        __val__.reserve(__num__.size());
+        for (size_t i = 0; i < __num__.size(); i++) __val__.push_back(Value(__num__[i]));
+        __num__.clear();
+        __num__.shrink_to_fit();
+        __packed__ = false;
     }
 };
 
+// 开放寻址（Robin Hood）哈希表：所有槽位放在一段连续内存中，
+// 查找时先比较缓存的 hash 再比较 key，删除使用 backward shift 不需要墓碑
+class MapObject {
+public:
+    struct Slot {
+        unsigned int __dist__; // 0 表示空槽，否则为 探测距离 + 1
+        unsigned long long __hash__;
+        Value key, value;
+
+        Slot() : __dist__(0), __hash__(0) {}
+    };
+
+    int __ref__;
+    size_t __size__;
+    std::vector<Slot> __slots__; // 容量始终为 2 的幂
+
+    MapObject() : __ref__(0), __size__(0) {}
+
+    static bool is_valid_key(const Value &k) {
+        if (k.__type__ == VAL_NUMBER) return k.number == k.number; // NaN 不能作为 key
+        return k.__type__ == VAL_INT || k.__type__ == VAL_STRING;
+    }
+
+    static unsigned long long hash_key(const Value &k) {
+        unsigned long long h;
+        if (k.is_numeric()) {
+            // 数字走快速路径：直接对 double 的二进制位做一次混合，+0.0 与 -0.0 视为同一个 key
+            // 整数也按 double 计算 hash，这样 1 和 1.0 会落在同一个位置
+            double d = k.as_double();
+            if (d == 0.0) d = 0.0;
+            std::memcpy(&h, &d, sizeof(h));
+            h ^= h >> 33;
+            h *= 0xff51afd7ed558ccdULL;
+            h ^= h >> 33;
+            h *= 0xc4ceb9fe1a85ec53ULL;
+            h ^= h >> 33;
+        } else {
+            // 字符串使用 FNV-1a
+            h = 14695981039346656037ULL;
+            for (size_t i = 0; i < k.str.size(); i++) {
+                h ^= static_cast<unsigned char>(k.str[i]);
+                h *= 1099511628211ULL;
+            }
+        }
+        return h;
+    }
+
+    static bool key_equal(const Value &a, const Value &b) {
+        if (a.is_numeric() && b.is_numeric()) {
+            if (a.__type__ == VAL_INT && b.__type__ == VAL_INT) return a.integer == b.integer;
+            long long i;
+            const Value &d = (a.__type__ == VAL_NUMBER) ? a : b;
+            const Value &o = (a.__type__ == VAL_NUMBER) ? b : a;
+            if (o.__type__ == VAL_NUMBER) return a.number == b.number;
+            return d.as_integer(i) && i == o.integer;
+        }
+        if (a.__type__ != b.__type__) return false;
+        return a.str == b.str;
+    }
+
+    long find(const Value &k) const {
+        if (__slots__.empty()) return -1;
+        size_t mask = __slots__.size() - 1;
+        unsigned long long h = hash_key(k);
+        size_t pos = static_cast<size_t>(h) & mask;
+        unsigned int dist = 1;
+
+        while (true) {
+            const Slot &slot = __slots__[pos];
+            // Robin Hood 的不变量保证：遇到空槽或者比我们更 "富" 的槽位就可以停止了
+            if (slot.__dist__ < dist) return -1;
+            if (slot.__hash__ == h && key_equal(slot.key, k)) return static_cast<long>(pos);
+            pos = (pos + 1) & mask;
+            dist++;
+        }
+    }
+
+    void set(const Value &k, const Value &v) {
+        long pos = find(k);
+        if (pos >= 0) {
+            __slots__[pos].value = v;
+            return;
+        }
+
+        if ((__size__ + 1) * 8 > __slots__.size() * 7) grow();
+        insert_slot(hash_key(k), k, v);
+        __size__++;
+    }
+
+    bool erase(const Value &k) {
+        long found = find(k);
+        if (found < 0) return false;
+
+        size_t mask = __slots__.size() - 1;
+        size_t pos = static_cast<size_t>(found);
+        size_t next = (pos + 1) & mask;
+        while (__slots__[next].__dist__ > 1) {
+            __slots__[pos] = __slots__[next];
+            __slots__[pos].__dist__--;
+            pos = next;
+            next = (next + 1) & mask;
+        }
+        __slots__[pos].__dist__ = 0;
+        __slots__[pos].key = Value();
+        __slots__[pos].value = Value();
+        __size__--;
+        return true;
+    }
+
+    // 迭代：返回 cursor 之后第一个被占用的槽位下标，没有的话返回 -1，整个过程不需要分配内存
+    long next(long cursor) const {
+        for (size_t i = static_cast<size_t>(cursor + 1); i < __slots__.size(); i++) {
+            if (__slots__[i].__dist__ != 0) return static_cast<long>(i);
+        }
+        return -1;
+    }
+
+private:
+    void insert_slot(unsigned long long h, Value k, Value v) {
+        size_t mask = __slots__.size() - 1;
+        size_t pos = static_cast<size_t>(h) & mask;
+        unsigned int dist = 1;
+
+        while (true) {
+            Slot &slot = __slots__[pos];
+            if (slot.__dist__ == 0) {
+                slot.__dist__ = dist;
+                slot.__hash__ = h;
+                slot.key = k;
+                slot.value = v;
+                return;
+            }
+
+            // 抢占探测距离更短的槽位，把原来的元素继续往后放
+            if (slot.__dist__ < dist) {
+                std::swap(slot.__dist__, dist);
+                std::swap(slot.__hash__, h);
+                Value tmp_k = slot.key; slot.key = k; k = tmp_k;
+                Value tmp_v = slot.value; slot.value = v; v = tmp_v;
+            }
+            pos = (pos + 1) & mask;
+            dist++;
+        }
+    }
+
+    void grow() {
+        std::vector<Slot> old;
+        old.swap(__slots__);
+        __slots__.resize(old.empty() ? 8 : old.size() * 2);
+        for (size_t i = 0; i < old.size(); i++) {
+            if (old[i].__dist__ != 0) insert_slot(old[i].__hash__, old[i].key, old[i].value);
+        }
+    }
+};
+
+inline Value::Value(MapObject *m) : __type__(VAL_MAP), map(m) {
+    map->__ref__++;
+}
+
+inline Value::Value(ArrayObject *arr) : __type__(VAL_ARRAY), array(arr) {
+    array->__ref__++;
+}
+
+inline void Value::copy_from(const Value &other) {
+    __type__ = other.__type__;
+    if (other.__type__ == VAL_NUMBER) {
+        number = other.number;
+    } else if (other.__type__ == VAL_INT) {
+        integer = other.integer;
+    } else if (other.__type__ == VAL_STRING) {
+        new (&str) std::string(other.str);
+    } else if (other.__type__ == VAL_ARRAY) {
+        array = other.array;
+        array->__ref__++;
+    } else if (other.__type__ == VAL_MAP) {
+        map = other.map;
+        map->__ref__++;
+    } else {
+        std::cerr << "Unknown value type!" << std::endl;
+        exit(1);
+    }
+}
+
+inline void Value::release() {
+    if (__type__ == VAL_STRING) {
+        str.~basic_string();
+    } else if (__type__ == VAL_ARRAY) {
+        if (--array->__ref__ == 0) delete array;
+    } else if (__type__ == VAL_MAP) {
+        if (--map->__ref__ == 0) delete map;
+    }
+    __type__ = VAL_NUMBER;
+    number = 0.0;
+}
+
 class VirtualMachine;
 
 typedef void (*BuiltinFn)(VirtualMachine *vm, int argc, int* arg_regs, int result_reg);
 
+// VM 中的用户函数：字节码可能来自编译器，也可能直接指向 mmap 进来的字节码镜像
+struct FuncInfo {
+    std::string name;
+    size_t param_count;
+    ChunkView chunk;
+};
+
 // 函数调用帧
 class CallFrame { 
 public:
-    const Func *fn; 
+    const FuncInfo *fn; 
     size_t return_pc;
-    const Chunk *caller_chunk;
+    const ChunkView *caller_chunk;
     std::vector<Value> register_file;
     int return_reg;
 
     CallFrame() : fn(nullptr), return_pc(0), caller_chunk(nullptr), return_reg(0) {}
 
-    CallFrame(const Func *fn, size_t return_pc, const Chunk *chunk) : fn(fn), return_pc(return_pc), caller_chunk(chunk), return_reg(0) {}
-    CallFrame(const Func *fn, size_t return_pc, const Chunk *chunk, int return_reg) : fn(fn), return_pc(return_pc), caller_chunk(chunk), return_reg(return_reg) {}
+    CallFrame(const FuncInfo *fn, size_t return_pc, const ChunkView *chunk) : fn(fn), return_pc(return_pc), caller_chunk(chunk), return_reg(0) {}
+    CallFrame(const FuncInfo *fn, size_t return_pc, const ChunkView *chunk, int return_reg) : fn(fn), return_pc(return_pc), caller_chunk(chunk), return_reg(return_reg) {}
 };
 
 // 虚拟机
@@ -85,28 +414,98 @@ class VirtualMachine {
 
     static const int MAX_CALL_DEPTH = 64;
 
-    std::unordered_map<std::string, BuiltinFn> __builtin_func__;
-    std::unordered_map<std::string, Func> __user_func__;
+    // pmap / preduce 中每个分片的元素个数，分片方式只和数组长度有关，和线程数无关
+    static const size_t PARALLEL_GRAIN = 1024;
 
+    std::unordered_map<std::string, BuiltinFn> __builtin_func__;
+    std::list<Func> __defined_func__;   // define_function 进来的函数，FuncInfo 中的 ChunkView 指向这里
+    std::unordered_map<std::string, FuncInfo> __user_func__;
+    const VirtualMachine *__parent__;   // 子解释器先在父 VM 的函数表中查找，共享同一份字节码
+    const BytecodeImage *__image__;     // 挂上字节码镜像时，函数在第一次调用时才从镜像中查找
+    const Compiler *__lazy__;           // --lazy：函数在第一次调用时才编译
+    ChunkView __main_chunk__;
 
     std::stack<CallFrame *> __frame__;
 
     std::vector<Value> __current_reg__;
-    const Chunk* __current_chunk__;
+    const ChunkView* __current_chunk__;
     size_t __tmp_counter__; // 这里的 __tmp_counter__ 是用于计算当下运行过的 opcode 下标
 
+    size_t __stop_depth__;  // invoke 调用的函数返回时调用栈的深度，0 表示一直执行到程序结束
+    Value __return_value__;
+
+    bool __is_child__;
+    ThreadPool *__pool__;
+
+    Profile *__profile__;   // --profile-gen 时记录分支和调用次数；子解释器不记录，pmap / preduce 中执行的代码不在 profile 中
+
+    static void write_value(std::ostream &os, const Value &v) {
+        if (v.__type__ == VAL_STRING) {
+            os << v.str;
+        } else if (v.__type__ == VAL_NUMBER) {
+            os << v.number;
+        } else if (v.__type__ == VAL_INT) {
+            os << v.integer;
+        } else if (v.__type__ == VAL_ARRAY) {
+            os << "[";
+            for (size_t i = 0; i < v.array->size(); i++) {
+                if (i > 0) os << ", ";
+                write_value(os, v.array->get(i));
+            }
+            os << "]";
+        } else if (v.__type__ == VAL_MAP) {
+            os << "{";
+            bool first = true;
+            for (long i = v.map->next(-1); i >= 0; i = v.map->next(i)) {
+                if (!first) os << ", ";
+                first = false;
+                write_value(os, v.map->__slots__[i].key);
+                os << ": ";
+                write_value(os, v.map->__slots__[i].value);
+            }
+            os << "}";
+        }
+    }
+
+    static void check_map_key(const Value &key, const char *where) {
+        if (!MapObject::is_valid_key(key)) {
+            std::cerr << "Runtime Error: map key must be a number or a string in " << where << std::endl;
+            exit(1);
+        }
+    }
+
+    // map_next / map_key / map_value 中使用的 cursor 必须指向一个有效的槽位
+    static long map_cursor(const MapObject *m, const Value &cursor, const char *where) {
+        long long i;
+        if (cursor.as_integer(i)) {
+            if (i >= 0 && static_cast<size_t>(i) < m->__slots__.size() && m->__slots__[i].__dist__ != 0) return i;
+        }
+        std::cerr << "Runtime Error: invalid map cursor in " << where << std::endl;
+        exit(1);
+    }
+
+    // 检查下标是否为合法的整数并且没有越界
+    static size_t array_index(const ArrayObject *arr, const Value &idx, const char *where) {
+        long long i;
+        if (!idx.as_integer(i)) {
+            std::cerr << "Runtime Error: array index must be an integer in " << where << std::endl;
+            exit(1);
+        }
+
+        if (i < 0 || static_cast<size_t>(i) >= arr->size()) {
+            std::cerr << "Runtime Error: array index " << i << " out of range [0, " << arr->size() << ") in " << where << std::endl;
+            exit(1);
+        }
+        return static_cast<size_t>(i);
+    }
+
     static void builtin_print(VirtualMachine *vm, int argc, int* arg_regs, int result_reg) {
         if (argc > 0) {
-            Value &v = vm->__current_reg__[arg_regs[0]];
-            if (v.__type__ == VAL_STRING) {
-                std::cout<< v.str;
-            } else if (v.__type__ == VAL_NUMBER) {
-                std::cout << v.number;
-            }
+            write_value(std::cout, vm->__current_reg__[arg_regs[0]]);
         }
 
         std::cout<<std::endl;
-        vm->__current_reg__[result_reg] = Value(0.0);
+        vm->__current_reg__[result_reg] = Value(0LL);
     }
 
     static void builtin_input(VirtualMachine *vm, int argc, int* arg_regs, int result_reg) {
@@ -117,13 +516,8 @@ class VirtualMachine {
 
         Value prompt_value = vm->__current_reg__[arg_regs[0]];
 
-        if (prompt_value.__type__ == VAL_STRING) {
-            std::cout << prompt_value.str;
-            std::cout.flush();
-        } else if (prompt_value.__type__ == VAL_NUMBER) {
-            std::cout << prompt_value.number;
-            std::cout.flush();
-        }
+        write_value(std::cout, prompt_value);
+        std::cout.flush();
 
         std::string line;
         std::getline(std::cin, line);
@@ -149,6 +543,15 @@ class VirtualMachine {
 
         const char* str = arg.str.c_str();
         char* end;
+
+        // 优先按整数解析，装不下或者带小数的再按 double 解析
+        errno = 0;
+        long long inum = strtoll(str, &end, 10);
+        if (end != str && *end == '\0' && errno == 0) {
+            vm->__current_reg__[result_reg] = Value(inum);
+            return;
+        }
+
         double num = strtod(str, &end);
     
         if (end == str || *end != '\0') {
@@ -159,13 +562,365 @@ class VirtualMachine {
         vm->__current_reg__[result_reg] = Value(num);
     }
 
-public:
+    static void builtin_len(VirtualMachine *vm, int argc, int* arg_regs, int result_reg) {
+        if (argc != 1) {
+            std::cerr << "Runtime Error, len expected 1 argument, " << argc << " given." << std::endl;
+            exit(1);
+        }
+
+        Value &arg = vm->__current_reg__[arg_regs[0]];
+        if (arg.__type__ == VAL_ARRAY) {
+            vm->__current_reg__[result_reg] = Value(static_cast<long long>(arg.array->size()));
+        } else if (arg.__type__ == VAL_MAP) {
+            vm->__current_reg__[result_reg] = Value(static_cast<long long>(arg.map->__size__));
+        } else if (arg.__type__ == VAL_STRING) {
+            vm->__current_reg__[result_reg] = Value(static_cast<long long>(arg.str.size()));
+        } else {
+            std::cerr << "Runtime error: len() argument must be an array, a map or a string" << std::endl;
+            exit(1);
+        }
+    }
+
+    static void builtin_push(VirtualMachine *vm, int argc, int* arg_regs, int result_reg) {
+        if (argc < 2) {
+            std::cerr << "Runtime Error, push expected at least 2 arguments, " << argc << " given." << std::endl;
+            exit(1);
+        }
+
+        Value &arr = vm->__current_reg__[arg_regs[0]];
+        if (arr.__type__ != VAL_ARRAY) {
+            std::cerr << "Runtime error: push() first argument must be an array" << std::endl;
+            exit(1);
+        }
+
+        for (int i = 1; i < argc; i++) {
+            arr.array->push(vm->__current_reg__[arg_regs[i]]);
+        }
+        vm->__current_reg__[result_reg] = Value(static_cast<long long>(arr.array->size()));
+    }
+
+    static MapObject* map_argument(VirtualMachine *vm, int argc, int* arg_regs, int expected, const char *name) {
+        if (argc != expected) {
+            std::cerr << "Runtime Error, " << name << " expected " << expected << " arguments, " << argc << " given." << std::endl;
+            exit(1);
+        }
+
+        Value &m = vm->__current_reg__[arg_regs[0]];
+        if (m.__type__ != VAL_MAP) {
+            std::cerr << "Runtime error: " << name << "() first argument must be a map" << std::endl;
+            exit(1);
+        }
+        return m.map;
+    }
+
+    static void builtin_map(VirtualMachine *vm, int argc, int*, int result_reg) {
+        if (argc != 0) {
+            std::cerr << "Runtime Error, map expected 0 argument, " << argc << " given." << std::endl;
+            exit(1);
+        }
+        vm->__current_reg__[result_reg] = Value(new MapObject());
+    }
 
-    VirtualMachine() {
+    static void builtin_has(VirtualMachine *vm, int argc, int* arg_regs, int result_reg) {
+        MapObject *m = map_argument(vm, argc, arg_regs, 2, "has");
+        Value &key = vm->__current_reg__[arg_regs[1]];
+        check_map_key(key, "has()");
+        vm->__current_reg__[result_reg] = Value(m->find(key) >= 0 ? 1LL : 0LL);
+    }
+
+    static void builtin_get(VirtualMachine *vm, int argc, int* arg_regs, int result_reg) {
+        MapObject *m = map_argument(vm, argc, arg_regs, 3, "get");
+        Value &key = vm->__current_reg__[arg_regs[1]];
+        check_map_key(key, "get()");
+        long pos = m->find(key);
+        Value v = (pos >= 0) ? m->__slots__[pos].value : vm->__current_reg__[arg_regs[2]];
+        vm->__current_reg__[result_reg] = v;
+    }
+
+    static void builtin_del(VirtualMachine *vm, int argc, int* arg_regs, int result_reg) {
+        MapObject *m = map_argument(vm, argc, arg_regs, 2, "del");
+        Value &key = vm->__current_reg__[arg_regs[1]];
+        check_map_key(key, "del()");
+        vm->__current_reg__[result_reg] = Value(m->erase(key) ? 1LL : 0LL);
+    }
+
+    // 遍历：let it = map_next(m, -1); while (it >= 0) { ...; it = map_next(m, it); }
+    static void builtin_map_next(VirtualMachine *vm, int argc, int* arg_regs, int result_reg) {
+        MapObject *m = map_argument(vm, argc, arg_regs, 2, "map_next");
+        Value &cursor = vm->__current_reg__[arg_regs[1]];
+        long long c;
+        if (!cursor.as_integer(c)) {
+            std::cerr << "Runtime Error: invalid map cursor in map_next()" << std::endl;
+            exit(1);
+        }
+        long start = c < 0 ? -1 : static_cast<long>(c);
+        vm->__current_reg__[result_reg] = Value(static_cast<long long>(m->next(start)));
+    }
+
+    static void builtin_map_key(VirtualMachine *vm, int argc, int* arg_regs, int result_reg) {
+        MapObject *m = map_argument(vm, argc, arg_regs, 2, "map_key");
+        long i = map_cursor(m, vm->__current_reg__[arg_regs[1]], "map_key()");
+        Value v = m->__slots__[i].key;
+        vm->__current_reg__[result_reg] = v;
+    }
+
+    static void builtin_map_value(VirtualMachine *vm, int argc, int* arg_regs, int result_reg) {
+        MapObject *m = map_argument(vm, argc, arg_regs, 2, "map_value");
+        long i = map_cursor(m, vm->__current_reg__[arg_regs[1]], "map_value()");
+        Value v = m->__slots__[i].value;
+        vm->__current_reg__[result_reg] = v;
+    }
+
+    // 批量数值运算的参数必须是纯数字数组，这样才能直接把紧凑的 double 缓冲区交给 SIMD 内核
+    // 数值内置函数的数组参数，元素必须都是数字
+    // 超出 double 精确范围的整数会让数组留在通用存储中（见 ArrayObject::packable），这样的数组也接受：
+    // 只读的函数用 numbers_of 按 as_double() 转换一份，原地修改的函数先 pack_rounded
+    static ArrayObject* numeric_array(VirtualMachine *vm, int reg, const char *name) {
+        Value &v = vm->__current_reg__[reg];
+        if (v.__type__ != VAL_ARRAY || !(v.array->try_pack() || v.array->all_numeric())) {
+            std::cerr << "Runtime error: " << name << "() expects an array of numbers" << std::endl;
+            exit(1);
+        }
+        return v.array;
+    }
+
+    // 数组中的数字：紧凑存储直接返回，否则转换到 buf 中，数组本身不变
+    static const double *numbers_of(const ArrayObject *a, std::vector<double> &buf) {
+        if (a->__packed__) return a->__num__.data();
+        buf.resize(a->__val__.size());
+        for (size_t i = 0; i < buf.size(); i++) buf[i] = a->__val__[i].as_double();
+        return buf.data();
+    }
+
+    static void check_argc(int argc, int expected, const char *name) {
+        if (argc != expected) {
+            std::cerr << "Runtime Error, " << name << " expected " << expected << " arguments, " << argc << " given." << std::endl;
+            exit(1);
+        }
+    }
+
+    static double number_argument(VirtualMachine *vm, int reg, const char *name) {
+        Value &v = vm->__current_reg__[reg];
+        if (!v.is_numeric()) {
+            std::cerr << "Runtime error: " << name << "() expects a number" << std::endl;
+            exit(1);
+        }
+        return v.as_double();
+    }
+
+    static void builtin_sum(VirtualMachine *vm, int argc, int* arg_regs, int result_reg) {
+        check_argc(argc, 1, "sum");
+        ArrayObject *a = numeric_array(vm, arg_regs[0], "sum");
+        std::vector<double> buf;
+        vm->__current_reg__[result_reg] = Value(simd_kernels().sum(numbers_of(a, buf), a->size()));
+    }
+
+    static void builtin_dot(VirtualMachine *vm, int argc, int* arg_regs, int result_reg) {
+        check_argc(argc, 2, "dot");
+        ArrayObject *a = numeric_array(vm, arg_regs[0], "dot");
+        ArrayObject *b = numeric_array(vm, arg_regs[1], "dot");
+        if (a->size() != b->size()) {
+            std::cerr << "Runtime error: dot() arrays must have the same length" << std::endl;
+            exit(1);
+        }
+        std::vector<double> buf_a, buf_b;
+        vm->__current_reg__[result_reg] = Value(simd_kernels().dot(numbers_of(a, buf_a), numbers_of(b, buf_b), a->size()));
+    }
+
+    static void builtin_min(VirtualMachine *vm, int argc, int* arg_regs, int result_reg) {
+        check_argc(argc, 1, "min");
+        ArrayObject *a = numeric_array(vm, arg_regs[0], "min");
+        if (a->size() == 0) {
+            std::cerr << "Runtime error: min() of an empty array" << std::endl;
+            exit(1);
+        }
+        std::vector<double> buf;
+        vm->__current_reg__[result_reg] = Value(simd_kernels().min(numbers_of(a, buf), a->size()));
+    }
+
+    static void builtin_max(VirtualMachine *vm, int argc, int* arg_regs, int result_reg) {
+        check_argc(argc, 1, "max");
+        ArrayObject *a = numeric_array(vm, arg_regs[0], "max");
+        if (a->size() == 0) {
+            std::cerr << "Runtime error: max() of an empty array" << std::endl;
+            exit(1);
+        }
+        std::vector<double> buf;
+        vm->__current_reg__[result_reg] = Value(simd_kernels().max(numbers_of(a, buf), a->size()));
+    }
+
+    // scale / axpy / prefix_sum 都是原地修改，返回被修改的数组本身
+    static void builtin_scale(VirtualMachine *vm, int argc, int* arg_regs, int result_reg) {
+        check_argc(argc, 2, "scale");
+        ArrayObject *a = numeric_array(vm, arg_regs[0], "scale");
+        double k = number_argument(vm, arg_regs[1], "scale");
+        a->pack_rounded();
+        simd_kernels().scale(a->__num__.data(), a->__num__.size(), k);
+        vm->__current_reg__[result_reg] = Value(a);
+    }
+
+    // axpy(alpha, x, y): y = alpha * x + y
+    static void builtin_axpy(VirtualMachine *vm, int argc, int* arg_regs, int result_reg) {
+        check_argc(argc, 3, "axpy");
+        double alpha = number_argument(vm, arg_regs[0], "axpy");
+        ArrayObject *x = numeric_array(vm, arg_regs[1], "axpy");
+        ArrayObject *y = numeric_array(vm, arg_regs[2], "axpy");
+        if (x->size() != y->size()) {
+            std::cerr << "Runtime error: axpy() arrays must have the same length" << std::endl;
+            exit(1);
+        }
+        y->pack_rounded();
+        std::vector<double> buf;
+        simd_kernels().axpy(alpha, numbers_of(x, buf), y->__num__.data(), y->__num__.size());
+        vm->__current_reg__[result_reg] = Value(y);
+    }
+
+    static void builtin_prefix_sum(VirtualMachine *vm, int argc, int* arg_regs, int result_reg) {
+        check_argc(argc, 1, "prefix_sum");
+        ArrayObject *a = numeric_array(vm, arg_regs[0], "prefix_sum");
+        a->pack_rounded();
+        simd_kernels().prefix_sum(a->__num__.data(), a->__num__.size());
+        vm->__current_reg__[result_reg] = Value(a);
+    }
+
+    static const FuncInfo& parallel_function(VirtualMachine *vm, int reg, size_t arity, const char *name) {
+        Value &v = vm->__current_reg__[reg];
+        const FuncInfo *fn = v.__type__ == VAL_STRING ? vm->find_function(v.str) : nullptr;
+        if (fn == nullptr) {
+            std::cerr << "Runtime error: " << name << "() first argument must be a user defined function" << std::endl;
+            exit(1);
+        }
+        if (fn->param_count != arity) {
+            std::cerr << "Runtime error: " << name << "() function " << fn->name << " must take " << arity << " parameters" << std::endl;
+            exit(1);
+        }
+        return *fn;
+    }
+
+    // 工作线程之间不能共享带引用计数的对象，所以只允许数字和字符串元素
+    static ArrayObject* parallel_array(VirtualMachine *vm, int reg, const char *name) {
+        Value &v = vm->__current_reg__[reg];
+        if (v.__type__ != VAL_ARRAY) {
+            std::cerr << "Runtime error: " << name << "() expects an array" << std::endl;
+            exit(1);
+        }
+        if (!v.array->__packed__) {
+            for (size_t i = 0; i < v.array->__val__.size(); i++) {
+                ValueType t = v.array->__val__[i].__type__;
+                if (t != VAL_NUMBER && t != VAL_INT && t != VAL_STRING) {
+                    std::cerr << "Runtime error: " << name << "() array elements must be numbers or strings" << std::endl;
+                    exit(1);
+                }
+            }
+        }
+        return v.array;
+    }
+
+    // 把 [0, n) 按 PARALLEL_GRAIN 切成固定的分片，再把连续的分片分组交给线程池
+    // 每组使用一个独立的子解释器；子解释器中再调用 pmap 时直接串行执行，避免线程池死锁
+    void parallel_for(size_t n, const std::function<void(VirtualMachine &, size_t, size_t, size_t)> &body) {
+        size_t parts = (n + PARALLEL_GRAIN - 1) / PARALLEL_GRAIN;
+        if (parts <= 1 || __is_child__) {
+            VirtualMachine child(this);
+            for (size_t p = 0; p < parts; p++) {
+                body(child, p, p * PARALLEL_GRAIN, std::min(n, (p + 1) * PARALLEL_GRAIN));
+            }
+            return;
+        }
+
+        if (!__pool__) __pool__ = new ThreadPool(ThreadPool::default_size());
+
+        size_t groups = std::min(parts, __pool__->size() * 4);
+        std::vector<std::function<void()>> tasks;
+        for (size_t g = 0; g < groups; g++) {
+            size_t first = parts * g / groups, last = parts * (g + 1) / groups;
+            tasks.push_back([this, &body, n, first, last]() {
+                VirtualMachine child(this);
+                for (size_t p = first; p < last; p++) {
+                    body(child, p, p * PARALLEL_GRAIN, std::min(n, (p + 1) * PARALLEL_GRAIN));
+                }
+            });
+        }
+        __pool__->run_batch(tasks);
+    }
+
+    // pmap(fn, array): 结果顺序和串行执行完全一致
+    static void builtin_pmap(VirtualMachine *vm, int argc, int* arg_regs, int result_reg) {
+        check_argc(argc, 2, "pmap");
+        const FuncInfo &fn = parallel_function(vm, arg_regs[0], 1, "pmap");
+        const ArrayObject *arr = parallel_array(vm, arg_regs[1], "pmap");
+
+        size_t n = arr->size();
+        std::vector<Value> results(n);
+        vm->parallel_for(n, [&fn, arr, &results](VirtualMachine &child, size_t, size_t begin, size_t end) {
+            std::vector<Value> args(1);
+            for (size_t i = begin; i < end; i++) {
+                args[0] = arr->get(i);
+                results[i] = child.invoke(fn, args);
+            }
+        });
+
+        ArrayObject *out = new ArrayObject();
+        for (size_t i = 0; i < n; i++) out->push(results[i]);
+        vm->__current_reg__[result_reg] = Value(out);
+    }
+
+    // preduce(fn, array, init): 每个分片先从自己的第一个元素开始折叠，再在调用线程上从 init 开始按分片顺序合并
+    // 分片只由数组长度决定，所以结果是确定的；fn 满足结合律时和串行的折叠结果相同
+    static void builtin_preduce(VirtualMachine *vm, int argc, int* arg_regs, int result_reg) {
+        check_argc(argc, 3, "preduce");
+        const FuncInfo &fn = parallel_function(vm, arg_regs[0], 2, "preduce");
+        const ArrayObject *arr = parallel_array(vm, arg_regs[1], "preduce");
+
+        size_t n = arr->size();
+        std::vector<Value> partials((n + PARALLEL_GRAIN - 1) / PARALLEL_GRAIN);
+        vm->parallel_for(n, [&fn, arr, &partials](VirtualMachine &child, size_t part, size_t begin, size_t end) {
+            std::vector<Value> args(2);
+            Value acc = arr->get(begin);
+            for (size_t i = begin + 1; i < end; i++) {
+                args[0] = acc;
+                args[1] = arr->get(i);
+                acc = child.invoke(fn, args);
+            }
+            partials[part] = acc;
+        });
+
+        VirtualMachine child(vm);
+        std::vector<Value> args(2);
+        Value acc = vm->__current_reg__[arg_regs[2]];
+        for (size_t p = 0; p < partials.size(); p++) {
+            args[0] = acc;
+            args[1] = partials[p];
+            acc = child.invoke(fn, args);
+        }
+        vm->__current_reg__[result_reg] = acc;
+    }
+
+    void register_builtins() {
         __builtin_func__["print"] = builtin_print;
         __builtin_func__["input"] = builtin_input;
         __builtin_func__["str2int"] = builtin_str2int; // 一开始我以为 str2int 会被 Lexer 识别为三个 Token，但是后面看看用的是 isalnum 判断就没事了（希望
+        __builtin_func__["len"] = builtin_len;
+        __builtin_func__["push"] = builtin_push;
+        __builtin_func__["map"] = builtin_map;
+        __builtin_func__["has"] = builtin_has;
+        __builtin_func__["get"] = builtin_get;
+        __builtin_func__["del"] = builtin_del;
+        __builtin_func__["map_next"] = builtin_map_next;
+        __builtin_func__["map_key"] = builtin_map_key;
+        __builtin_func__["map_value"] = builtin_map_value;
+        __builtin_func__["sum"] = builtin_sum;
+        __builtin_func__["dot"] = builtin_dot;
+        __builtin_func__["min"] = builtin_min;
+        __builtin_func__["max"] = builtin_max;
+        __builtin_func__["scale"] = builtin_scale;
+        __builtin_func__["axpy"] = builtin_axpy;
+        __builtin_func__["prefix_sum"] = builtin_prefix_sum;
+        __builtin_func__["pmap"] = builtin_pmap;
+        __builtin_func__["preduce"] = builtin_preduce;
+    }
 
+    void init_main_frame() {
         // 我们这里将主函数也看成一个 Call frame
         CallFrame *main_frame = new CallFrame();
         __frame__.push(main_frame);
@@ -175,6 +930,54 @@ public:
         __tmp_counter__ = 0;
     }
 
+    // 自己和祖先 VM 中已经登记的函数。执行 pmap / preduce 时父 VM 阻塞在线程池上，不会同时修改它的函数表
+    const FuncInfo *lookup_function(const std::string &name) const {
+        for (const VirtualMachine *vm = this; vm != nullptr; vm = vm->__parent__) {
+            std::unordered_map<std::string, FuncInfo>::const_iterator it = vm->__user_func__.find(name);
+            if (it != vm->__user_func__.end()) return &it->second;
+        }
+        return nullptr;
+    }
+
+    // 找不到时再编译 --lazy 登记的函数或者查字节码镜像，结果登记在自己的函数表中，之后的调用直接找到
+    // pmap 的子解释器各自编译自己用到的函数，不修改父 VM 的函数表
+    const FuncInfo *find_function(const std::string &name) {
+        const FuncInfo *fn = lookup_function(name);
+        if (fn != nullptr) return fn;
+
+        if (__lazy__ != nullptr) {
+            Func compiled(name, std::vector<std::string>());
+            if (__lazy__->compile_lazy(name, compiled)) {
+                define_function(std::move(compiled));
+                return &__user_func__.find(name)->second;
+            }
+        }
+        if (__image__ == nullptr) return nullptr;
+
+        FuncInfo info;
+        info.name = name;
+        ImageLookup found = __image__->find(name, info.param_count, info.chunk);
+        if (found == IMAGE_MISSING) return nullptr;
+        if (found == IMAGE_INVALID) {
+            std::cerr << "Runtime Error: Corrupted bytecode for function " << name << " in bytecode cache, please delete the cache file" << std::endl;
+            exit(1);
+        }
+        return &(__user_func__[name] = info);
+    }
+
+public:
+
+    VirtualMachine() : __parent__(nullptr), __image__(nullptr), __lazy__(nullptr), __stop_depth__(0), __is_child__(false), __pool__(nullptr), __profile__(nullptr) {
+        register_builtins();
+        init_main_frame();
+    }
+
+    // 子解释器：和父 VM 共享只读的函数表，自己拥有寄存器和调用栈
+    explicit VirtualMachine(const VirtualMachine *parent) : __parent__(parent), __image__(parent->__image__), __lazy__(parent->__lazy__), __stop_depth__(0), __is_child__(true), __pool__(nullptr), __profile__(nullptr) {
+        register_builtins();
+        init_main_frame();
+    }
+
     ~VirtualMachine() {
         CallFrame *frame;
         while (!__frame__.empty()) {
@@ -182,34 +985,167 @@ public:
             __frame__.pop();
             delete frame;
         }
+        delete __pool__;
+    }
+
+    // VM 接管 fn，字节码和常量池直接移动过来，不拷贝
+    void define_function(Func &&fn) {
+        if (__user_func__.count(fn.name)) return;
+        __defined_func__.push_back(std::move(fn));
+        const Func &stored = __defined_func__.back();
+
+        FuncInfo info;
+        info.name = stored.name;
+        info.param_count = stored.params.size();
+        info.chunk = ChunkView(stored.__chunk__);
+        __user_func__.emplace(stored.name, std::move(info));
+    }
+
+    // 直接执行字节码镜像中的函数，image 必须比 VM 活得久
+    void attach_image(const BytecodeImage *image) {
+        __image__ = image;
+    }
+
+    // --lazy：调用到还没有定义的函数时由 compiler 编译，compiler 和它的 AST 必须比 VM 活得久
+    void set_lazy_compiler(const Compiler *compiler) {
+        __lazy__ = compiler;
+    }
+
+    void set_profile(Profile *profile) {
+        __profile__ = profile;
     }
 
-    void define_function(Func &fn) {
-        __user_func__.insert({fn.name, fn});
+    std::vector<std::string> builtin_names() const {
+        std::vector<std::string> names;
+        for (auto &pair : __builtin_func__) names.push_back(pair.first);
+        return names;
     }
 
     void run(const Chunk& main_chunk) {
-        __frame__.top()->caller_chunk = &main_chunk;
+        run(ChunkView(main_chunk));
+    }
+
+    // main_chunk 指向的指令和常量必须在执行期间一直有效
+    void run(const ChunkView& main_chunk) {
+        __main_chunk__ = main_chunk;
+        __frame__.top()->caller_chunk = &__main_chunk__;
 
-        int main_reg_cnt = __frame__.top()->caller_chunk->get_reg_count();
+        int main_reg_cnt = __main_chunk__.reg_count;
         __current_reg__ = __frame__.top()->register_file;
         __current_reg__.resize(main_reg_cnt, Value(0.0));
 
-        __current_chunk__ = &main_chunk;
+        __current_chunk__ = &__main_chunk__;
+        __tmp_counter__ = 0;
+
+        execute();
+    }
+
+    // 直接调用一个用户函数，执行到它返回为止
+    Value invoke(const FuncInfo &fn, const std::vector<Value> &args) {
+        if (fn.param_count != args.size()) {
+            std::cerr << "Runtime Error: Arugment mismatch for function "<< fn.name << ", expected " << fn.param_count << ", " << args.size() << " given" << std::endl;
+            exit(1);
+        }
+
+        __frame__.top()->register_file = __current_reg__;
+
+        CallFrame *frame = new CallFrame(&fn, __tmp_counter__, __current_chunk__, 0);
+        frame->register_file.resize(fn.chunk.reg_count, Value(0.0));
+        for (size_t i = 0; i < args.size(); i++) frame->register_file[i] = args[i];
+        __frame__.push(frame);
+
+        size_t saved_stop = __stop_depth__;
+        __stop_depth__ = __frame__.size();
+
+        __current_reg__ = frame->register_file;
+        __current_chunk__ = &(fn.chunk);
         __tmp_counter__ = 0;
+        __return_value__ = Value(0LL);
 
-        while (__tmp_counter__ < __current_chunk__->__code__.size()) {
-            Instruction inst = __current_chunk__->__code__[__tmp_counter__++];
+        execute();
+
+        // 函数没有 return 就执行到了末尾，把多出来的调用帧都弹掉
+        while (__frame__.size() >= __stop_depth__) {
+            CallFrame *top = __frame__.top();
+            __frame__.pop();
+            __current_reg__ = __frame__.top()->register_file;
+            __current_chunk__ = top->caller_chunk;
+            __tmp_counter__ = top->return_pc;
+            delete top;
+        }
 
+        __stop_depth__ = saved_stop;
+        return __return_value__;
+    }
+
+private:
+
+    // _NUM 指令写结果：目标寄存器原来就是数字的时候直接改写，省掉 Value 的赋值
+    static void store_int(Value &dst, long long v) {
+        if (dst.is_numeric()) {
+            dst.__type__ = VAL_INT;
+            dst.integer = v;
+        } else {
+            dst = Value(v);
+        }
+    }
+
+    static void store_number(Value &dst, double v) {
+        if (dst.is_numeric()) {
+            dst.__type__ = VAL_NUMBER;
+            dst.number = v;
+        } else {
+            dst = Value(v);
+        }
+    }
+
+    // OP_EQUAL 的比较规则
+    static bool values_equal(const Value &l, const Value &r) {
+        if (l.__type__ == VAL_INT && r.__type__ == VAL_INT) {
+            return l.integer == r.integer;
+        } else if (l.is_numeric() && r.is_numeric()) {
+            return l.as_double() == r.as_double();
+        } else if (l.__type__ == VAL_STRING && r.__type__ == VAL_STRING) {
+            return std::strcmp(l.str.c_str(), r.str.c_str()) == 0;
+        } else if (l.__type__ == VAL_ARRAY && r.__type__ == VAL_ARRAY) {
+            return l.array == r.array; // 数组比较的是是否为同一个对象
+        } else if (l.__type__ == VAL_MAP && r.__type__ == VAL_MAP) {
+            return l.map == r.map;
+        }
+        return false;
+    }
+
+    void execute() {
+        while (__tmp_counter__ < __current_chunk__->code_size) {
+            const CompactInst &c = __current_chunk__->code[__tmp_counter__++];
+            Instruction inst(static_cast<Opcode>(c.op), c.arg1, c.arg2, c.result);
+
+        dispatch:
             switch (inst.op) {
+                case OP_WIDE: {
+                    // 很少出现，放在 switch 里，普通指令不用多判断一次；解码出完整的下一条指令再分派
+                    __tmp_counter__--;
+                    inst = decode_inst(__current_chunk__->code, __tmp_counter__);
+                    goto dispatch;
+                }
+
+                case OP_LOAD_INT: {
+                    // 64 位整数直接编码在指令中：arg1 为低 32 位，arg2 为高 32 位
+                    unsigned long long bits = (static_cast<unsigned long long>(static_cast<unsigned int>(inst.arg2)) << 32) |
+                                              static_cast<unsigned int>(inst.arg1);
+                    __current_reg__[inst.result] = Value(static_cast<long long>(bits));
+                    break;
+                }
+
                 case OP_CONSTANT: {
                     if (inst.arg1 >= 0) {
                         // Number Constant
-                        __current_reg__[inst.result] = Value(__current_chunk__->__const_num__[inst.arg1]);
+                        __current_reg__[inst.result] = Value(__current_chunk__->nums[inst.arg1]);
                     } else {
                         // String Constant
-                        int str_idx = ~inst.arg1;
-                        __current_reg__[inst.result] = Value(__current_chunk__->__const_str__[str_idx]);
+                        size_t length;
+                        const char *data = __current_chunk__->str_data(~inst.arg1, length);
+                        __current_reg__[inst.result].set_string(data, length);
                     }
                     break;
                 }
@@ -232,8 +1168,11 @@ public:
                 case OP_ADD: {
                     Value &l = __current_reg__[inst.arg1];
                     Value &r = __current_reg__[inst.arg2];
-                    if (l.__type__ == VAL_NUMBER && r.__type__ == VAL_NUMBER) {
-                        __current_reg__[inst.result] = Value(l.number + r.number);
+                    long long iv;
+                    if (l.__type__ == VAL_INT && r.__type__ == VAL_INT && !int_add_overflow(l.integer, r.integer, &iv)) {
+                        __current_reg__[inst.result] = Value(iv);
+                    } else if (l.is_numeric() && r.is_numeric()) {
+                        __current_reg__[inst.result] = Value(l.as_double() + r.as_double());
                     } else {
                         std::cerr << "Type mismatch in OP_ADD" << std::endl;
                         exit(1);
@@ -244,10 +1183,13 @@ public:
                 case OP_SUB: {
                     Value &l = __current_reg__[inst.arg1];
                     Value &r = __current_reg__[inst.arg2];
-                    if (l.__type__ == VAL_NUMBER && r.__type__ == VAL_NUMBER) {
-                        __current_reg__[inst.result] = Value(l.number - r.number);
+                    long long iv;
+                    if (l.__type__ == VAL_INT && r.__type__ == VAL_INT && !int_sub_overflow(l.integer, r.integer, &iv)) {
+                        __current_reg__[inst.result] = Value(iv);
+                    } else if (l.is_numeric() && r.is_numeric()) {
+                        __current_reg__[inst.result] = Value(l.as_double() - r.as_double());
                     } else {
-                        std::cerr << "Type mismatch in OP_ADD" << std::endl;
+                        std::cerr << "Type mismatch in OP_SUB" << std::endl;
                         exit(1);
                     }
                     break;
@@ -256,54 +1198,55 @@ public:
                 case OP_MUL: {
                     Value &l = __current_reg__[inst.arg1];
                     Value &r = __current_reg__[inst.arg2];
-                    if (l.__type__ == VAL_NUMBER && r.__type__ == VAL_NUMBER) {
-                        __current_reg__[inst.result] = Value(l.number * r.number);
+                    long long iv;
+                    if (l.__type__ == VAL_INT && r.__type__ == VAL_INT && !int_mul_overflow(l.integer, r.integer, &iv)) {
+                        __current_reg__[inst.result] = Value(iv);
+                    } else if (l.is_numeric() && r.is_numeric()) {
+                        __current_reg__[inst.result] = Value(l.as_double() * r.as_double());
                     } else {
-                        std::cerr << "Type mismatch in OP_ADD" << std::endl;
+                        std::cerr << "Type mismatch in OP_MUL" << std::endl;
                         exit(1);
                     }
                     break;
                 }
 
+                // 除法的结果始终是 double，和原来的语义保持一致
                 case OP_DIV: {
                     Value &l = __current_reg__[inst.arg1];
                     Value &r = __current_reg__[inst.arg2];
-                    if (l.__type__ == VAL_NUMBER && r.__type__ == VAL_NUMBER) {
-                        if (r.number == 0) {
+                    if (l.is_numeric() && r.is_numeric()) {
+                        if (r.as_double() == 0) {
                             std::cerr << "Runtime error: divided by zero" << std::endl;
                             exit(1);
                         }
 
-                        __current_reg__[inst.result] = Value(l.number / r.number);
+                        __current_reg__[inst.result] = Value(l.as_double() / r.as_double());
                     } else {
-                        std::cerr << "Type mismatch in OP_ADD" << std::endl;
+                        std::cerr << "Type mismatch in OP_DIV" << std::endl;
                         exit(1);
                     }
                     break;
                 }
 
                 case OP_EQUAL: {
-                    Value &l = __current_reg__[inst.arg1];
-                    Value &r = __current_reg__[inst.arg2];
-                    bool eq;
-                    if (l.__type__ == VAL_NUMBER && r.__type__ == VAL_NUMBER) {
-                        eq = (l.number == r.number);
-                    } else if (l.__type__ == VAL_STRING && r.__type__ == VAL_STRING) {
-                        eq = (std::strcmp(l.str.c_str(), r.str.c_str()) == 0);
-                    } else {
-                        eq = false;
-                    }
-                    __current_reg__[inst.result] = Value(eq ? 1.0 : 0.0);
+                    __current_reg__[inst.result] = Value(values_equal(__current_reg__[inst.arg1], __current_reg__[inst.arg2]) ? 1LL : 0LL);
+                    break;
+                }
+
+                case OP_NOT_EQUAL: {
+                    __current_reg__[inst.result] = Value(values_equal(__current_reg__[inst.arg1], __current_reg__[inst.arg2]) ? 0LL : 1LL);
                     break;
                 }
 
                 case OP_GREATER: {
                     Value &l = __current_reg__[inst.arg1];
                     Value &r = __current_reg__[inst.arg2];
-                    if (l.__type__ == VAL_NUMBER && r.__type__ == VAL_NUMBER) {
-                        __current_reg__[inst.result] = Value(l.number > r.number ? 1.0 : 0.0);
+                    if (l.__type__ == VAL_INT && r.__type__ == VAL_INT) {
+                        __current_reg__[inst.result] = Value(l.integer > r.integer ? 1LL : 0LL);
+                    } else if (l.is_numeric() && r.is_numeric()) {
+                        __current_reg__[inst.result] = Value(l.as_double() > r.as_double() ? 1LL : 0LL);
                     } else {
-                        std::cerr << "Type mismatch in OP_ADD" << std::endl;
+                        std::cerr << "Type mismatch in OP_GREATER" << std::endl;
                         exit(1);
                     }
                     break;
@@ -312,10 +1255,12 @@ public:
                 case OP_LESS: {
                     Value &l = __current_reg__[inst.arg1];
                     Value &r = __current_reg__[inst.arg2];
-                    if (l.__type__ == VAL_NUMBER && r.__type__ == VAL_NUMBER) {
-                        __current_reg__[inst.result] = Value(l.number < r.number ? 1.0 : 0.0);
+                    if (l.__type__ == VAL_INT && r.__type__ == VAL_INT) {
+                        __current_reg__[inst.result] = Value(l.integer < r.integer ? 1LL : 0LL);
+                    } else if (l.is_numeric() && r.is_numeric()) {
+                        __current_reg__[inst.result] = Value(l.as_double() < r.as_double() ? 1LL : 0LL);
                     } else {
-                        std::cerr << "Type mismatch in OP_ADD" << std::endl;
+                        std::cerr << "Type mismatch in OP_LESS" << std::endl;
                         exit(1);
                     }
                     break;
@@ -324,10 +1269,12 @@ public:
                 case OP_GREATER_EQUAL: {
                     Value &l = __current_reg__[inst.arg1];
                     Value &r = __current_reg__[inst.arg2];
-                    if (l.__type__ == VAL_NUMBER && r.__type__ == VAL_NUMBER) {
-                        __current_reg__[inst.result] = Value(l.number >= r.number ? 1.0 : 0.0);
+                    if (l.__type__ == VAL_INT && r.__type__ == VAL_INT) {
+                        __current_reg__[inst.result] = Value(l.integer >= r.integer ? 1LL : 0LL);
+                    } else if (l.is_numeric() && r.is_numeric()) {
+                        __current_reg__[inst.result] = Value(l.as_double() >= r.as_double() ? 1LL : 0LL);
                     } else {
-                        std::cerr << "Type mismatch in OP_ADD" << std::endl;
+                        std::cerr << "Type mismatch in OP_GREATER_EQUAL" << std::endl;
                         exit(1);
                     }
                     break;
@@ -336,10 +1283,12 @@ public:
                 case OP_LESS_EQUAL: {
                     Value &l = __current_reg__[inst.arg1];
                     Value &r = __current_reg__[inst.arg2];
-                    if (l.__type__ == VAL_NUMBER && r.__type__ == VAL_NUMBER) {
-                        __current_reg__[inst.result] = Value(l.number <= r.number ? 1.0 : 0.0);
+                    if (l.__type__ == VAL_INT && r.__type__ == VAL_INT) {
+                        __current_reg__[inst.result] = Value(l.integer <= r.integer ? 1LL : 0LL);
+                    } else if (l.is_numeric() && r.is_numeric()) {
+                        __current_reg__[inst.result] = Value(l.as_double() <= r.as_double() ? 1LL : 0LL);
                     } else {
-                        std::cerr << "Type mismatch in OP_ADD" << std::endl;
+                        std::cerr << "Type mismatch in OP_LESS_EQUAL" << std::endl;
                         exit(1);
                     }
                     break;
@@ -347,10 +1296,12 @@ public:
 
                 case OP_NOT: {
                     Value &v = __current_reg__[inst.arg1];
-                    if (v.__type__ == VAL_NUMBER) {
-                        __current_reg__[inst.result] = Value((v.number == 0.0) ? 1.0 : 0.0);
+                    if (v.__type__ == VAL_INT) {
+                        __current_reg__[inst.result] = Value(v.integer == 0 ? 1LL : 0LL);
+                    } else if (v.__type__ == VAL_NUMBER) {
+                        __current_reg__[inst.result] = Value((v.number == 0.0) ? 1LL : 0LL);
                     } else {
-                        __current_reg__[inst.result] = Value(0.0);
+                        __current_reg__[inst.result] = Value(0LL);
                     }
                     break;
                 }
@@ -362,7 +1313,9 @@ public:
 
                 case OP_JUMP_IF_FALSE: {
                     Value &cond = __current_reg__[inst.arg1];
-                    bool is_false = (cond.__type__ == VAL_NUMBER && cond.number == 0.0);
+                    bool is_false = (cond.__type__ == VAL_INT && cond.integer == 0) ||
+                                    (cond.__type__ == VAL_NUMBER && cond.number == 0.0);
+                    if (__profile__ && inst.arg2) __profile__->record_branch(inst.arg2, !is_false);
                     
                     if (is_false) {
                         __tmp_counter__ = static_cast<int> (inst.result);
@@ -371,6 +1324,132 @@ public:
                     break;
                 }
 
+                case OP_JUMP_IF_TRUE: {
+                    Value &cond = __current_reg__[inst.arg1];
+                    bool is_false = (cond.__type__ == VAL_INT && cond.integer == 0) ||
+                                    (cond.__type__ == VAL_NUMBER && cond.number == 0.0);
+                    if (__profile__ && inst.arg2) __profile__->record_branch(inst.arg2, !is_false);
+
+                    if (!is_false) {
+                        __tmp_counter__ = static_cast<int> (inst.result);
+                    }
+
+                    break;
+                }
+
+                // 计数循环的 "自增 + 比较 + 跳转"，语义和 OP_ADD 加上比较指令完全一致
+                case OP_FORLOOP: {
+                    Value &counter = __current_reg__[inst.arg1];
+                    const Value &limit = __current_reg__[inst.arg1 + 1];
+                    const Value &step = __current_reg__[inst.arg1 + 2];
+
+                    long long iv;
+                    if (counter.__type__ == VAL_INT && step.__type__ == VAL_INT && !int_add_overflow(counter.integer, step.integer, &iv)) {
+                        counter.integer = iv;
+                    } else if (counter.is_numeric() && step.is_numeric()) {
+                        counter = Value(counter.as_double() + step.as_double());
+                    } else {
+                        std::cerr << "Type mismatch in OP_FORLOOP" << std::endl;
+                        exit(1);
+                    }
+
+                    if (!limit.is_numeric()) {
+                        std::cerr << "Type mismatch in OP_FORLOOP" << std::endl;
+                        exit(1);
+                    }
+
+                    bool again;
+                    if (counter.__type__ == VAL_INT && limit.__type__ == VAL_INT) {
+                        long long a = counter.integer, b = limit.integer;
+                        again = inst.arg2 == OP_LESS ? a < b : inst.arg2 == OP_LESS_EQUAL ? a <= b : inst.arg2 == OP_GREATER ? a > b : a >= b;
+                    } else {
+                        double a = counter.as_double(), b = limit.as_double();
+                        again = inst.arg2 == OP_LESS ? a < b : inst.arg2 == OP_LESS_EQUAL ? a <= b : inst.arg2 == OP_GREATER ? a > b : a >= b;
+                    }
+                    if (again) __tmp_counter__ = static_cast<int> (inst.result);
+                    break;
+                }
+
+                // 类型推导已经证明操作数都是数字，下面这些指令不再检查类型
+                case OP_ADD_NUM: {
+                    const Value &l = __current_reg__[inst.arg1];
+                    const Value &r = __current_reg__[inst.arg2];
+                    long long iv;
+                    if (l.__type__ == VAL_INT && r.__type__ == VAL_INT && !int_add_overflow(l.integer, r.integer, &iv)) {
+                        store_int(__current_reg__[inst.result], iv);
+                    } else {
+                        store_number(__current_reg__[inst.result], l.as_double() + r.as_double());
+                    }
+                    break;
+                }
+
+                case OP_SUB_NUM: {
+                    const Value &l = __current_reg__[inst.arg1];
+                    const Value &r = __current_reg__[inst.arg2];
+                    long long iv;
+                    if (l.__type__ == VAL_INT && r.__type__ == VAL_INT && !int_sub_overflow(l.integer, r.integer, &iv)) {
+                        store_int(__current_reg__[inst.result], iv);
+                    } else {
+                        store_number(__current_reg__[inst.result], l.as_double() - r.as_double());
+                    }
+                    break;
+                }
+
+                case OP_MUL_NUM: {
+                    const Value &l = __current_reg__[inst.arg1];
+                    const Value &r = __current_reg__[inst.arg2];
+                    long long iv;
+                    if (l.__type__ == VAL_INT && r.__type__ == VAL_INT && !int_mul_overflow(l.integer, r.integer, &iv)) {
+                        store_int(__current_reg__[inst.result], iv);
+                    } else {
+                        store_number(__current_reg__[inst.result], l.as_double() * r.as_double());
+                    }
+                    break;
+                }
+
+                case OP_DIV_NUM: {
+                    const Value &l = __current_reg__[inst.arg1];
+                    const Value &r = __current_reg__[inst.arg2];
+                    if (r.as_double() == 0) {
+                        std::cerr << "Runtime error: divided by zero" << std::endl;
+                        exit(1);
+                    }
+                    store_number(__current_reg__[inst.result], l.as_double() / r.as_double());
+                    break;
+                }
+
+                case OP_GREATER_NUM: {
+                    const Value &l = __current_reg__[inst.arg1];
+                    const Value &r = __current_reg__[inst.arg2];
+                    bool b = (l.__type__ == VAL_INT && r.__type__ == VAL_INT) ? l.integer > r.integer : l.as_double() > r.as_double();
+                    store_int(__current_reg__[inst.result], b ? 1LL : 0LL);
+                    break;
+                }
+
+                case OP_LESS_NUM: {
+                    const Value &l = __current_reg__[inst.arg1];
+                    const Value &r = __current_reg__[inst.arg2];
+                    bool b = (l.__type__ == VAL_INT && r.__type__ == VAL_INT) ? l.integer < r.integer : l.as_double() < r.as_double();
+                    store_int(__current_reg__[inst.result], b ? 1LL : 0LL);
+                    break;
+                }
+
+                case OP_GREATER_EQUAL_NUM: {
+                    const Value &l = __current_reg__[inst.arg1];
+                    const Value &r = __current_reg__[inst.arg2];
+                    bool b = (l.__type__ == VAL_INT && r.__type__ == VAL_INT) ? l.integer >= r.integer : l.as_double() >= r.as_double();
+                    store_int(__current_reg__[inst.result], b ? 1LL : 0LL);
+                    break;
+                }
+
+                case OP_LESS_EQUAL_NUM: {
+                    const Value &l = __current_reg__[inst.arg1];
+                    const Value &r = __current_reg__[inst.arg2];
+                    bool b = (l.__type__ == VAL_INT && r.__type__ == VAL_INT) ? l.integer <= r.integer : l.as_double() <= r.as_double();
+                    store_int(__current_reg__[inst.result], b ? 1LL : 0LL);
+                    break;
+                }
+
                 // 最麻烦的来了
                 case OP_CALL: {
                     Value &fn_val = __current_reg__[inst.arg1];
@@ -399,20 +1478,21 @@ public:
 
                     // 再判断是否为 User Defined Function
 
-                    auto user_def_it = __user_func__.find(fn_name);
-                    if (user_def_it != __user_func__.end()) {
-                        const Func &fn = user_def_it->second;
+                    const FuncInfo *user_fn = find_function(fn_name);
+                    if (user_fn != nullptr) {
+                        const FuncInfo &fn = *user_fn;
+                        if (__profile__) __profile__->record_call(fn.name);
 
-                        if (static_cast<int> (fn.params.size()) != arg_count) {
-                            std::cerr << "Runtime Error: Arugment mismatch for function "<< fn.name << ", expected " << fn.params.size() << ", " << arg_count << " given" << std::endl;
+                        if (static_cast<int> (fn.param_count) != arg_count) {
+                            std::cerr << "Runtime Error: Arugment mismatch for function "<< fn.name << ", expected " << fn.param_count << ", " << arg_count << " given" << std::endl;
                             exit(1);
                         }
 
                         size_t return_pc = __tmp_counter__;
-                        const Chunk* caller_chunk = __current_chunk__;
+                        const ChunkView* caller_chunk = __current_chunk__;
 
                         CallFrame *frame = new CallFrame(&fn, return_pc, caller_chunk, result_reg);
-                        frame->register_file.resize(fn.__chunk__.get_reg_count(), Value(0.0));
+                        frame->register_file.resize(fn.chunk.reg_count, Value(0.0));
                         for (int i = 0; i < arg_count; i++) {
                             frame->register_file[i] = __current_reg__[i + (result_reg - arg_count)];
                         }
@@ -422,7 +1502,7 @@ public:
                         __frame__.push(frame);
 
                         __current_reg__ = __frame__.top()->register_file;
-                        __current_chunk__ = &(fn.__chunk__);
+                        __current_chunk__ = &(fn.chunk);
                         __tmp_counter__ = 0;
 
                         continue;
@@ -450,10 +1530,85 @@ public:
                     __current_reg__ = __frame__.top()->register_file;
                     __current_chunk__ = frame->caller_chunk;
                     __tmp_counter__ = frame->return_pc;
+                    delete frame;
+
+                    // invoke 调用的函数返回了，把返回值交给 invoke
+                    if (__frame__.size() < __stop_depth__) {
+                        __return_value__ = ret_val;
+                        return;
+                    }
 
                     __current_reg__[return_reg] = ret_val;
+                    break;
+                }
 
-                    delete frame;
+                case OP_NEW_ARRAY: {
+                    ArrayObject *arr = new ArrayObject();
+                    bool packed = true;
+                    for (int i = 0; i < inst.arg2; i++) {
+                        if (!ArrayObject::packable(__current_reg__[inst.arg1 + i])) packed = false;
+                    }
+
+                    if (packed) {
+                        arr->__num__.resize(inst.arg2);
+                        for (int i = 0; i < inst.arg2; i++) arr->__num__[i] = __current_reg__[inst.arg1 + i].as_double();
+                    } else {
+                        arr->__packed__ = false;
+                        arr->__val__.assign(__current_reg__.begin() + inst.arg1, __current_reg__.begin() + inst.arg1 + inst.arg2);
+                    }
+
+                    __current_reg__[inst.result] = Value(arr);
+                    break;
+                }
+
+                case OP_GET_INDEX: {
+                    Value &obj = __current_reg__[inst.arg1];
+                    if (obj.__type__ == VAL_MAP) {
+                        Value &key = __current_reg__[inst.arg2];
+                        check_map_key(key, "OP_GET_INDEX");
+                        long pos = obj.map->find(key);
+                        if (pos < 0) {
+                            std::cerr << "Runtime Error: key ";
+                            write_value(std::cerr, key);
+                            std::cerr << " not found in map at instruction " << __tmp_counter__ << std::endl;
+                            exit(1);
+                        }
+                        Value v = obj.map->__slots__[pos].value;
+                        __current_reg__[inst.result] = v;
+                        break;
+                    }
+
+                    if (obj.__type__ != VAL_ARRAY) {
+                        std::cerr << "Runtime Error: only arrays and maps can be indexed at instruction " << __tmp_counter__ << std::endl;
+                        exit(1);
+                    }
+
+                    size_t i = array_index(obj.array, __current_reg__[inst.arg2], "OP_GET_INDEX");
+                    if (obj.array->__packed__) {
+                        __current_reg__[inst.result] = Value(obj.array->__num__[i]);
+                    } else {
+                        Value v = obj.array->__val__[i]; // 目标寄存器可能就是数组本身，先拷贝出来
+                        __current_reg__[inst.result] = v;
+                    }
+                    break;
+                }
+
+                case OP_SET_INDEX: {
+                    Value &obj = __current_reg__[inst.arg1];
+                    if (obj.__type__ == VAL_MAP) {
+                        Value &key = __current_reg__[inst.arg2];
+                        check_map_key(key, "OP_SET_INDEX");
+                        obj.map->set(key, __current_reg__[inst.result]);
+                        break;
+                    }
+
+                    if (obj.__type__ != VAL_ARRAY) {
+                        std::cerr << "Runtime Error: only arrays and maps can be indexed at instruction " << __tmp_counter__ << std::endl;
+                        exit(1);
+                    }
+
+                    size_t i = array_index(obj.array, __current_reg__[inst.arg2], "OP_SET_INDEX");
+                    obj.array->set(i, __current_reg__[inst.result]);
                     break;
                 }
 